@@ -0,0 +1,89 @@
+#include <stdint.h>
+
+/*
+ * binary protocol. a client that sends a single BIN_HELLO byte before its
+ * user name (the name prompt still comes first, as text) switches its
+ * connection to length prefixed frames, both ways, for good:
+ *
+ *   request:   u32 length of the rest, u8 opcode, then fields, each a u16
+ *              length and that many bytes
+ *   response:  u32 length of the rest, u8 opcode (the request's), u8 status,
+ *              then the payload
+ *
+ * all integers are little endian. a user is sent as "u32 id, u8 name
+ * length, name"; the payloads that aren't empty are:
+ *
+ *   BIN_LOGIN         u32 id, u8 1 if the user was just created
+ *   BIN_LIST_USERS    u32 count, then count users
+ *   BIN_PROFILE       the user, u32 friend count, the friends, then posts
+ *   BIN_POSTS         posts
+ *   BIN_FEED          u32 count, then the posts (newest first) as i64 date,
+ *                     u32 author id, u32 id of the wall's owner, u32 body
+ *                     length, body
+ *   BIN_SEARCH        as BIN_FEED
+ *   BIN_MUTUAL        u32 count, then count users
+ *   BIN_SUGGEST       u32 count, then count times a user and a u32 count of
+ *                     friends in common
+ *   BIN_DISTANCE      u32 number of friendships between the two users
+ *   BIN_PATH          u32 count, then the users on the path, first to last
+ *
+ * where posts are a u32 count, the posts (newest first) as i64 date, u32
+ * author id, u32 body length, body, and a u32 cursor for the next page (0
+ * when the oldest post was sent).
+ */
+#define BIN_HELLO 0x00
+#define BIN_HEADER_SIZE 6 // of a response
+#define BIN_MAX_FIELDS 4
+
+// opcodes, and the fields their requests carry
+enum {
+    BIN_LOGIN = 1, // name
+    BIN_LIST_USERS,
+    BIN_MAKE_FRIENDS, // name
+    BIN_POST, // target name, body
+    BIN_PROFILE, // name, then optionally u32 limit and u32 cursor
+    BIN_PING,
+    BIN_QUIT,
+    BIN_POSTS, // name, then optionally u32 limit and u32 cursor
+    BIN_FEED, // optionally u32 limit
+    BIN_MUTUAL, // name
+    BIN_SUGGEST, // optionally u32 k
+    BIN_DISTANCE, // name, name
+    BIN_PATH, // name, name
+    BIN_SEARCH // query text, then optionally u32 limit
+};
+
+// statuses
+enum {
+    BIN_OK,
+    BIN_NOT_FOUND, // the user named doesn't exist
+    BIN_ALREADY_FRIENDS,
+    BIN_SELF, // can't friend yourself
+    BIN_NOT_FRIENDS, // can only post to friends
+    BIN_BAD_REQUEST, // unknown opcode or wrong fields
+    BIN_NOT_LOGGED_IN,
+    BIN_NO_PATH, // the users aren't connected
+    BIN_TOO_FAR, // the search for a path gave up
+    BIN_NOT_READY // search is still indexing a loaded store
+};
+
+static inline void bin_put_u16(char *at, uint16_t value) {
+    at[0] = value;
+    at[1] = value >> 8;
+}
+
+static inline void bin_put_u32(char *at, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        at[i] = value >> (8 * i);
+    }
+}
+
+static inline uint16_t bin_get_u16(const char *at) {
+    const unsigned char *bytes = (const unsigned char *)at;
+    return bytes[0] | bytes[1] << 8;
+}
+
+static inline uint32_t bin_get_u32(const char *at) {
+    const unsigned char *bytes = (const unsigned char *)at;
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
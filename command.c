@@ -0,0 +1,160 @@
+#include "command.h"
+#include <string.h>
+
+
+/*
+ * commands are parsed in one pass over the line, in place: the words are
+ * cut out as slices of the line (with a null terminator written after
+ * each), so nothing is copied, and nothing is kept between calls, so any
+ * number of threads can parse their own lines at once. the command name is
+ * looked up with a perfect hash of its length and its first and last
+ * characters
+ */
+#define CMD_HASH(len, first, last) (((first) * 7 + (last) * 6 + (len) * 5) & 31)
+
+static const char *command_names[NUM_COMMANDS] = {
+    [CMD_NONE] = "",
+    [CMD_INVALID] = "",
+    [CMD_QUIT] = "quit",
+    [CMD_LIST_USERS] = "list_users",
+    [CMD_MAKE_FRIENDS] = "make_friends",
+    [CMD_POST] = "post",
+    [CMD_PROFILE] = "profile",
+    [CMD_POSTS] = "posts",
+    [CMD_FEED] = "feed",
+    [CMD_MUTUAL] = "mutual",
+    [CMD_SUGGEST] = "suggest",
+    [CMD_DISTANCE] = "distance",
+    [CMD_PATH] = "path",
+    [CMD_SEARCH] = "search",
+    [CMD_MEMORY] = "memory",
+    [CMD_CACHE] = "cache",
+    [CMD_SNAPSHOT] = "snapshot",
+    [CMD_STATS] = "stats",
+    [CMD_PING] = "ping"
+};
+
+
+static int is_delim(char c) {
+    return c == ' ' || c == '\n';
+}
+
+
+/*
+ * find the command with the given name (len bytes, not null terminated)
+ *
+ * return its id, or CMD_INVALID if there is no such command
+ */
+CommandId command_lookup(const char *name, size_t len) {
+    if (len < 4 || len > 12) {
+        return CMD_INVALID;
+    }
+    // the compiler rejects a switch with two equal cases, so a new command
+    // that breaks the hash won't build
+    CommandId id;
+    switch (CMD_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1])) {
+    case CMD_HASH(4, 'q', 't'): id = CMD_QUIT; break;
+    case CMD_HASH(10, 'l', 's'): id = CMD_LIST_USERS; break;
+    case CMD_HASH(12, 'm', 's'): id = CMD_MAKE_FRIENDS; break;
+    case CMD_HASH(4, 'p', 't'): id = CMD_POST; break;
+    case CMD_HASH(7, 'p', 'e'): id = CMD_PROFILE; break;
+    case CMD_HASH(5, 'p', 's'): id = CMD_POSTS; break;
+    case CMD_HASH(4, 'f', 'd'): id = CMD_FEED; break;
+    case CMD_HASH(6, 'm', 'l'): id = CMD_MUTUAL; break;
+    case CMD_HASH(7, 's', 't'): id = CMD_SUGGEST; break;
+    case CMD_HASH(8, 'd', 'e'): id = CMD_DISTANCE; break;
+    case CMD_HASH(4, 'p', 'h'): id = CMD_PATH; break;
+    case CMD_HASH(6, 's', 'h'): id = CMD_SEARCH; break;
+    case CMD_HASH(6, 'm', 'y'): id = CMD_MEMORY; break;
+    case CMD_HASH(5, 'c', 'e'): id = CMD_CACHE; break;
+    case CMD_HASH(8, 's', 't'): id = CMD_SNAPSHOT; break;
+    case CMD_HASH(5, 's', 's'): id = CMD_STATS; break;
+    case CMD_HASH(4, 'p', 'g'): id = CMD_PING; break;
+    default: return CMD_INVALID;
+    }
+    // the hash only tells the commands apart, anything else can land on one
+    if (strlen(command_names[id]) != len || memcmp(command_names[id], name, len) != 0) {
+        return CMD_INVALID;
+    }
+    return id;
+}
+
+
+/*
+ * return the name of a command ("" for CMD_NONE and CMD_INVALID)
+ */
+const char *command_name(CommandId id) {
+    return command_names[id];
+}
+
+
+/*
+ * split the len byte line (which must be followed by a writable byte, its
+ * null terminator) into a command and its arguments, checking them
+ * against the front end's specs (indexed by command id) as it goes
+ *
+ * return (and store in cmd->id):
+ *   - CMD_NONE if the line is empty.
+ *   - CMD_INVALID if it isn't a command in specs, or has the wrong arguments.
+ *   - the command's id otherwise, with its arguments in cmd.
+ */
+CommandId parse_command(char *line, size_t len, const CommandSpec *specs, Command *cmd) {
+    char *at = line;
+    char *end = line + len;
+    cmd->argc = 0;
+    cmd->rest.data = end;
+    cmd->rest.len = 0;
+
+    while (at < end && is_delim(*at)) {
+        at++;
+    }
+    if (at == end) {
+        return cmd->id = CMD_NONE;
+    }
+    char *name = at;
+    while (at < end && !is_delim(*at)) {
+        at++;
+    }
+    CommandId id = command_lookup(name, at - name);
+    if (id == CMD_INVALID || !specs[id].allowed) {
+        return cmd->id = CMD_INVALID;
+    }
+    const CommandSpec *spec = &specs[id];
+
+    while (1) {
+        while (at < end && is_delim(*at)) {
+            at++;
+        }
+        if (at == end) {
+            break;
+        }
+        if (spec->rest && cmd->argc == spec->max_args) {
+            // everything left is one argument, spaces and all
+            while (is_delim(end[-1])) {
+                end--;
+            }
+            *end = '\0';
+            cmd->rest.data = at;
+            cmd->rest.len = end - at;
+            break;
+        }
+        if (cmd->argc == spec->max_args) {
+            return cmd->id = CMD_INVALID;
+        }
+        Slice *arg = &cmd->argv[cmd->argc++];
+        arg->data = at;
+        while (at < end && !is_delim(*at)) {
+            at++;
+        }
+        arg->len = at - arg->data;
+        *at = '\0';
+        if (at < end) {
+            at++;
+        }
+    }
+
+    if (cmd->argc < spec->min_args || (spec->rest && cmd->rest.len == 0)) {
+        return cmd->id = CMD_INVALID;
+    }
+    return cmd->id = id;
+}
@@ -0,0 +1,62 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#define CMD_MAX_ARGS 3 // words a command takes after its name, at most
+
+// every command either front end knows
+typedef enum command_id {
+    CMD_NONE, // an empty line
+    CMD_INVALID, // an unknown command, or the wrong arguments for one
+    CMD_QUIT,
+    CMD_LIST_USERS,
+    CMD_MAKE_FRIENDS,
+    CMD_POST,
+    CMD_PROFILE,
+    CMD_POSTS,
+    CMD_FEED,
+    CMD_MUTUAL,
+    CMD_SUGGEST,
+    CMD_DISTANCE,
+    CMD_PATH,
+    CMD_SEARCH,
+    CMD_MEMORY,
+    CMD_CACHE,
+    CMD_SNAPSHOT,
+    CMD_STATS,
+    CMD_PING,
+    NUM_COMMANDS
+} CommandId;
+
+// a piece of the line a command was parsed from. the parser ends every
+// argument with a null terminator in place, so data is also a C string
+typedef struct slice {
+    char *data;
+    size_t len;
+} Slice;
+
+// the arguments a front end accepts for a command: between min_args and
+// max_args words, then (if rest is set) the rest of the line, which must
+// not be empty. commands a front end doesn't have are left all zero
+typedef struct command_spec {
+    int allowed;
+    int min_args;
+    int max_args;
+    int rest;
+} CommandSpec;
+
+typedef struct command {
+    CommandId id;
+    int argc;
+    Slice argv[CMD_MAX_ARGS];
+    Slice rest; // the rest of the line, trailing spaces cut off
+} Command;
+
+CommandId parse_command(char *line, size_t len, const CommandSpec *specs, Command *cmd);
+
+CommandId command_lookup(const char *name, size_t len);
+
+const char *command_name(CommandId id);
+
+#endif
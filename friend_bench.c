@@ -0,0 +1,712 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "binary.h"
+
+#ifndef PORT
+  #define PORT 53232
+#endif
+#define READ_SIZE 65536
+#define MAX_EVENTS 256
+#define MAX_CMD 160
+#define MAX_NAME_FIELD 32
+#define HIST_BUCKETS 1024
+#define PONG "\npong\n"
+#define PROMPT_LEN 24 // "What is your user name?\n", sent before the binary protocol starts
+
+// load generator for friend_server: opens many connections, logs each in
+// as its own user (bench0, bench1, ...), and sends a mix of list_users,
+// make_friends, post and profile for a fixed time. requests arrive open
+// loop (-r, poisson arrivals at a fixed total rate, each on a random
+// connection, whether or not earlier replies came back) or closed loop
+// (-r 0, every connection sends its next request as soon as the last one
+// is answered). latency is measured from when a request was due, so a
+// stalled server can't hide its queueing delay.
+//
+// every request is followed by a ping, and its reply ends at the pong, so
+// commands with empty replies can be timed too. with -b the connections
+// use the binary protocol instead, where every reply is one frame.
+
+enum { CMD_LIST_USERS, CMD_MAKE_FRIENDS, CMD_POST, CMD_PROFILE, NUM_CMDS };
+
+static const char *cmd_names[NUM_CMDS] = {"list_users", "make_friends", "post", "profile"};
+
+// settings shared by every thread
+typedef struct bench {
+    const char *host;
+    int port;
+    int seconds;
+    int num_conns;
+    int num_threads;
+    double rate; // requests per second over all connections, 0 for closed loop
+    int weights[NUM_CMDS]; // relative frequency of each command
+    int total_weight;
+    int seed_posts; // posts every user writes on a friend's wall before the run
+    int binary; // speak the binary protocol
+    pthread_barrier_t logged_in;
+} Bench;
+
+// latency histogram in nanoseconds: 16 linear sub-buckets per power of
+// two, so every recorded value is within about 6% of its bucket
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+// one connection: its socket, the due times of the requests it has in
+// flight (oldest first), and output the socket couldn't take yet
+typedef struct conn {
+    int fd;
+    int id;
+    uint64_t *due;
+    int due_head;
+    int due_count;
+    int due_cap;
+    int pong_state; // bytes of PONG matched so far
+    int prompt_left; // binary: bytes of the text name prompt still to skip
+    int len_have; // binary: bytes of the next frame's length prefix seen
+    char len_buf[4];
+    uint32_t frame_left; // binary: bytes of the current frame still to come
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+} Conn;
+
+// one thread, the connections it owns, and its results
+typedef struct worker {
+    pthread_t thread;
+    Bench *bench;
+    Conn *conns;
+    int num_conns;
+    uint64_t rng;
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t by_cmd[NUM_CMDS];
+    Histogram latency;
+} Worker;
+
+// monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, one state per thread
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// uniform double in (0, 1]
+double random_unit(uint64_t *state) {
+    return ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+int hist_index(uint64_t value) {
+    if (value < 16) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+// the smallest value that lands in the bucket
+uint64_t hist_value(int index) {
+    if (index < 16) {
+        return index;
+    }
+    int msb = index / 16 + 3;
+    return (uint64_t)(16 + index % 16) << (msb - 4);
+}
+
+void hist_record(Histogram *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// the value at the given quantile (0..1), 0 if nothing was recorded
+uint64_t hist_quantile(const Histogram *hist, double quantile) {
+    uint64_t rank = ceil(quantile * hist->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank && seen > 0) {
+            // the middle of the bucket, but never past the largest value seen
+            uint64_t mid = (hist_value(i) + hist_value(i + 1)) / 2;
+            return mid < hist->max ? mid : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// feeds received bytes through the pong matcher
+// returns how many pongs (finished requests) they contained
+int count_pongs(Conn *conn, const char *buf, int len) {
+    int found = 0;
+    int state = conn->pong_state;
+    for (int i = 0; i < len; i++) {
+        if (buf[i] == PONG[state]) {
+            state++;
+            if (state == (int)strlen(PONG)) {
+                found++;
+                state = 1; // the closing newline opens the next match
+            }
+        } else {
+            state = buf[i] == '\n' ? 1 : 0;
+        }
+    }
+    conn->pong_state = state;
+    return found;
+}
+
+// feeds received bytes through the binary frame splitter
+// returns how many frames (finished requests) they completed
+int count_frames(Conn *conn, const char *buf, int len) {
+    int found = 0;
+    int i = 0;
+    while (i < len) {
+        if (conn->prompt_left > 0) {
+            int skip = len - i < conn->prompt_left ? len - i : conn->prompt_left;
+            conn->prompt_left -= skip;
+            i += skip;
+        } else if (conn->frame_left > 0) {
+            uint32_t skip = (uint32_t)(len - i) < conn->frame_left ? (uint32_t)(len - i) : conn->frame_left;
+            conn->frame_left -= skip;
+            i += skip;
+            found += conn->frame_left == 0;
+        } else {
+            conn->len_buf[conn->len_have++] = buf[i++];
+            if (conn->len_have == 4) {
+                conn->frame_left = bin_get_u32(conn->len_buf);
+                conn->len_have = 0;
+            }
+        }
+    }
+    return found;
+}
+
+int count_replies(const Bench *bench, Conn *conn, const char *buf, int len) {
+    return bench->binary ? count_frames(conn, buf, len) : count_pongs(conn, buf, len);
+}
+
+// blocks until the connection has seen the given number of replies
+// exits if the server closes it
+void wait_replies(const Bench *bench, Conn *conn, int count) {
+    char buf[READ_SIZE];
+    while (count > 0) {
+        int nbytes = read(conn->fd, buf, sizeof(buf));
+        if (nbytes <= 0) {
+            fprintf(stderr, "bench: server closed connection\n");
+            exit(1);
+        }
+        count -= count_replies(bench, conn, buf, nbytes);
+    }
+}
+
+// writes all of buf, blocking
+void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t nbytes = write(fd, buf, len);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bench: write");
+            exit(1);
+        }
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+// connects and logs in as bench<id>, waiting for the welcome
+void connect_conn(const Bench *bench, Conn *conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        perror("bench: socket");
+        exit(1);
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(bench->port);
+    if (inet_pton(AF_INET, bench->host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bench: bad address %s\n", bench->host);
+        exit(1);
+    }
+    if (connect(conn->fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        perror("bench: connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char login[64];
+    int len;
+    if (bench->binary) {
+        // the hello byte, then a login frame with the name as its field
+        char name[MAX_NAME_FIELD];
+        int name_len = snprintf(name, sizeof(name), "bench%d", conn->id);
+        login[0] = BIN_HELLO;
+        bin_put_u32(login + 1, 3 + name_len);
+        login[5] = BIN_LOGIN;
+        bin_put_u16(login + 6, name_len);
+        memcpy(login + 8, name, name_len);
+        len = 8 + name_len;
+        conn->prompt_left = PROMPT_LEN;
+    } else {
+        len = snprintf(login, sizeof(login), "bench%d\r\nping\r\n", conn->id);
+    }
+    write_all(conn->fd, login, len);
+    wait_replies(bench, conn, 1);
+}
+
+// formats a command with up to two arguments (NULL if absent): a line
+// followed by a ping, or a binary frame
+// returns its length
+int build_request(const Bench *bench, char *cmd, int which, const char *arg1, const char *arg2) {
+    if (!bench->binary) {
+        return snprintf(cmd, MAX_CMD, "%s%s%s%s%s\r\nping\r\n", cmd_names[which],
+                        arg1 != NULL ? " " : "", arg1 != NULL ? arg1 : "",
+                        arg2 != NULL ? " " : "", arg2 != NULL ? arg2 : "");
+    }
+    static const int opcodes[NUM_CMDS] = {BIN_LIST_USERS, BIN_MAKE_FRIENDS, BIN_POST, BIN_PROFILE};
+    const char *args[2] = {arg1, arg2};
+    int len = 5;
+    cmd[4] = opcodes[which];
+    for (int i = 0; i < 2 && args[i] != NULL; i++) {
+        int arg_len = strlen(args[i]);
+        bin_put_u16(cmd + len, arg_len);
+        memcpy(cmd + len + 2, args[i], arg_len);
+        len += 2 + arg_len;
+    }
+    bin_put_u32(cmd, len - 4);
+    return len;
+}
+
+// formats a random command for the connection
+// returns its length, and sets *which to the kind of command
+int format_command(Worker *worker, Conn *conn, char *cmd, int *which) {
+    const Bench *bench = worker->bench;
+    int pick = next_random(&worker->rng) % bench->total_weight;
+    *which = 0;
+    while (pick >= bench->weights[*which]) {
+        pick -= bench->weights[*which];
+        (*which)++;
+    }
+    char name[MAX_NAME_FIELD];
+    char body[MAX_CMD / 2];
+    switch (*which) {
+        case CMD_LIST_USERS:
+            return build_request(bench, cmd, *which, NULL, NULL);
+        case CMD_POST:
+            // the next user is always a friend (see seed_friends)
+            snprintf(name, sizeof(name), "bench%d", (conn->id + 1) % bench->num_conns);
+            snprintf(body, sizeof(body), "load post %lu from bench%d with some filler text",
+                     (unsigned long)worker->sent, conn->id);
+            return build_request(bench, cmd, *which, name, body);
+        default:
+            snprintf(name, sizeof(name), "bench%d", (int)(next_random(&worker->rng) % bench->num_conns));
+            return build_request(bench, cmd, *which, name, NULL);
+    }
+}
+
+// sends a request on the connection, due at the given time. whatever the
+// socket doesn't take is kept and sent once it is writable
+void send_request(Worker *worker, int epoll_fd, Conn *conn, uint64_t due) {
+    char cmd[MAX_CMD];
+    int which;
+    int len = format_command(worker, conn, cmd, &which);
+    worker->sent++;
+    worker->by_cmd[which]++;
+
+    if (conn->due_count == conn->due_cap) {
+        int cap = conn->due_cap == 0 ? 16 : conn->due_cap * 2;
+        uint64_t *due_times = malloc(sizeof(uint64_t) * cap);
+        if (due_times == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < conn->due_count; i++) {
+            due_times[i] = conn->due[(conn->due_head + i) % conn->due_cap];
+        }
+        free(conn->due);
+        conn->due = due_times;
+        conn->due_head = 0;
+        conn->due_cap = cap;
+    }
+    conn->due[(conn->due_head + conn->due_count) % conn->due_cap] = due;
+    conn->due_count++;
+
+    int sent = 0;
+    if (conn->out_len == 0) {
+        sent = write(conn->fd, cmd, len);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("bench: write");
+                exit(1);
+            }
+            sent = 0;
+        }
+    }
+    if (sent < len) {
+        if (conn->out_len + len - sent > conn->out_cap) {
+            conn->out_cap = (conn->out_len + len - sent) * 2;
+            conn->out = realloc(conn->out, conn->out_cap);
+            if (conn->out == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(conn->out + conn->out_len, cmd + sent, len - sent);
+        int was_empty = conn->out_len == 0;
+        conn->out_len += len - sent;
+        if (was_empty) {
+            struct epoll_event event = {EPOLLIN | EPOLLOUT, {.ptr = conn}};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        }
+    }
+}
+
+// sends output the socket couldn't take earlier
+void flush_conn(int epoll_fd, Conn *conn) {
+    while (conn->out_len > 0) {
+        ssize_t nbytes = write(conn->fd, conn->out, conn->out_len);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            perror("bench: write");
+            exit(1);
+        }
+        memmove(conn->out, conn->out + nbytes, conn->out_len - nbytes);
+        conn->out_len -= nbytes;
+    }
+    struct epoll_event event = {EPOLLIN, {.ptr = conn}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// reads replies, recording the latency of every finished request
+// returns how many requests finished
+int read_conn(Worker *worker, Conn *conn, char *buf) {
+    int finished = 0;
+    while (1) {
+        ssize_t nbytes = read(conn->fd, buf, READ_SIZE);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return finished;
+            }
+            perror("bench: read");
+            exit(1);
+        } else if (nbytes == 0) {
+            fprintf(stderr, "bench: server closed connection\n");
+            exit(1);
+        }
+
+        int pongs = count_replies(worker->bench, conn, buf, nbytes);
+        uint64_t now = now_ns();
+        for (int i = 0; i < pongs && conn->due_count > 0; i++) {
+            uint64_t due = conn->due[conn->due_head];
+            hist_record(&worker->latency, now > due ? now - due : 0);
+            worker->completed++;
+            conn->due_head = (conn->due_head + 1) % conn->due_cap;
+            conn->due_count--;
+            finished++;
+        }
+    }
+}
+
+// makes every user friends with the next one, so posts have a target, and
+// seeds their walls
+void seed_friends(Worker *worker) {
+    const Bench *bench = worker->bench;
+    for (int i = 0; i < worker->num_conns; i++) {
+        Conn *conn = &worker->conns[i];
+        char cmd[MAX_CMD];
+        char name[MAX_NAME_FIELD];
+        char body[MAX_CMD / 2];
+        snprintf(name, sizeof(name), "bench%d", (conn->id + 1) % bench->num_conns);
+        int len = build_request(bench, cmd, CMD_MAKE_FRIENDS, name, NULL);
+        write_all(conn->fd, cmd, len);
+        for (int j = 0; j < bench->seed_posts; j++) {
+            snprintf(body, sizeof(body), "seed post %d from bench%d", j, conn->id);
+            len = build_request(bench, cmd, CMD_POST, name, body);
+            write_all(conn->fd, cmd, len);
+        }
+    }
+    for (int i = 0; i < worker->num_conns; i++) {
+        wait_replies(bench, &worker->conns[i], 1 + bench->seed_posts);
+    }
+}
+
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+    Bench *bench = worker->bench;
+
+    for (int i = 0; i < worker->num_conns; i++) {
+        connect_conn(bench, &worker->conns[i]);
+    }
+    // every user has to exist before anyone friends them
+    pthread_barrier_wait(&bench->logged_in);
+    if (bench->num_conns > 1) {
+        seed_friends(worker);
+    }
+    pthread_barrier_wait(&bench->logged_in);
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("bench: epoll_create1");
+        exit(1);
+    }
+    for (int i = 0; i < worker->num_conns; i++) {
+        Conn *conn = &worker->conns[i];
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event event = {EPOLLIN, {.ptr = conn}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+            perror("bench: epoll_ctl");
+            exit(1);
+        }
+    }
+
+    char *buf = malloc(READ_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)bench->seconds * 1000000000;
+    double mean_gap = bench->rate > 0 ? 1e9 * bench->num_threads / bench->rate : 0;
+    uint64_t next_arrival = start;
+    if (bench->rate == 0) {
+        for (int i = 0; i < worker->num_conns; i++) {
+            send_request(worker, epoll_fd, &worker->conns[i], start);
+        }
+    }
+
+    uint64_t now = start;
+    while (now < end) {
+        int timeout_ms = 100;
+        if (bench->rate > 0) {
+            // everything due by now goes out, late or not
+            while (next_arrival <= now) {
+                Conn *conn = &worker->conns[next_random(&worker->rng) % worker->num_conns];
+                send_request(worker, epoll_fd, conn, next_arrival);
+                next_arrival += (uint64_t)(-log(random_unit(&worker->rng)) * mean_gap);
+            }
+            timeout_ms = (next_arrival - now) / 1000000;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int num_ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (num_ready < 0 && errno != EINTR) {
+            perror("bench: epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < num_ready; i++) {
+            Conn *conn = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                flush_conn(epoll_fd, conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                int finished = read_conn(worker, conn, buf);
+                // closed loop: the next request goes out right away
+                now = now_ns();
+                for (int j = 0; bench->rate == 0 && j < finished && now < end; j++) {
+                    send_request(worker, epoll_fd, conn, now);
+                }
+            }
+        }
+        now = now_ns();
+    }
+
+    free(buf);
+    close(epoll_fd);
+    for (int i = 0; i < worker->num_conns; i++) {
+        close(worker->conns[i].fd);
+        free(worker->conns[i].due);
+        free(worker->conns[i].out);
+    }
+    return NULL;
+}
+
+// parses a mix like "list_users=5,make_friends=5,post=20,profile=70"
+// returns 0 on success, -1 on a bad mix
+int parse_mix(Bench *bench, char *mix) {
+    memset(bench->weights, 0, sizeof(bench->weights));
+    bench->total_weight = 0;
+    char *save;
+    for (char *item = strtok_r(mix, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(item, '=');
+        if (equals == NULL) {
+            return -1;
+        }
+        *equals = '\0';
+        int which = 0;
+        while (which < NUM_CMDS && strcmp(item, cmd_names[which]) != 0) {
+            which++;
+        }
+        int weight = strtol(equals + 1, NULL, 10);
+        if (which == NUM_CMDS || weight < 0) {
+            return -1;
+        }
+        bench->weights[which] = weight;
+        bench->total_weight += weight;
+    }
+    return bench->total_weight > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    Bench bench = {"127.0.0.1", PORT, 5, 1000, 4, 10000, {5, 5, 20, 70}, 100, 0};
+    char default_mix[] = "list_users=5,make_friends=5,post=20,profile=70";
+    char *mix = default_mix;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:r:m:n:b")) != -1) {
+        switch (opt) {
+            case 'h':
+                bench.host = optarg;
+                break;
+            case 'p':
+                bench.port = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.num_conns = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                bench.num_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                bench.seconds = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rate = strtod(optarg, NULL);
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 'n':
+                bench.seed_posts = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                bench.binary = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds]\n"
+                        "       [-r requests per second, 0 for closed loop] [-m list_users=N,make_friends=N,post=N,profile=N]\n"
+                        "       [-n seed posts per user] [-b (binary protocol)]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (parse_mix(&bench, mix) < 0) {
+        fprintf(stderr, "bench: bad mix %s\n", mix);
+        exit(1);
+    }
+    if (bench.num_threads < 1 || bench.num_conns < bench.num_threads || bench.rate < 0 || bench.seconds < 1) {
+        fprintf(stderr, "bench: need 1 <= threads <= connections, a rate >= 0 and at least one second\n");
+        exit(1);
+    }
+
+    // thousands of connections need more than the usual 1024 fds
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Worker *workers = calloc(bench.num_threads, sizeof(Worker));
+    Conn *conns = calloc(bench.num_conns, sizeof(Conn));
+    if (workers == NULL || conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_barrier_init(&bench.logged_in, NULL, bench.num_threads);
+    for (int i = 0; i < bench.num_conns; i++) {
+        conns[i].id = i;
+    }
+    // connections are split into contiguous runs, one per thread
+    for (int i = 0, first = 0; i < bench.num_threads; i++) {
+        int count = bench.num_conns / bench.num_threads + (i < bench.num_conns % bench.num_threads);
+        workers[i].bench = &bench;
+        workers[i].conns = conns + first;
+        workers[i].num_conns = count;
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        first += count;
+    }
+
+    for (int i = 0; i < bench.num_threads; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "bench: pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+
+    Histogram *latency = calloc(1, sizeof(Histogram));
+    if (latency == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    uint64_t sent = 0, completed = 0, by_cmd[NUM_CMDS] = {0};
+    for (int i = 0; i < bench.num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        sent += workers[i].sent;
+        completed += workers[i].completed;
+        for (int j = 0; j < NUM_CMDS; j++) {
+            by_cmd[j] += workers[i].by_cmd[j];
+        }
+        hist_merge(latency, &workers[i].latency);
+    }
+
+    printf("protocol=%s connections=%d threads=%d rate=%.0f seconds=%d sent=%lu completed=%lu req_per_sec=%.0f"
+           " p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+           bench.binary ? "binary" : "text", bench.num_conns, bench.num_threads, bench.rate, bench.seconds,
+           (unsigned long)sent, (unsigned long)completed, (double)completed / bench.seconds,
+           hist_quantile(latency, 0.5) / 1e3, hist_quantile(latency, 0.99) / 1e3,
+           hist_quantile(latency, 0.999) / 1e3, latency->max / 1e3);
+    for (int i = 0; i < NUM_CMDS; i++) {
+        printf(" %s=%lu", cmd_names[i], (unsigned long)by_cmd[i]);
+    }
+    printf("\n");
+
+    free(latency);
+    free(conns);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,954 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "snapshot.h"
+
+#define MAX_THREADS 256
+#define CHUNKS_PER_THREAD 4 // so threads that finish early can take more
+#define NAME_SHARDS 256 // name table shards, each interned by one thread
+#define USER_BLOCK 4096 // users a thread takes at a time when sorting friends
+#define SMALL_SORT 32 // lists up to this long are insertion sorted
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// bulk importer: turns an edge list and a post list into a snapshot that
+// friend_server loads with -l, without going through the server at all.
+//
+//   edges file: one friendship per line, "name1 name2"
+//   posts file: one post per line, "author target date body...", with the
+//               date in seconds since the epoch and the body the rest of
+//               the line
+//
+// users are every name either file mentions, numbered in the order they
+// first appear (the edges file first). both files are mmap'd and split
+// into chunks at line boundaries, which the threads parse in parallel.
+// every name a chunk mentions is grouped by the shard of the name table it
+// hashes to, and each shard is then interned by a single thread, in file
+// order, into a table small enough to stay in cache. friend lists are
+// then built as one flat array (counted and placed by threads that each
+// own a range of users, then sorted per user in parallel), and posts are
+// kept only between friends, as make_post would, grouped by wall and
+// oldest first. duplicate friendships and friendships with oneself are
+// dropped, and so are lines that don't parse; the counts are reported at
+// the end.
+
+// a name as parsed, waiting to be interned: its hash, where in its file it
+// is, and the field of the chunk's edges or posts its handle goes in
+typedef struct name_ref {
+    uint32_t hash;
+    uint32_t field; // edge * 2 + side, or post * 2 + (0 for author, 1 for target)
+    uint64_t seen; // file << 62 | offset << 5 | length
+} NameRef;
+
+// one distinct name
+typedef struct name_entry {
+    char name[MAX_NAME];
+    uint64_t first_seen; // the seen of its first ref, so ids go in file order
+    uint32_t len;
+} NameEntry;
+
+// a shard of the name table: entries in the order they were added, and an
+// open addressing index of them that keeps each name's hash next to its
+// entry, so a probe only reads an entry that is likely the one. a name's
+// handle is its entry's index times NAME_SHARDS plus its shard
+typedef struct name_shard {
+    NameEntry *entries;
+    uint32_t *ids; // by entry, once assigned
+    uint32_t count;
+    uint32_t cap;
+    uint64_t *slots; // hash << 32 | (entry index + 1), 0 for an empty slot
+    uint32_t num_slots; // a power of two
+} NameShard;
+
+// a post as parsed, its body still in the mapped posts file
+typedef struct import_post {
+    uint32_t author; // a name handle, then an id
+    uint32_t target;
+    int64_t date;
+    uint64_t body_off; // in the posts file, which also orders same-date posts
+    uint32_t body_len;
+} ImportPost;
+
+// a mapped input file
+typedef struct input {
+    const char *path;
+    const char *data;
+    size_t size;
+} Input;
+
+// a piece of an input file, and what was parsed from it
+typedef struct chunk {
+    int file; // 0 for the edges file, 1 for the posts file
+    size_t start;
+    size_t end;
+    uint32_t *edges; // pairs of name handles, then of ids
+    size_t num_edges;
+    size_t edges_cap;
+    ImportPost *posts;
+    size_t num_posts;
+    size_t posts_cap;
+    NameRef *refs; // grouped by shard once the chunk is parsed
+    size_t num_refs;
+    size_t refs_cap;
+    uint32_t ref_start[NAME_SHARDS + 1]; // where each shard's refs start
+    uint64_t bad_lines;
+} Chunk;
+
+static Input inputs[2];
+static Chunk *chunks;
+static int num_chunks;
+static int next_chunk; // taken atomically by the threads
+static uint32_t next_shard; // likewise
+static int num_threads;
+
+static NameShard shards[NAME_SHARDS];
+static uint32_t num_users;
+static uint32_t *user_handles; // by id
+
+// friend lists: user i's friends are adj[adj_start[i]...], num_friends[i]
+// of them once sorted and deduplicated
+static uint64_t *adj_start;
+static uint64_t *adj_fill;
+static uint32_t *adj;
+static uint32_t *num_friends;
+static uint32_t next_block; // taken atomically by the threads
+static uint32_t next_range; // likewise
+
+// posts, by wall: user i's are posts[post_start[i]...], oldest first
+static uint64_t *post_start;
+static uint64_t *post_fill;
+static ImportPost *posts;
+
+
+double ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+void *alloc_or_die(size_t size) {
+    void *mem = malloc(size > 0 ? size : 1);
+    if (mem == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return mem;
+}
+
+
+// runs fn on num_threads threads (the calling one included) and waits for
+// all of them
+void run_parallel(void *(*fn)(void *)) {
+    pthread_t threads[MAX_THREADS];
+    for (int i = 1; i < num_threads; i++) {
+        int err = pthread_create(&threads[i], NULL, fn, NULL);
+        if (err != 0) {
+            fprintf(stderr, "import: pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    fn(NULL);
+    for (int i = 1; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+// maps the file at path read only. an empty file maps to nothing
+void map_input(Input *input, const char *path) {
+    input->path = path;
+    input->data = NULL;
+    input->size = 0;
+    if (path == NULL) {
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    input->size = st.st_size;
+    if (input->size > 0) {
+        input->data = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input->data == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise((void *)input->data, input->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+
+// splits both inputs into about CHUNKS_PER_THREAD chunks per thread each,
+// every chunk ending right after a newline (or at the end of its file)
+void split_inputs(void) {
+    chunks = alloc_or_die(sizeof(Chunk) * 2 * num_threads * CHUNKS_PER_THREAD);
+    num_chunks = 0;
+    for (int file = 0; file < 2; file++) {
+        const Input *input = &inputs[file];
+        size_t target = input->size / (num_threads * CHUNKS_PER_THREAD) + 1;
+        size_t start = 0;
+        while (start < input->size) {
+            size_t end = start + target;
+            if (end >= input->size) {
+                end = input->size;
+            } else {
+                const char *newline = memchr(input->data + end, '\n', input->size - end);
+                end = newline == NULL ? input->size : (size_t)(newline - input->data) + 1;
+            }
+            Chunk *chunk = &chunks[num_chunks++];
+            memset(chunk, 0, sizeof(Chunk));
+            chunk->file = file;
+            chunk->start = start;
+            chunk->end = end;
+            start = end;
+        }
+    }
+}
+
+
+uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+// returns the handle of the name ref points at, adding it to the shard
+// (which is only ever used by the calling thread) if it is new. refs are
+// interned in file order, so a new name's ref is where it is first seen
+uint32_t intern_name(uint32_t which, const NameRef *ref) {
+    NameShard *shard = &shards[which];
+    const char *name = inputs[ref->seen >> 62].data + ((ref->seen >> 5) & ((1ULL << 57) - 1));
+    uint32_t len = ref->seen & 31;
+
+    uint32_t mask = shard->num_slots - 1;
+    uint32_t slot = (ref->hash / NAME_SHARDS) & mask;
+    while (shard->slots[slot] != 0) {
+        uint32_t index = (uint32_t)shard->slots[slot] - 1;
+        NameEntry *entry = &shard->entries[index];
+        if (shard->slots[slot] >> 32 == ref->hash && entry->len == len
+                && memcmp(entry->name, name, len) == 0) {
+            return index * NAME_SHARDS + which;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (shard->count == shard->cap) {
+        shard->cap *= 2;
+        shard->entries = realloc(shard->entries, sizeof(NameEntry) * shard->cap);
+        if (shard->entries == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    uint32_t index = shard->count++;
+    NameEntry *entry = &shard->entries[index];
+    memset(entry->name, 0, MAX_NAME);
+    memcpy(entry->name, name, len);
+    entry->len = len;
+    entry->first_seen = ref->seen;
+    shard->slots[slot] = (uint64_t)ref->hash << 32 | (index + 1);
+
+    // keep the index at most half full
+    if (shard->count * 2 > shard->num_slots) {
+        uint32_t num_slots = shard->num_slots * 2;
+        uint64_t *slots = calloc(num_slots, sizeof(uint64_t));
+        if (slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < shard->num_slots; i++) {
+            if (shard->slots[i] == 0) {
+                continue;
+            }
+            uint32_t at = (uint32_t)(shard->slots[i] >> 32) / NAME_SHARDS & (num_slots - 1);
+            while (slots[at] != 0) {
+                at = (at + 1) & (num_slots - 1);
+            }
+            slots[at] = shard->slots[i];
+        }
+        free(shard->slots);
+        shard->slots = slots;
+        shard->num_slots = num_slots;
+    }
+    return index * NAME_SHARDS + which;
+}
+
+
+// interns the names of the shards it takes, over every chunk in order, and
+// puts their handles in the edges and posts that mention them
+void *intern_names(void *arg) {
+    uint32_t which;
+    while ((which = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)) < NAME_SHARDS) {
+        for (int i = 0; i < num_chunks; i++) {
+            Chunk *chunk = &chunks[i];
+            for (uint32_t j = chunk->ref_start[which]; j < chunk->ref_start[which + 1]; j++) {
+                const NameRef *ref = &chunk->refs[j];
+                uint32_t handle = intern_name(which, ref);
+                if (chunk->file == 0) {
+                    chunk->edges[ref->field] = handle;
+                } else if (ref->field % 2 == 0) {
+                    chunk->posts[ref->field / 2].author = handle;
+                } else {
+                    chunk->posts[ref->field / 2].target = handle;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+
+NameEntry *name_entry(uint32_t handle) {
+    return &shards[handle % NAME_SHARDS].entries[handle / NAME_SHARDS];
+}
+
+
+uint32_t name_id(uint32_t handle) {
+    return shards[handle % NAME_SHARDS].ids[handle / NAME_SHARDS];
+}
+
+
+// finds the next space separated field at or after *at, moving *at past it
+// returns its length, 0 at the end of the line
+size_t next_field(const char **at, const char *end, const char **field) {
+    const char *p = *at;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    *field = p;
+    while (p < end && *p != ' ') {
+        p++;
+    }
+    *at = p;
+    return p - *field;
+}
+
+
+// remembers a name the chunk mentions, to be interned into field
+void add_ref(Chunk *chunk, const char *name, size_t len, uint32_t field) {
+    if (chunk->num_refs == chunk->refs_cap) {
+        chunk->refs_cap = chunk->refs_cap == 0 ? 8192 : chunk->refs_cap * 2;
+        chunk->refs = realloc(chunk->refs, sizeof(NameRef) * chunk->refs_cap);
+        if (chunk->refs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    NameRef *ref = &chunk->refs[chunk->num_refs++];
+    ref->hash = hash_name(name, len);
+    ref->field = field;
+    ref->seen = (uint64_t)chunk->file << 62 | (uint64_t)(name - inputs[chunk->file].data) << 5 | len;
+}
+
+
+// parses one line of the edges file into the chunk
+// returns 0 on success, -1 if the line isn't an edge
+int parse_edge(Chunk *chunk, const char *line, const char *end) {
+    const char *name1, *name2, *extra;
+    size_t len1 = next_field(&line, end, &name1);
+    size_t len2 = next_field(&line, end, &name2);
+    if (len1 == 0 || len2 == 0 || len1 >= MAX_NAME || len2 >= MAX_NAME
+        || next_field(&line, end, &extra) != 0) {
+        return -1;
+    }
+    if (chunk->num_edges == chunk->edges_cap) {
+        chunk->edges_cap = chunk->edges_cap == 0 ? 4096 : chunk->edges_cap * 2;
+        chunk->edges = realloc(chunk->edges, sizeof(uint32_t) * 2 * chunk->edges_cap);
+        if (chunk->edges == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    add_ref(chunk, name1, len1, 2 * chunk->num_edges);
+    add_ref(chunk, name2, len2, 2 * chunk->num_edges + 1);
+    chunk->num_edges++;
+    return 0;
+}
+
+
+// parses one line of the posts file into the chunk
+// returns 0 on success, -1 if the line isn't a post
+int parse_post(Chunk *chunk, const char *line, const char *end) {
+    const char *author, *target, *date;
+    size_t author_len = next_field(&line, end, &author);
+    size_t target_len = next_field(&line, end, &target);
+    size_t date_len = next_field(&line, end, &date);
+    if (author_len == 0 || target_len == 0 || date_len == 0 || author_len >= MAX_NAME
+        || target_len >= MAX_NAME) {
+        return -1;
+    }
+    int negative = *date == '-';
+    int64_t value = 0;
+    for (size_t i = negative; i < date_len; i++) {
+        if (date[i] < '0' || date[i] > '9' || value > INT64_MAX / 10 - 9) {
+            return -1;
+        }
+        value = value * 10 + (date[i] - '0');
+    }
+    if (date_len == (size_t)negative) {
+        return -1;
+    }
+    // the body is the rest of the line, as the post command takes it
+    while (line < end && *line == ' ') {
+        line++;
+    }
+    if (line == end || end - line > UINT32_MAX) {
+        return -1;
+    }
+
+    if (chunk->num_posts == chunk->posts_cap) {
+        chunk->posts_cap = chunk->posts_cap == 0 ? 1024 : chunk->posts_cap * 2;
+        chunk->posts = realloc(chunk->posts, sizeof(ImportPost) * chunk->posts_cap);
+        if (chunk->posts == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    add_ref(chunk, author, author_len, 2 * chunk->num_posts);
+    add_ref(chunk, target, target_len, 2 * chunk->num_posts + 1);
+    ImportPost *post = &chunk->posts[chunk->num_posts++];
+    post->date = negative ? -value : value;
+    post->body_off = line - inputs[1].data;
+    post->body_len = end - line;
+    return 0;
+}
+
+
+// sorts the chunk's name refs by shard (keeping their order within each)
+void group_refs(Chunk *chunk) {
+    memset(chunk->ref_start, 0, sizeof(chunk->ref_start));
+    for (size_t i = 0; i < chunk->num_refs; i++) {
+        chunk->ref_start[chunk->refs[i].hash % NAME_SHARDS + 1]++;
+    }
+    uint32_t fill[NAME_SHARDS];
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        chunk->ref_start[i + 1] += chunk->ref_start[i];
+        fill[i] = chunk->ref_start[i];
+    }
+    NameRef *grouped = alloc_or_die(sizeof(NameRef) * chunk->num_refs);
+    for (size_t i = 0; i < chunk->num_refs; i++) {
+        grouped[fill[chunk->refs[i].hash % NAME_SHARDS]++] = chunk->refs[i];
+    }
+    free(chunk->refs);
+    chunk->refs = grouped;
+}
+
+
+// parses every line of the chunks it takes. blank lines and lines starting
+// with # are skipped
+void *parse_chunks(void *arg) {
+    int i;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < num_chunks) {
+        Chunk *chunk = &chunks[i];
+        const char *data = inputs[chunk->file].data;
+        const char *at = data + chunk->start;
+        const char *stop = data + chunk->end;
+        while (at < stop) {
+            const char *newline = memchr(at, '\n', stop - at);
+            const char *end = newline == NULL ? stop : newline;
+            const char *next = newline == NULL ? stop : newline + 1;
+            while (end > at && (end[-1] == '\r' || end[-1] == ' ')) {
+                end--;
+            }
+            if (end > at && *at != '#') {
+                int result = chunk->file == 0 ? parse_edge(chunk, at, end) : parse_post(chunk, at, end);
+                if (result < 0) {
+                    chunk->bad_lines++;
+                }
+            }
+            at = next;
+        }
+        group_refs(chunk);
+    }
+    return NULL;
+}
+
+
+static int first_seen_order(const void *a, const void *b) {
+    uint64_t seen_a = name_entry(*(const uint32_t *)a)->first_seen;
+    uint64_t seen_b = name_entry(*(const uint32_t *)b)->first_seen;
+    return seen_a < seen_b ? -1 : seen_a > seen_b;
+}
+
+
+// numbers the users in the order their names first appear
+void assign_ids(void) {
+    num_users = 0;
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        num_users += shards[i].count;
+    }
+    user_handles = alloc_or_die(sizeof(uint32_t) * num_users);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < NAME_SHARDS; i++) {
+        for (uint32_t j = 0; j < shards[i].count; j++) {
+            user_handles[n++] = j * NAME_SHARDS + i;
+        }
+    }
+    qsort(user_handles, num_users, sizeof(uint32_t), first_seen_order);
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        shards[i].ids = alloc_or_die(sizeof(uint32_t) * shards[i].count);
+    }
+    for (uint32_t id = 0; id < num_users; id++) {
+        uint32_t handle = user_handles[id];
+        shards[handle % NAME_SHARDS].ids[handle / NAME_SHARDS] = id;
+    }
+}
+
+
+// turns the name handles of the chunks it takes into ids
+void *resolve_ids(void *arg) {
+    int i;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < num_chunks) {
+        Chunk *chunk = &chunks[i];
+        for (size_t j = 0; j < 2 * chunk->num_edges; j++) {
+            chunk->edges[j] = name_id(chunk->edges[j]);
+        }
+        for (size_t j = 0; j < chunk->num_posts; j++) {
+            chunk->posts[j].author = name_id(chunk->posts[j].author);
+            chunk->posts[j].target = name_id(chunk->posts[j].target);
+        }
+    }
+    return NULL;
+}
+
+
+// takes the next of num_threads equal ranges of user ids, so each thread
+// owns the friend lists of its range and fills them without atomics
+// returns 0 if there was one left, -1 otherwise
+int take_range(uint32_t *first, uint32_t *last) {
+    uint32_t range = __atomic_fetch_add(&next_range, 1, __ATOMIC_RELAXED);
+    if (range >= (uint32_t)num_threads) {
+        return -1;
+    }
+    *first = (uint64_t)num_users * range / num_threads;
+    *last = (uint64_t)num_users * (range + 1) / num_threads;
+    return 0;
+}
+
+
+// counts the friendships of the users in the ranges it takes, over every
+// chunk's edges
+void *count_friends(void *arg) {
+    uint32_t first, last;
+    while (take_range(&first, &last) == 0) {
+        for (int i = 0; i < num_chunks; i++) {
+            const uint32_t *edges = chunks[i].edges;
+            for (size_t j = 0; j < 2 * chunks[i].num_edges; j += 2) {
+                uint32_t id1 = edges[j];
+                uint32_t id2 = edges[j + 1];
+                if (id1 != id2) {
+                    if (id1 >= first && id1 < last) {
+                        adj_start[id1 + 1]++;
+                    }
+                    if (id2 >= first && id2 < last) {
+                        adj_start[id2 + 1]++;
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+
+// places the friendships of the users in the ranges it takes in their lists
+void *place_friends(void *arg) {
+    uint32_t first, last;
+    while (take_range(&first, &last) == 0) {
+        for (int i = 0; i < num_chunks; i++) {
+            const uint32_t *edges = chunks[i].edges;
+            for (size_t j = 0; j < 2 * chunks[i].num_edges; j += 2) {
+                uint32_t id1 = edges[j];
+                uint32_t id2 = edges[j + 1];
+                if (id1 == id2) {
+                    continue;
+                }
+                if (id1 >= first && id1 < last) {
+                    adj[adj_fill[id1]++] = id2;
+                }
+                if (id2 >= first && id2 < last) {
+                    adj[adj_fill[id2]++] = id1;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+
+// returns the next block of users for a thread to take
+static uint32_t take_block(void) {
+    return __atomic_fetch_add(&next_block, 1, __ATOMIC_RELAXED);
+}
+
+
+static int id_order(const void *a, const void *b) {
+    uint32_t id_a = *(const uint32_t *)a;
+    uint32_t id_b = *(const uint32_t *)b;
+    return id_a < id_b ? -1 : id_a > id_b;
+}
+
+
+// sorts the friend lists of the blocks of users it takes, dropping repeats
+void *sort_friends(void *arg) {
+    uint32_t block;
+    while ((block = take_block()) * (uint64_t)USER_BLOCK < num_users) {
+        uint32_t first = block * USER_BLOCK;
+        uint32_t last = num_users - first < USER_BLOCK ? num_users : first + USER_BLOCK;
+        for (uint32_t id = first; id < last; id++) {
+            uint32_t *ids = adj + adj_start[id];
+            uint32_t count = adj_start[id + 1] - adj_start[id];
+            if (count <= SMALL_SORT) {
+                for (uint32_t j = 1; j < count; j++) {
+                    uint32_t value = ids[j];
+                    uint32_t k = j;
+                    for (; k > 0 && ids[k - 1] > value; k--) {
+                        ids[k] = ids[k - 1];
+                    }
+                    ids[k] = value;
+                }
+            } else {
+                qsort(ids, count, sizeof(uint32_t), id_order);
+            }
+            uint32_t unique = 0;
+            for (uint32_t j = 0; j < count; j++) {
+                if (unique == 0 || ids[j] != ids[unique - 1]) {
+                    ids[unique++] = ids[j];
+                }
+            }
+            num_friends[id] = unique;
+        }
+    }
+    return NULL;
+}
+
+
+int are_friends(uint32_t id, uint32_t other) {
+    return bsearch(&other, adj + adj_start[id], num_friends[id], sizeof(uint32_t), id_order) != NULL;
+}
+
+
+// drops the posts of the chunks it takes whose author isn't a friend of the
+// wall's owner, and counts the rest by wall
+void *count_posts(void *arg) {
+    int i;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < num_chunks) {
+        Chunk *chunk = &chunks[i];
+        size_t kept = 0;
+        for (size_t j = 0; j < chunk->num_posts; j++) {
+            ImportPost *post = &chunk->posts[j];
+            if (are_friends(post->target, post->author)) {
+                __atomic_fetch_add(&post_start[post->target + 1], 1, __ATOMIC_RELAXED);
+                chunk->posts[kept++] = *post;
+            }
+        }
+        chunk->bad_lines += chunk->num_posts - kept;
+        chunk->num_posts = kept;
+    }
+    return NULL;
+}
+
+
+// places the posts of the chunks it takes on their walls
+void *place_posts(void *arg) {
+    int i;
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < num_chunks) {
+        Chunk *chunk = &chunks[i];
+        for (size_t j = 0; j < chunk->num_posts; j++) {
+            uint64_t at = __atomic_fetch_add(&post_fill[chunk->posts[j].target], 1, __ATOMIC_RELAXED);
+            posts[at] = chunk->posts[j];
+        }
+        free(chunk->posts);
+        chunk->posts = NULL;
+    }
+    return NULL;
+}
+
+
+static int oldest_first(const void *a, const void *b) {
+    const ImportPost *post_a = a;
+    const ImportPost *post_b = b;
+    if (post_a->date != post_b->date) {
+        return post_a->date < post_b->date ? -1 : 1;
+    }
+    return post_a->body_off < post_b->body_off ? -1 : post_a->body_off > post_b->body_off;
+}
+
+
+// sorts the walls of the blocks of users it takes, oldest post first
+void *sort_posts(void *arg) {
+    uint32_t block;
+    while ((block = take_block()) * (uint64_t)USER_BLOCK < num_users) {
+        uint32_t first = block * USER_BLOCK;
+        uint32_t last = num_users - first < USER_BLOCK ? num_users : first + USER_BLOCK;
+        for (uint32_t id = first; id < last; id++) {
+            qsort(posts + post_start[id], post_start[id + 1] - post_start[id], sizeof(ImportPost),
+                  oldest_first);
+        }
+    }
+    return NULL;
+}
+
+
+// turns counts[1...n] into running totals, so counts[i] is where the
+// items of i start, and returns the total
+uint64_t running_totals(uint64_t *counts, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        counts[i + 1] += counts[i];
+    }
+    return counts[n];
+}
+
+
+// write the zeros that pad a section of len bytes to a multiple of 8
+int write_padding(FILE *out, size_t len) {
+    static const char zeros[8];
+    size_t pad = ((len + 7) & ~(size_t)7) - len;
+    return pad > 0 && fwrite(zeros, 1, pad, out) != pad;
+}
+
+
+/*
+ * write everything imported to path as a snapshot (see snapshot.h),
+ * through a temporary file that is renamed over it once complete
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the file couldn't be written.
+ */
+int write_snapshot(const char *path) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 22);
+
+    SnapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_users = num_users;
+    header.num_posts = post_start[num_users];
+    for (uint32_t id = 0; id < num_users; id++) {
+        header.num_friend_ids += num_friends[id];
+    }
+    for (uint64_t i = 0; i < header.num_posts; i++) {
+        header.bodies_len += posts[i].body_len + 1;
+    }
+    header.users_off = ALIGN8(sizeof(SnapHeader));
+    header.friends_off = header.users_off + ALIGN8(sizeof(SnapUser) * header.num_users);
+    header.posts_off = header.friends_off + ALIGN8(sizeof(uint32_t) * header.num_friend_ids);
+    header.bodies_off = header.posts_off + ALIGN8(sizeof(SnapPost) * header.num_posts);
+    int err = fwrite(&header, sizeof(header), 1, out) != 1 || write_padding(out, sizeof(header));
+
+    uint64_t next_friend = 0;
+    for (uint32_t id = 0; id < num_users && !err; id++) {
+        const NameEntry *entry = name_entry(user_handles[id]);
+        SnapUser snap_user;
+        memset(&snap_user, 0, sizeof(snap_user));
+        memcpy(snap_user.name, entry->name, entry->len);
+        snap_user.first_friend = next_friend;
+        snap_user.num_friends = num_friends[id];
+        snap_user.first_post = post_start[id];
+        snap_user.num_posts = post_start[id + 1] - post_start[id];
+        next_friend += snap_user.num_friends;
+        err = fwrite(&snap_user, sizeof(snap_user), 1, out) != 1;
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(SnapUser) * header.num_users);
+    }
+
+    for (uint32_t id = 0; id < num_users && !err; id++) {
+        err = num_friends[id] > 0
+              && fwrite(adj + adj_start[id], sizeof(uint32_t), num_friends[id], out) != num_friends[id];
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(uint32_t) * header.num_friend_ids);
+    }
+
+    uint64_t body_off = 0;
+    for (uint64_t i = 0; i < header.num_posts && !err; i++) {
+        SnapPost snap_post;
+        memset(&snap_post, 0, sizeof(snap_post));
+        snap_post.date = posts[i].date;
+        snap_post.body_off = body_off;
+        snap_post.author_id = posts[i].author;
+        snap_post.body_len = posts[i].body_len;
+        // formatted as make_post does
+        time_t date = posts[i].date;
+        struct tm local;
+        if (localtime_r(&date, &local) == NULL || asctime_r(&local, snap_post.date_text) == NULL) {
+            strcpy(snap_post.date_text, "???\n");
+        }
+        body_off += snap_post.body_len + 1;
+        err = fwrite(&snap_post, sizeof(snap_post), 1, out) != 1;
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(SnapPost) * header.num_posts);
+    }
+    for (uint64_t i = 0; i < header.num_posts && !err; i++) {
+        err = fwrite(inputs[1].data + posts[i].body_off, 1, posts[i].body_len, out) != posts[i].body_len
+              || putc('\0', out) == EOF;
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        err = 1;
+    }
+    if (fclose(out) != 0 || err) {
+        perror(tmp_path);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    const char *edges_path = NULL;
+    const char *posts_path = NULL;
+    const char *out_path = "friend_server.snap";
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "e:p:o:t:")) != -1) {
+        switch (opt) {
+            case 'e':
+                edges_path = optarg;
+                break;
+            case 'p':
+                posts_path = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 't':
+                num_threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-e edges file] [-p posts file] [-o snapshot] [-t threads]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "import: need 1 to %d threads\n", MAX_THREADS);
+        exit(1);
+    }
+
+    struct timespec start, phase;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    map_input(&inputs[0], edges_path);
+    map_input(&inputs[1], posts_path);
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        NameShard *shard = &shards[i];
+        shard->cap = 1024;
+        shard->entries = alloc_or_die(sizeof(NameEntry) * shard->cap);
+        shard->num_slots = 2048;
+        shard->slots = calloc(shard->num_slots, sizeof(uint64_t));
+        if (shard->slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+
+    // parse both files, interning names
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    split_inputs();
+    next_chunk = 0;
+    run_parallel(parse_chunks);
+    next_shard = 0;
+    run_parallel(intern_names);
+    for (int i = 0; i < num_chunks; i++) {
+        free(chunks[i].refs);
+    }
+    assign_ids();
+    uint64_t total_edges = 0;
+    uint64_t total_posts = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        total_edges += chunks[i].num_edges;
+        total_posts += chunks[i].num_posts;
+    }
+    fprintf(stderr, "import: parsed %lu edges and %lu posts naming %u users in %.1f ms\n",
+            (unsigned long)total_edges, (unsigned long)total_posts, num_users, ms_since(&phase));
+
+    // friend lists: count, place, then sort every user's
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    adj_start = calloc((size_t)num_users + 1, sizeof(uint64_t));
+    post_start = calloc((size_t)num_users + 1, sizeof(uint64_t));
+    num_friends = alloc_or_die(sizeof(uint32_t) * num_users);
+    if (adj_start == NULL || post_start == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    next_chunk = 0;
+    run_parallel(resolve_ids);
+    next_range = 0;
+    run_parallel(count_friends);
+    uint64_t total_links = running_totals(adj_start, num_users);
+    adj = alloc_or_die(sizeof(uint32_t) * total_links);
+    adj_fill = alloc_or_die(sizeof(uint64_t) * ((size_t)num_users + 1));
+    memcpy(adj_fill, adj_start, sizeof(uint64_t) * ((size_t)num_users + 1));
+    next_range = 0;
+    run_parallel(place_friends);
+    for (int i = 0; i < num_chunks; i++) {
+        free(chunks[i].edges);
+    }
+    next_block = 0;
+    run_parallel(sort_friends);
+    uint64_t friendships = 0;
+    for (uint32_t id = 0; id < num_users; id++) {
+        friendships += num_friends[id];
+    }
+    fprintf(stderr, "import: built %lu friendships in %.1f ms\n", (unsigned long)(friendships / 2),
+            ms_since(&phase));
+
+    // posts: keep those between friends, then group them by wall
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    next_chunk = 0;
+    run_parallel(count_posts);
+    uint64_t kept_posts = running_totals(post_start, num_users);
+    posts = alloc_or_die(sizeof(ImportPost) * kept_posts);
+    post_fill = alloc_or_die(sizeof(uint64_t) * ((size_t)num_users + 1));
+    memcpy(post_fill, post_start, sizeof(uint64_t) * ((size_t)num_users + 1));
+    next_chunk = 0;
+    run_parallel(place_posts);
+    next_block = 0;
+    run_parallel(sort_posts);
+    fprintf(stderr, "import: placed %lu posts in %.1f ms\n", (unsigned long)kept_posts, ms_since(&phase));
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    if (write_snapshot(out_path) != 0) {
+        exit(1);
+    }
+    uint64_t bad_lines = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        bad_lines += chunks[i].bad_lines;
+    }
+    fprintf(stderr, "import: wrote %s in %.1f ms\n", out_path, ms_since(&phase));
+    fprintf(stderr, "import: %u users, %lu friendships, %lu posts (%lu lines skipped) in %.1f ms\n",
+            num_users, (unsigned long)(friendships / 2), (unsigned long)kept_posts, (unsigned long)bad_lines,
+            ms_since(&start));
+    return 0;
+}
@@ -2,48 +2,442 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
 
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#ifdef USE_SELECT
+  #include <sys/select.h>
+#else
+  #include <sys/epoll.h>
+#endif
 #include "friends.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "stats.h"
+#include "binary.h"
+#include "command.h"
+#ifdef USE_URING
+  #include "uring.h"
+#endif
 
 #ifndef PORT
   #define PORT 53232
 #endif
-#define BUFFER_SIZE 128
-#define MAX_BACKLOG 5
-#define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
+#define BUFFER_SIZE 128 // starting size of a client's input buffer
+#define MAX_LINE (64 * 1024) // longest command line a client may send
+#define MAX_IOV 64 // output chunks sent per writev
+#define MAX_BACKLOG 128
+#define MAX_EVENTS 256
+#define MAX_THREADS 256
+#define DEFAULT_HIGH_WATER (256 * 1024)
+#define DEFAULT_MAX_QUEUED (16 * 1024 * 1024)
+#define DEFAULT_PAGE_SIZE 20 // posts per page when no limit is given
+#define DEFAULT_SUGGESTIONS 10 // suggestions when suggest is given no count
+#define URING_ENTRIES 4096 // sqes per loop, enough for every op a turn starts
+#define URING_BUFS 512 // provided receive buffers per loop (a power of two)
+#define URING_BUF_SIZE 4096
+
+// output limits for every client (set once at startup):
+// - past high_water queued bytes a client's input is left unread until the
+//   queue drains to half of that
+// - past max_queued bytes the client is disconnected
+static size_t high_water = DEFAULT_HIGH_WATER;
+static size_t max_queued = DEFAULT_MAX_QUEUED;
+
+// snapshots are written by a forked child (copy on write, so the loops
+// carry on), on the snapshot command or on SIGUSR1
+static const char *snapshot_path = "friend_server.snap";
+static volatile sig_atomic_t snapshot_requested;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t snapshot_pid;
+
+// every change to the store is appended to the journal at journal_path (if
+// given), and committed at least once per loop iteration, before the
+// replies of that iteration are sent
+static const char *journal_path;
+static Durability durability = JOURNAL_BATCH;
+
+// if set, the stats report is written to stats_path every stats_interval
+// seconds, by a thread of its own
+static const char *stats_path;
+static int stats_interval = 10;
+
+// with a budget (in bytes), post bodies past it are spilled, oldest first,
+// to the cold segment at cold_path, and read back from there when needed
+static size_t post_budget;
+static const char *cold_path = "friend_server.cold";
+
+// one piece of pending output: either a constant string, a shared
+// (refcounted) response whose reference is released once it is sent, or a
+// few bytes copied into the chunk itself
+typedef struct out_chunk {
+    struct out_chunk *next;
+    const char *data;
+    size_t len; // bytes left to send
+    Rendered *shared;
+    char small[16];
+} OutChunk;
 
 // my data structure, storing (for each client):
 // - file descriptor
-// - username (used to locate user in the users data structure)
-// - file buffer, for partial reads
-// - pointer to next client
+// - the user it logged in as, resolved once at login (NULL until then)
+// - input buffer, for partial reads and pipelined commands
+// - output queue, for responses the socket couldn't take yet
 typedef struct sockname {
     int sock_fd;
-    char *username;
-    char *buf;
-    struct sockname *next;
+    User *user;
+    // input is read in at in_end and handled (parsed in place) from
+    // in_start, so a burst of pipelined commands costs no copying; the
+    // unhandled bytes are only moved down when the end runs out of room
+    char *in_buf;
+    size_t in_cap;
+    size_t in_start;
+    size_t in_end;
+    size_t in_scanned; // no network newline before this offset
+    int in_skip; // the rest of a line that was too long is still coming
+    OutChunk *out_head;
+    OutChunk *out_tail;
+    size_t out_bytes; // queued but not sent yet
+    int paused; // input is left unread until the output queue drains
+    int dirty; // has output to send once the journal is committed
+    int binary; // speaks the binary protocol (see binary.h)
+#ifdef USE_URING
+    // io_uring only: the sendmsg in flight (the chunks it covers stay
+    // queued until it completes), and the operations the ring holds the
+    // client for. a closed client is freed once none are left
+    struct msghdr msg;
+    struct iovec iov[MAX_IOV];
+    int sending;
+    int receiving;
+    int cancelling;
+    int closed;
+#endif
 } Client;
 
+// the event loop: an epoll instance by default, or a plain fd_set when
+// built with -DUSE_SELECT (make BACKEND=select). built with -DUSE_URING
+// (make BACKEND=uring) it is an io_uring instead, when the kernel supports
+// it, with epoll as the fallback. clients are kept in a table indexed by
+// their file descriptor, so accepting, dispatching and closing a client
+// never walks the other clients.
+typedef struct event_loop {
+#ifdef USE_SELECT
+    fd_set all_fds;
+    fd_set write_fds;
+    int max_fd;
+#else
+    int epoll_fd;
+#endif
+#ifdef USE_URING
+    Uring ring;
+#endif
+    Client **clients;
+    int num_slots;
+    // clients served this iteration, flushed once the journal is committed
+    int dirty_fds[MAX_EVENTS];
+    int num_dirty;
+} EventLoop;
+
+#ifdef USE_URING
+// io_uring loops: every accept, receive and send is an operation on the
+// loop's ring, and one io_uring_enter per turn both submits the turn's
+// sends and waits for the next completions. the low bits of an
+// operation's user_data say what it is, the rest point at its client
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_CANCEL 4
+#define URING_TAG_MASK 7
+
+static int use_uring; // set at startup, if the kernel can run the io_uring loop
+#endif
+
 // all helper function signatures, commented where they appear
-int accept_connection(int fd, Client *clients);
-int read_from(Client *clients, User **user_list_ptr);
+int open_listener(int port, int reuse_port);
+void *run_worker(void *arg);
+void check_snapshot_request(void);
+void finish_turn(EventLoop *loop);
+void loop_init(EventLoop *loop);
+int loop_watch(EventLoop *loop, int fd);
+void loop_unwatch(EventLoop *loop, int fd);
+void loop_update(EventLoop *loop, int fd, int want_read, int want_write);
+int loop_wait(EventLoop *loop, int *ready_fds, int max_ready, int timeout_ms);
+int set_nonblocking(int fd);
+void accept_connections(int fd, EventLoop *loop);
+void add_client(EventLoop *loop, int client_fd);
+void close_client(EventLoop *loop, Client *client);
+void free_client(Client *client);
+int serve_client(EventLoop *loop, Client *client, User **user_list_ptr);
+int queue_output(Client *client, const char *data, size_t len, Rendered *shared);
+int queue_copy(Client *client, const char *data, size_t len);
+int flush_output(EventLoop *loop, Client *client);
+int write_output(Client *client);
+void drop_sent(Client *client, size_t nbytes);
+void mark_dirty(EventLoop *loop, Client *client);
+void flush_dirty(EventLoop *loop);
+int read_from(EventLoop *loop, Client *client, User **user_list_ptr);
+int serve_requests(EventLoop *loop, Client *client, User **user_list_ptr);
+int next_request(Client *client);
+int next_line(Client *client);
+int next_frame(Client *client);
+int serve_frame(Client *client, int len, User **user_list_ptr);
+int field_name(char *name, const char *field, int len);
+int queue_status(Client *client, int opcode, int status);
+int make_room(Client *client);
 int find_network_newline(const char *buf, int n);
-int tokenize(char *cmd, char **cmd_argv);
-char *process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, char *username);
-
-int main(void) {
-    // initializing the first client in a "null" state so we have a data structure to reference
-    Client client;
-    client.sock_fd = -1;
-    client.username = NULL;
-    client.next = NULL;
-    // our clients data structure
-    Client *clients = &client;
+char *process_args(const Command *cmd, User **user_list_ptr, User *user, Rendered **shared);
+int parse_count(const char *arg, unsigned int *count);
+void request_snapshot(int sig);
+char *start_snapshot(void);
+void *dump_stats(void *arg);
+#ifdef USE_URING
+void run_uring(EventLoop *loop, int sock_fd, User **user_list_ptr);
+void uring_send(EventLoop *loop, Client *client);
+void uring_sent(EventLoop *loop, Client *client, int res, User **user_list_ptr);
+void uring_received(EventLoop *loop, Client *client, int res, unsigned int flags, User **user_list_ptr);
+int take_input(EventLoop *loop, Client *client, const char *data, size_t len, User **user_list_ptr);
+void uring_stop_receiving(EventLoop *loop, Client *client);
+#endif
+
+// the commands clients can send, and their arguments. the user a command
+// acts as is the client's own, so it isn't an argument
+static const CommandSpec server_commands[NUM_COMMANDS] = {
+    [CMD_QUIT] = {1, 0, 0, 0},
+    [CMD_LIST_USERS] = {1, 0, 0, 0},
+    [CMD_MAKE_FRIENDS] = {1, 1, 1, 0}, // name
+    [CMD_POST] = {1, 1, 1, 1}, // target, then the body
+    [CMD_PROFILE] = {1, 1, 3, 0}, // name [limit [cursor]]
+    [CMD_POSTS] = {1, 1, 3, 0}, // name [limit [cursor]]
+    [CMD_FEED] = {1, 0, 1, 0}, // [limit]
+    [CMD_MUTUAL] = {1, 1, 1, 0}, // name
+    [CMD_SUGGEST] = {1, 0, 1, 0}, // [count]
+    [CMD_DISTANCE] = {1, 2, 2, 0}, // from, to
+    [CMD_PATH] = {1, 2, 2, 0}, // from, to
+    [CMD_SEARCH] = {1, 0, 0, 1}, // the words
+    [CMD_MEMORY] = {1, 0, 0, 0},
+    [CMD_CACHE] = {1, 0, 0, 0},
+    [CMD_SNAPSHOT] = {1, 0, 0, 0},
+    [CMD_STATS] = {1, 0, 0, 0},
+    [CMD_PING] = {1, 0, 0, 0}
+};
+
+// the arguments of a worker thread's event loop
+typedef struct worker {
+    pthread_t thread;
+    int sock_fd;
+    User **user_list_ptr;
+} Worker;
+
+int main(int argc, char **argv) {
+    int num_threads = 1;
+    const char *load_path = NULL;
+    long interval_ms = 100;
+    static const struct option long_options[] = {
+        {"load", required_argument, NULL, 'l'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"journal", required_argument, NULL, 'j'},
+        {"durability", required_argument, NULL, 'd'},
+        {"interval", required_argument, NULL, 'i'},
+        {"stats-file", required_argument, NULL, 'S'},
+        {"stats-interval", required_argument, NULL, 'I'},
+        {"post-budget", required_argument, NULL, 'b'},
+        {"cold-file", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:w:W:l:s:j:d:i:S:I:b:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                load_path = optarg;
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'd':
+                if (strcmp(optarg, "per-op") == 0) {
+                    durability = JOURNAL_PER_OP;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    durability = JOURNAL_BATCH;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    durability = JOURNAL_INTERVAL;
+                } else {
+                    fprintf(stderr, "server: durability must be per-op, batch or interval\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+                interval_ms = strtol(optarg, NULL, 10);
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'I':
+                stats_interval = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                post_budget = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                cold_path = optarg;
+                break;
+            case 't':
+                num_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                high_water = strtoul(optarg, NULL, 10);
+                break;
+            case 'W':
+                max_queued = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-w high water bytes] [-W max queued bytes]"
+                        " [-l|--load snapshot] [-s|--snapshot path]\n"
+                        "       [-j|--journal path] [-d|--durability per-op|batch|interval]"
+                        " [-i|--interval ms]\n"
+                        "       [-S|--stats-file path] [-I|--stats-interval seconds]\n"
+                        "       [-b|--post-budget bytes] [-c|--cold-file path]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "server: thread count must be between 1 and %d\n", MAX_THREADS);
+        exit(1);
+    }
+    if (high_water == 0 || max_queued < high_water) {
+        fprintf(stderr, "server: need 0 < high water <= max queued\n");
+        exit(1);
+    }
+    if (stats_interval < 1) {
+        fprintf(stderr, "server: the stats interval must be at least 1 second\n");
+        exit(1);
+    }
+    if (interval_ms < 1) {
+        fprintf(stderr, "server: the fsync interval must be at least 1 ms\n");
+        exit(1);
+    }
+
+#ifdef USE_URING
+    use_uring = uring_supported();
+    if (!use_uring) {
+        fprintf(stderr, "server: io_uring not supported, using epoll\n");
+    }
+#endif
+
+    // a client hanging up mid-write should give EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // one fd per client: allow as many as the hard limit does
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // SIGUSR1 asks for a snapshot; it interrupts the wait of whichever loop
+    // gets it, and that loop starts the snapshot
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_snapshot;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    // before any post is made, as set_post_budget needs. posts restored
+    // from a snapshot or journal stay in its mapping and are never spilled
+    if (post_budget > 0 && set_post_budget(post_budget, cold_path) != 0) {
+        exit(1);
+    }
+
+    // initialize user data structure, shared by every worker
+    User *user_list = NULL;
+    uint64_t last_lsn = 0;
+    if (load_path != NULL) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (snapshot_load(load_path, &user_list, &last_lsn) != 0) {
+            fprintf(stderr, "server: could not load %s\n", load_path);
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "server: loaded %u users from %s in %.1f ms\n", user_count(), load_path,
+                (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+
+    // replay whatever the journal has past the snapshot, then keep appending
+    if (journal_path != NULL) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t snapshot_lsn = last_lsn;
+        if (journal_replay(journal_path, &user_list, snapshot_lsn, &last_lsn) != 0) {
+            fprintf(stderr, "server: could not replay %s\n", journal_path);
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (last_lsn > snapshot_lsn) {
+            fprintf(stderr, "server: replayed %lu changes from %s in %.1f ms\n",
+                    (unsigned long)(last_lsn - snapshot_lsn), journal_path,
+                    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+        if (journal_open(journal_path, durability, interval_ms, last_lsn) != 0) {
+            exit(1);
+        }
+    }
+    // whatever was loaded is indexed for search while the loops serve
+    start_search_index();
+
+    // one event loop per thread. with SO_REUSEPORT every loop gets its own
+    // listening socket and the kernel spreads connections across them,
+    // otherwise the loops share one listening socket and race to accept
+    Worker *workers = malloc(sizeof(Worker) * num_threads);
+    if (workers == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+#ifdef SO_REUSEPORT
+        workers[i].sock_fd = open_listener(PORT, num_threads > 1);
+#else
+        workers[i].sock_fd = i == 0 ? open_listener(PORT, 0) : workers[0].sock_fd;
+#endif
+        workers[i].user_list_ptr = &user_list;
+    }
 
+    if (stats_path != NULL) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, dump_stats, NULL);
+        if (err != 0) {
+            fprintf(stderr, "server: pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+
+    // the main thread runs the first loop itself
+    for (int i = 1; i < num_threads; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "server: pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    run_worker(&workers[0]);
+    return 1;
+}
+
+// creates a non-blocking socket listening on the given port
+// returns its fd, exits on failure
+int open_listener(int port, int reuse_port) {
     // create socket
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
@@ -54,7 +448,7 @@ int main(void) {
     // initialize server
     struct sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);
+    server.sin_port = htons(port);
     server.sin_addr.s_addr = INADDR_ANY;
 
     // for port convienience
@@ -64,6 +458,14 @@ int main(void) {
     if (status == -1) {
         perror("setsockopt -- REUSEADDR");
     }
+#ifdef SO_REUSEPORT
+    // lets every worker thread bind its own socket to the same port
+    if (reuse_port && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+                                 (const char *) &on, sizeof(on)) == -1) {
+        perror("setsockopt -- REUSEPORT");
+        exit(1);
+    }
+#endif
 
     // reset for safety
     memset(&server.sin_zero, 0, 8);
@@ -81,215 +483,1163 @@ int main(void) {
         close(sock_fd);
         exit(1);
     }
-    
-    // initialize set of file descriptors
-    int max_fd = sock_fd;
-    fd_set all_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(sock_fd, &all_fds);
 
-    // initialize user data structure
-    User *user_list = NULL;
+    // the listening socket is drained completely on every wakeup
+    if (set_nonblocking(sock_fd) < 0) {
+        perror("server: fcntl");
+        exit(1);
+    }
+    return sock_fd;
+}
+
+// runs one event loop, accepting clients from the worker's listening socket
+// and serving them until the process exits
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+    int sock_fd = worker->sock_fd;
+
+    // initialize the event loop
+    EventLoop loop;
+    loop_init(&loop);
+#ifdef USE_URING
+    if (use_uring) {
+        run_uring(&loop, sock_fd, worker->user_list_ptr);
+        return NULL;
+    }
+#endif
+    if (loop_watch(&loop, sock_fd) < 0) {
+        perror("server: watch");
+        exit(1);
+    }
 
     // server loop
+    int ready_fds[MAX_EVENTS];
+    while (1) {
+        int num_ready = loop_wait(&loop, ready_fds, MAX_EVENTS, journal_timeout());
+        stats_add(STAT_WAKEUPS, 1);
+        check_snapshot_request();
+
+        for (int i = 0; i < num_ready; i++) {
+            int fd = ready_fds[i];
+            // new connection(s) waiting on the listening socket
+            if (fd == sock_fd) {
+                accept_connections(sock_fd, &loop);
+                continue;
+            }
+
+            // otherwise find the client straight from its fd
+            Client *client = fd < loop.num_slots ? loop.clients[fd] : NULL;
+            if (client != NULL && serve_client(&loop, client, worker->user_list_ptr) > 0) {
+                // serve_client returns the fd once the client has to go
+                close_client(&loop, client);
+            }
+        }
+        finish_turn(&loop);
+    }
+    return NULL;
+}
+
+// starts a snapshot if SIGUSR1 asked for one since the last check
+void check_snapshot_request(void) {
+    if (snapshot_requested && __atomic_exchange_n(&snapshot_requested, 0, __ATOMIC_ACQ_REL)) {
+        char *message = start_snapshot();
+        fprintf(stderr, "server: %s", message);
+        free(message);
+    }
+}
+
+// ends a loop iteration with the group commit: one write (and fsync)
+// covers every change made in the iteration, and only then do their
+// replies go out
+void finish_turn(EventLoop *loop) {
+    if (journal_commit() != 0) {
+        fprintf(stderr, "server: journal write failed, stopping\n");
+        exit(1);
+    }
+    flush_dirty(loop);
+}
+
+#ifdef USE_URING
+// runs the loop on its io_uring: a multishot accept on the
+// listening socket and a multishot receive per client stay armed, and each
+// iteration submits the sends the last one started and waits for the next
+// completions in a single io_uring_enter
+void run_uring(EventLoop *loop, int sock_fd, User **user_list_ptr) {
+    Uring *ring = &loop->ring;
+    uring_prep_accept(uring_sqe(ring), sock_fd, URING_ACCEPT);
     while (1) {
-        // clone set for select call
-        fd_set listen_fds = all_fds;
-        if ((select(max_fd + 1, &listen_fds, NULL, NULL, NULL)) == -1) {
-            perror("server: select");
+        if (uring_enter(ring, 1, journal_timeout()) < 0) {
+            perror("server: io_uring_enter");
             exit(1);
         }
+        stats_add(STAT_WAKEUPS, 1);
+        stats_add(STAT_SYSCALLS, ring->syscalls);
+        ring->syscalls = 0;
+        check_snapshot_request();
+
+        // at most MAX_EVENTS completions per iteration, like epoll_wait: the
+        // rest are there at once for the next io_uring_enter
+        struct io_uring_cqe *cqe;
+        for (int i = 0; i < MAX_EVENTS && (cqe = uring_next_cqe(ring)) != NULL; i++) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(ring);
 
-        // used to check if this is a new connection, updates all atributes accordingly
-        if (FD_ISSET(sock_fd, &listen_fds)) {
-            int client_fd = accept_connection(sock_fd, clients);
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
+            Client *client = (Client *)(uintptr_t)(user_data & ~(uint64_t)URING_TAG_MASK);
+            switch (user_data & URING_TAG_MASK) {
+            case URING_ACCEPT:
+                if (res >= 0) {
+                    add_client(loop, res);
+                } else if (res != -ECONNABORTED) {
+                    fprintf(stderr, "server: accept: %s\n", strerror(-res));
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_prep_accept(uring_sqe(ring), sock_fd, URING_ACCEPT);
+                }
+                break;
+            case URING_RECV:
+                uring_received(loop, client, res, flags, user_list_ptr);
+                break;
+            case URING_SEND:
+                uring_sent(loop, client, res, user_list_ptr);
+                break;
+            default:
+                break; // a cancel went through, or had nothing left to cancel
             }
-            FD_SET(client_fd, &all_fds);
-            // send a message to the newly connected client so they know to send a username
-            write(client_fd, "What is your user name?\n", 24);
-        }
-
-        // clone clients data structure so we can iterate through it without mutating
-        Client *clients_clone = clients;
-        while (clients_clone != NULL) {
-            // if the client exists and is ready to be read from, read from it
-            if (clients_clone->sock_fd > -1 && FD_ISSET(clients_clone->sock_fd, &listen_fds)) {
-                int client_closed = read_from(clients_clone, &user_list);
-                // if read_from returns an fd number, the client disconnected,
-                // so act accordingly
-                if (client_closed > 0) {
-                    FD_CLR(client_closed, &all_fds);
-                    close(clients->sock_fd);
-                    clients->sock_fd = -1;
+        }
+        finish_turn(loop);
+    }
+}
+
+// starts one sendmsg of up to MAX_IOV of the client's queued chunks. they
+// stay queued (and untouched) until it completes
+void uring_send(EventLoop *loop, Client *client) {
+    int iovcnt = 0;
+    for (OutChunk *chunk = client->out_head; chunk != NULL && iovcnt < MAX_IOV; chunk = chunk->next) {
+        client->iov[iovcnt].iov_base = (void *)chunk->data;
+        client->iov[iovcnt].iov_len = chunk->len;
+        iovcnt++;
+    }
+    memset(&client->msg, 0, sizeof(client->msg));
+    client->msg.msg_iov = client->iov;
+    client->msg.msg_iovlen = iovcnt;
+    uring_prep_sendmsg(uring_sqe(&loop->ring), client->sock_fd, &client->msg, (uintptr_t)client | URING_SEND);
+    client->sending = 1;
+}
+
+// handles the completion of the client's sendmsg: drops what went out and
+// sends the rest, resuming the client if its queue has drained enough
+void uring_sent(EventLoop *loop, Client *client, int res, User **user_list_ptr) {
+    client->sending = 0;
+    if (client->closed) {
+        close_client(loop, client);
+        return;
+    }
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        close_client(loop, client);
+        return;
+    }
+    if (res > 0) {
+        drop_sent(client, res);
+    }
+
+    int was_paused = client->paused;
+    if (flush_output(loop, client) < 0) {
+        close_client(loop, client);
+        return;
+    }
+    if (was_paused && !client->paused) {
+        // handle the input that came in while it was paused, then read on
+        if (serve_requests(loop, client, user_list_ptr) != 0) {
+            close_client(loop, client);
+            return;
+        }
+        mark_dirty(loop, client);
+        if (!client->paused && !client->receiving) {
+            uring_prep_recv(uring_sqe(&loop->ring), client->sock_fd, (uintptr_t)client | URING_RECV);
+            client->receiving = 1;
+        }
+    }
+}
+
+// handles a completion of the client's multishot receive: the data in its
+// provided buffer, if any, and the end of the receive, if it ended. it is
+// armed again unless the stream is over, the client is paused or closed
+void uring_received(EventLoop *loop, Client *client, int res, unsigned int flags, User **user_list_ptr) {
+    int gone = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!client->closed && res > 0) {
+            gone = take_input(loop, client, uring_buf(&loop->ring, bid), res, user_list_ptr);
+        }
+        uring_recycle(&loop->ring, bid);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        client->receiving = 0;
+        client->cancelling = 0;
+        // out of provided buffers just means trying again, and a receive
+        // cancelled for a pause is armed again when the client resumes
+        if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+            gone = 1;
+        } else if (!gone && !client->closed && !client->paused) {
+            uring_prep_recv(uring_sqe(&loop->ring), client->sock_fd, (uintptr_t)client | URING_RECV);
+            client->receiving = 1;
+        }
+    }
+    if (gone || client->closed) {
+        close_client(loop, client);
+    }
+}
+
+// adds received data to the client's input buffer, handling every request
+// it completes. once the client is paused the rest is only kept, however
+// long, to be handled when it resumes
+// returns the client's fd if it should be closed, 0 otherwise
+int take_input(EventLoop *loop, Client *client, const char *data, size_t len, User **user_list_ptr) {
+    stats_add(STAT_BYTES_IN, len);
+    while (1) {
+        int gone = serve_requests(loop, client, user_list_ptr);
+        if (gone != 0) {
+            return gone;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        if (client->paused) {
+            if (client->in_end + len >= client->in_cap) {
+                while (client->in_end + len >= client->in_cap) {
+                    client->in_cap *= 2;
+                }
+                client->in_buf = realloc(client->in_buf, client->in_cap);
+                if (client->in_buf == NULL) {
+                    perror("realloc");
+                    exit(1);
                 }
             }
-            // iterate through to next client
-            clients_clone = clients_clone->next;
+            memcpy(client->in_buf + client->in_end, data, len);
+            client->in_end += len;
+            break;
         }
+        if (make_room(client) < 0) {
+            return client->sock_fd;
+        }
+        // keep one byte free for the null terminator
+        size_t room = client->in_cap - 1 - client->in_end;
+        size_t nbytes = len < room ? len : room;
+        memcpy(client->in_buf + client->in_end, data, nbytes);
+        client->in_end += nbytes;
+        data += nbytes;
+        len -= nbytes;
     }
-    return 1;
+    mark_dirty(loop, client);
+    return 0;
 }
 
-// accepts the new client's (specified by fd) connection
-// returns the file descriptor
-int accept_connection(int fd, Client *clients) {
-    // clone clients data structure and iterate until we find next availiable client spot
-    Client *clients_clone = clients;
-    while (clients_clone->sock_fd != -1) {
-        if (clients_clone->next != NULL) {
-            clients_clone = clients_clone->next;
-        } else {
-            // init new client
-            Client *new_client = malloc(sizeof(Client));
-            new_client->sock_fd = -1;
-            clients_clone->next = new_client;
+// cancels the client's receive while it is paused, so its input waits in
+// the socket rather than in the client's buffer
+void uring_stop_receiving(EventLoop *loop, Client *client) {
+    if (client->receiving && !client->cancelling) {
+        uring_prep_cancel(uring_sqe(&loop->ring), (uintptr_t)client | URING_RECV, URING_CANCEL);
+        client->cancelling = 1;
+    }
+}
+#endif
+
+// sets up the event loop with no fds and an empty client table
+void loop_init(EventLoop *loop) {
+    loop->clients = NULL;
+    loop->num_slots = 0;
+    loop->num_dirty = 0;
+#ifdef USE_SELECT
+    FD_ZERO(&loop->all_fds);
+    FD_ZERO(&loop->write_fds);
+    loop->max_fd = -1;
+#else
+#ifdef USE_URING
+    if (use_uring) {
+        loop->epoll_fd = -1;
+        if (uring_init(&loop->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) != 0) {
+            perror("server: io_uring_setup");
+            exit(1);
+        }
+        return;
+    }
+#endif
+    loop->epoll_fd = epoll_create1(0);
+    if (loop->epoll_fd < 0) {
+        perror("server: epoll_create1");
+        exit(1);
+    }
+#endif
+}
+
+// starts waiting for the given fd to become readable (or, with epoll,
+// writable again after a write hit EAGAIN)
+// returns 0 on success, -1 if the fd can't be watched
+int loop_watch(EventLoop *loop, int fd) {
+#ifdef USE_SELECT
+    if (fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    FD_SET(fd, &loop->all_fds);
+    if (fd > loop->max_fd) {
+        loop->max_fd = fd;
+    }
+    return 0;
+#else
+    // edge triggered, so every reader has to drain its fd until EAGAIN, and
+    // a writable edge only comes after a write has filled the socket up
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    stats_add(STAT_SYSCALLS, 1);
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+#endif
+}
+
+// stops waiting on the given fd (must be called before it is closed)
+void loop_unwatch(EventLoop *loop, int fd) {
+#ifdef USE_SELECT
+    FD_CLR(fd, &loop->all_fds);
+    FD_CLR(fd, &loop->write_fds);
+#else
+    stats_add(STAT_SYSCALLS, 1);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+// sets whether a watched fd should wake the loop up when it is readable
+// and when it is writable. with edge triggered epoll both are always
+// watched and the client handlers ignore the edges they don't need, so
+// this only matters for select
+void loop_update(EventLoop *loop, int fd, int want_read, int want_write) {
+#ifdef USE_SELECT
+    if (want_read) {
+        FD_SET(fd, &loop->all_fds);
+    } else {
+        FD_CLR(fd, &loop->all_fds);
+    }
+    if (want_write) {
+        FD_SET(fd, &loop->write_fds);
+    } else {
+        FD_CLR(fd, &loop->write_fds);
+    }
+#endif
+}
+
+// blocks until at least one watched fd is ready (or for at most timeout_ms,
+// unless that is -1), and stores up to max_ready of them in ready_fds
+// returns the number of ready fds
+int loop_wait(EventLoop *loop, int *ready_fds, int max_ready, int timeout_ms) {
+#ifdef USE_SELECT
+    // clone sets for select call
+    fd_set listen_fds = loop->all_fds;
+    fd_set write_fds = loop->write_fds;
+    struct timeval timeout = {timeout_ms / 1000, timeout_ms % 1000 * 1000};
+    int num_ready = select(loop->max_fd + 1, &listen_fds, &write_fds, NULL, timeout_ms < 0 ? NULL : &timeout);
+    stats_add(STAT_SYSCALLS, 1);
+    if (num_ready == -1) {
+        if (errno == EINTR) {
+            return 0;
         }
+        perror("server: select");
+        exit(1);
     }
 
-    // accept the new client
-    int client_fd = accept(fd, NULL, NULL);
-    if (client_fd < 0) {
-        perror("server: accept");
-        close(fd);
+    int found = 0;
+    for (int fd = 0; fd <= loop->max_fd && found < max_ready; fd++) {
+        if (FD_ISSET(fd, &listen_fds) || FD_ISSET(fd, &write_fds)) {
+            ready_fds[found++] = fd;
+        }
+    }
+    return found;
+#else
+    struct epoll_event events[MAX_EVENTS];
+    if (max_ready > MAX_EVENTS) {
+        max_ready = MAX_EVENTS;
+    }
+    int num_ready = epoll_wait(loop->epoll_fd, events, max_ready, timeout_ms);
+    stats_add(STAT_SYSCALLS, 1);
+    if (num_ready == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("server: epoll_wait");
         exit(1);
     }
 
-    // finish setting up new client
-    clients_clone->sock_fd = client_fd;
-    clients_clone->username = NULL;
-    clients_clone->buf = malloc(sizeof(char) * BUFFER_SIZE);
-    clients_clone->next = NULL;
-    return client_fd;
-}
-
-// reads from the specified client (will always be the front of the provided clients structure)
-int read_from(Client *clients, User **user_list_ptr) {
-    // initialize variables for partial read buffer
-    int fd = clients->sock_fd;
-    char buf[BUFFER_SIZE];
-    int inbuf;
-    int room;
-    char *after;
-
-    // proceed depending on if this client has been partialy read from or not
-    if (clients->buf == NULL) {
-        buf[BUFFER_SIZE] = '\0';
-        inbuf = 0;           
-        room = sizeof(buf); 
-        after = buf; 
+    for (int i = 0; i < num_ready; i++) {
+        ready_fds[i] = events[i].data.fd;
+    }
+    return num_ready;
+#endif
+}
+
+// puts the given fd in non-blocking mode
+// returns 0 on success, -1 on error
+int set_nonblocking(int fd) {
+    stats_add(STAT_SYSCALLS, 2);
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// accepts every pending connection on the listening socket fd
+void accept_connections(int fd, EventLoop *loop) {
+    while (1) {
+        int client_fd = accept(fd, NULL, NULL);
+        stats_add(STAT_SYSCALLS, 1);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN: no connection left, anything else (e.g. out of fds)
+            // leaves the connection in the backlog for a later wakeup
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("server: accept");
+            }
+            return;
+        }
+
+        if (set_nonblocking(client_fd) < 0 || loop_watch(loop, client_fd) < 0) {
+            perror("server: new client");
+            close(client_fd);
+            continue;
+        }
+        add_client(loop, client_fd);
+    }
+}
+
+// gives a new connection the slot in the client table matching its fd,
+// and asks it for its user name
+void add_client(EventLoop *loop, int client_fd) {
+    // grow the client table so it has a slot for this fd
+    if (client_fd >= loop->num_slots) {
+        int num_slots = loop->num_slots == 0 ? 64 : loop->num_slots;
+        while (num_slots <= client_fd) {
+            num_slots *= 2;
+        }
+        Client **clients = realloc(loop->clients, sizeof(Client *) * num_slots);
+        if (clients == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(clients + loop->num_slots, 0, sizeof(Client *) * (num_slots - loop->num_slots));
+        loop->clients = clients;
+        loop->num_slots = num_slots;
+    }
+
+    // init new client
+    Client *new_client = malloc(sizeof(Client));
+    if (new_client == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    new_client->sock_fd = client_fd;
+    new_client->user = NULL;
+    new_client->in_buf = malloc(BUFFER_SIZE);
+    if (new_client->in_buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    new_client->in_cap = BUFFER_SIZE;
+    new_client->in_start = 0;
+    new_client->in_end = 0;
+    new_client->in_scanned = 0;
+    new_client->in_skip = 0;
+    new_client->out_head = NULL;
+    new_client->out_tail = NULL;
+    new_client->out_bytes = 0;
+    new_client->paused = 0;
+    new_client->dirty = 0;
+    new_client->binary = 0;
+    loop->clients[client_fd] = new_client;
+    stats_add(STAT_ACCEPTED, 1);
+#ifdef USE_URING
+    new_client->sending = 0;
+    new_client->receiving = 0;
+    new_client->cancelling = 0;
+    new_client->closed = 0;
+    if (use_uring) {
+        uring_prep_recv(uring_sqe(&loop->ring), client_fd, (uintptr_t)new_client | URING_RECV);
+        new_client->receiving = 1;
+    }
+#endif
+
+    // send a message to the newly connected client so they know to send a username
+    queue_output(new_client, "What is your user name?\n", 24, NULL);
+    if (flush_output(loop, new_client) < 0) {
+        close_client(loop, new_client);
+    }
+}
+
+// removes the client from the event loop and frees it
+void close_client(EventLoop *loop, Client *client) {
+#ifdef USE_URING
+    if (use_uring) {
+        // the ring may still be using the client's fd and output: cancel
+        // whatever it has in flight, and free the client once that is back
+        // (this is called again for each operation that completes)
+        if (!client->closed) {
+            client->closed = 1;
+            stats_add(STAT_CLOSED, 1);
+            loop->clients[client->sock_fd] = NULL;
+            if (client->receiving && !client->cancelling) {
+                uring_prep_cancel(uring_sqe(&loop->ring), (uintptr_t)client | URING_RECV, URING_CANCEL);
+                client->cancelling = 1;
+            }
+            if (client->sending) {
+                uring_prep_cancel(uring_sqe(&loop->ring), (uintptr_t)client | URING_SEND, URING_CANCEL);
+            }
+        }
+        if (!client->receiving && !client->sending) {
+            free_client(client);
+        }
+        return;
+    }
+#endif
+    loop_unwatch(loop, client->sock_fd);
+    stats_add(STAT_CLOSED, 1);
+    loop->clients[client->sock_fd] = NULL;
+    free_client(client);
+}
+
+// closes the client's socket and frees the client with all its buffers
+void free_client(Client *client) {
+    stats_add(STAT_SYSCALLS, 1);
+    close(client->sock_fd);
+    while (client->out_head != NULL) {
+        OutChunk *chunk = client->out_head;
+        client->out_head = chunk->next;
+        rendered_release(chunk->shared);
+        free(chunk);
+    }
+    free(client->in_buf);
+    free(client);
+}
+
+// handles one readiness event for the client: sends what it can of the
+// queued output, then reads and handles input unless the client is paused
+// returns the client's fd if it should be closed, 0 otherwise
+int serve_client(EventLoop *loop, Client *client, User **user_list_ptr) {
+    if (flush_output(loop, client) < 0) {
+        return client->sock_fd;
+    }
+    if (client->paused) {
+        return 0;
+    }
+    return read_from(loop, client, user_list_ptr);
+}
+
+// adds data to the end of the client's output queue. shared is the
+// reference keeping data alive (NULL for constant strings), and the queue
+// takes it over
+// returns 0 on success, -1 if the client has too much output queued
+int queue_output(Client *client, const char *data, size_t len, Rendered *shared) {
+    if (len == 0 || client->out_bytes + len > max_queued) {
+        rendered_release(shared);
+        return len == 0 ? 0 : -1;
+    }
+
+    OutChunk *chunk = malloc(sizeof(OutChunk));
+    if (chunk == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    chunk->next = NULL;
+    chunk->data = data;
+    chunk->len = len;
+    chunk->shared = shared;
+    if (client->out_tail == NULL) {
+        client->out_head = chunk;
     } else {
-        strcpy(buf, clients->buf);
-        inbuf = strlen(buf);
-        room = sizeof(buf) - inbuf;
-        after = buf + inbuf;
-    }
-	
-    // read from the client
-    if (read(fd, after, room) > 0) {
-        int where;
-        // this while loop will only trigger if a full read has finished
-        while ((where = find_network_newline(buf, strlen(buf))) > 0) {
-            buf[where - 2] = '\0';
+        client->out_tail->next = chunk;
+    }
+    client->out_tail = chunk;
+    client->out_bytes += len;
+    return 0;
+}
+
+// adds a copy of a short (at most 16 byte) response to the client's output
+// queue, for responses that aren't constant and too small to share
+// returns 0 on success, -1 if the client has too much output queued
+int queue_copy(Client *client, const char *data, size_t len) {
+    if (queue_output(client, data, len, NULL) < 0) {
+        return -1;
+    }
+    OutChunk *chunk = client->out_tail;
+    memcpy(chunk->small, data, len);
+    chunk->data = chunk->small;
+    return 0;
+}
+
+// sends queued output: writes it until the queue is empty or the socket is
+// full, or on an io_uring starts a send of it unless one is in flight.
+// pauses the client's input while more than high_water bytes are left and
+// resumes it once the queue is down to half of that
+// returns 0 on success, -1 if the client can't be written to
+int flush_output(EventLoop *loop, Client *client) {
+#ifdef USE_URING
+    if (use_uring) {
+        if (!client->sending && client->out_head != NULL) {
+            uring_send(loop, client);
+        }
+    } else if (write_output(client) < 0) {
+        return -1;
+    }
+#else
+    if (write_output(client) < 0) {
+        return -1;
+    }
+#endif
+
+    if (client->out_bytes > high_water) {
+        client->paused = 1;
+    } else if (client->out_bytes <= high_water / 2) {
+        client->paused = 0;
+    }
+#ifdef USE_URING
+    if (use_uring && client->paused) {
+        uring_stop_receiving(loop, client);
+    }
+#endif
+    loop_update(loop, client->sock_fd, !client->paused, client->out_bytes > 0);
+    return 0;
+}
+
+// writes queued output until the queue is empty or the socket is full,
+// gathering up to MAX_IOV queued responses into each writev
+// returns 0 on success, -1 if the client can't be written to
+int write_output(Client *client) {
+    while (client->out_head != NULL) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        for (OutChunk *chunk = client->out_head; chunk != NULL && iovcnt < MAX_IOV; chunk = chunk->next) {
+            iov[iovcnt].iov_base = (void *)chunk->data;
+            iov[iovcnt].iov_len = chunk->len;
+            iovcnt++;
+        }
+
+        ssize_t nbytes = writev(client->sock_fd, iov, iovcnt);
+        stats_add(STAT_SYSCALLS, 1);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; // full, wait for the socket to become writable
+            }
+            return -1;
+        }
+        drop_sent(client, nbytes);
+    }
+    return 0;
+}
+
+// drops every queued chunk that went out in full, and trims a partial one
+void drop_sent(Client *client, size_t nbytes) {
+    stats_add(STAT_BYTES_OUT, nbytes);
+    client->out_bytes -= nbytes;
+    while (nbytes > 0) {
+        OutChunk *chunk = client->out_head;
+        if (nbytes < chunk->len) {
+            chunk->data += nbytes;
+            chunk->len -= nbytes;
+            break;
+        }
+        nbytes -= chunk->len;
+        client->out_head = chunk->next;
+        if (client->out_head == NULL) {
+            client->out_tail = NULL;
+        }
+        rendered_release(chunk->shared);
+        free(chunk);
+    }
+}
+
+// remembers that the client has output waiting for the journal commit at
+// the end of this loop iteration
+void mark_dirty(EventLoop *loop, Client *client) {
+    if (client->dirty || client->out_bytes == 0) {
+        return;
+    }
+    if (loop->num_dirty == MAX_EVENTS) {
+        // can't happen (a client is served once per iteration), but stay safe
+        if (journal_commit() == 0) {
+            flush_dirty(loop);
+        }
+    }
+    client->dirty = 1;
+    loop->dirty_fds[loop->num_dirty++] = client->sock_fd;
+}
+
+// sends the output of every client marked dirty, closing the ones that
+// can't be written to
+void flush_dirty(EventLoop *loop) {
+    for (int i = 0; i < loop->num_dirty; i++) {
+        Client *client = loop->clients[loop->dirty_fds[i]];
+        if (client == NULL || !client->dirty) {
+            continue;
+        }
+        client->dirty = 0;
+        if (flush_output(loop, client) < 0) {
+            close_client(loop, client);
+        }
+    }
+    loop->num_dirty = 0;
+}
+
+// handles every full line in the client's buffer, then reads more until the
+// socket is drained. the responses to all of it are queued and sent
+// together once the loop has committed the journal (one writev for a whole
+// burst of pipelined commands), unless the queue passes the high water
+// mark first, in which case the client is paused and the rest of its input
+// is left unread
+// returns the client's fd if the client disconnected, 0 otherwise
+int read_from(EventLoop *loop, Client *client, User **user_list_ptr) {
+    while (1) {
+        int gone = serve_requests(loop, client, user_list_ptr);
+        if (gone != 0) {
+            return gone;
+        }
+        if (client->paused) {
+            return 0;
+        }
+
+        if (make_room(client) < 0) {
+            return client->sock_fd;
+        }
+        // keep one byte free for the null terminator
+        ssize_t nbytes = read(client->sock_fd, client->in_buf + client->in_end,
+                              client->in_cap - 1 - client->in_end);
+        stats_add(STAT_SYSCALLS, 1);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // drained, everything this wakeup produced is sent after the
+                // loop commits the journal
+                mark_dirty(loop, client);
+                return 0;
+            }
+            return client->sock_fd;
+        } else if (nbytes == 0) {
+            return client->sock_fd; // client closed the connection
+        }
+        client->in_end += nbytes;
+        stats_add(STAT_BYTES_IN, nbytes);
+    }
+}
+
+// handles every full request in the client's input buffer, until it runs
+// out of them or the client is paused
+// returns the client's fd if the client should be closed, 0 otherwise
+int serve_requests(EventLoop *loop, Client *client, User **user_list_ptr) {
+    int where = 0;
+    // this while loop will only trigger if a full request has arrived
+    while (!client->paused && (where = next_request(client)) > 0) {
+        if (client->binary) {
+            // frames carry their own length and are answered in place
+            int result = serve_frame(client, where, user_list_ptr);
+            if (result > 0) {
+                journal_commit();
+                flush_output(loop, client);
+            }
+            if (result != 0) {
+                return client->sock_fd;
+            }
+        } else {
+            char *line = client->in_buf + client->in_start;
+            line[where - 2] = '\0';
+            // the tail end of a dropped line isn't a command
+            if (client->in_skip) {
+                client->in_skip = 0;
+                client->in_start += where;
+                continue;
+            }
             // if no username was declared, this read was the client giving a username
-            if (clients->username == NULL) {
-                // allocating space based on if they gave a name longer than 32 chars
-                if (strlen(buf) < 32) {
-                    clients->username = malloc(sizeof(char) * (strlen(buf) + 1));
-                    strncpy(clients->username, buf, strlen(buf));
-                    clients->username[strlen(buf)] = '\0';
-                } else {
-                    clients->username = malloc(sizeof(char) * 32);
-                    strncpy(clients->username, buf, 31);
-                    clients->username[31] = '\0';
-                }
-                // create the new user in our user structure, or welcome them back if they already existed
-                if (create_user(clients->username, user_list_ptr) == 1) {
-                    write(clients->sock_fd, "Welcome back.\nGo ahead and enter user commands>\n", 48);
+            if (client->user == NULL) {
+                // names longer than 31 chars are cut to fit in a User
+                char name[MAX_NAME];
+                strncpy(name, line, MAX_NAME - 1);
+                name[MAX_NAME - 1] = '\0';
+                // create the new user in our user structure, or welcome them back if they already existed,
+                // and keep the user so commands needn't look the name up again
+                uint64_t start = stats_now();
+                int result = create_user(name, user_list_ptr);
+                client->user = find_user(name, __atomic_load_n(user_list_ptr, __ATOMIC_ACQUIRE));
+                if (result == 1) {
+                    queue_output(client, "Welcome back.\nGo ahead and enter user commands>\n", 48, NULL);
                 } else {
-                    write(clients->sock_fd, "Welcome.\nGo ahead and enter user commands>\n", 43);
+                    queue_output(client, "Welcome.\nGo ahead and enter user commands>\n", 43, NULL);
                 }
+                stats_record(STAT_LOGIN, stats_now() - start);
             // this client already gave a username, so this read was a command
             } else {
-                // initialize cmd_argv for processing arguments
-                char *cmd_argv[INPUT_ARG_MAX_NUM];
-                // clone buffer for tokenization
-                char buf_clone[BUFFER_SIZE];
-                strncpy(buf_clone, buf, where - 1);
-                int cmd_argc = tokenize(buf_clone, cmd_argv);
+                // split the line into the command and its arguments, in place
+                Command cmd;
+                parse_command(line, where - 2, server_commands, &cmd);
                 // process the given arguments, to_write contains desired server output
-                char *to_write = process_args(cmd_argc, cmd_argv, user_list_ptr, clients->username);
-                // the user disconnected if to_write is null and they didn't just hit enter
-                if (cmd_argc > 0 && (to_write == NULL)) {
-                    // reset all client attributes we can reset now accordingly (rest done outside helper)
-                    memset(clients->username, '\0', strlen(clients->username));
-                    clients->username = NULL;
-                    free(clients->username);
-                    return clients->sock_fd;
+                Rendered *shared = NULL;
+                uint64_t start = stats_now();
+                char *to_write = process_args(&cmd, user_list_ptr, client->user, &shared);
+                if (cmd.id != CMD_NONE) {
+                    stats_record(stats_command_kind(cmd.id), stats_now() - start);
+                }
+                // the user disconnected if to_write is null
+                if (to_write == NULL) {
+                    journal_commit();
+                    flush_output(loop, client);
+                    return client->sock_fd;
+                }
                 // otherwise, this was another command and we just want to give the output
-                } else {
-                    write(clients->sock_fd, to_write, strlen(to_write));
+                size_t len = shared != NULL ? shared->len : strlen(to_write);
+                if (queue_output(client, to_write, len, shared) < 0) {
+                    return client->sock_fd; // too slow to keep up with its output
                 }
             }
-            // full read finished, so reset buffer
-            memset(buf, '\0', 128);
         }
-        // pass on the full/partial read to buf attribute for next read
-        strcpy(clients->buf, buf);
+        // full request handled
+        client->in_start += where;
+        if (durability == JOURNAL_PER_OP && journal_commit() != 0) {
+            fprintf(stderr, "server: journal write failed, stopping\n");
+            exit(1);
+        }
+
+        // only send early if the client is falling behind
+        if (client->out_bytes > high_water && (journal_commit() != 0 || flush_output(loop, client) < 0)) {
+            return client->sock_fd;
+        }
+    }
+    if (where < -1) {
+        return client->sock_fd; // a frame that can never fit
     }
     return 0;
 }
 
-// locates and returns the position of the network newline (if it exists)
-int find_network_newline(const char *buf, int n) {
-    for (int i = 0; i < n - 1; i++) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n') {
-            return 1 + (i + 1);
-        }
+// finds the next full request in the client's input buffer: a line, or a
+// frame once the client has switched to the binary protocol by sending
+// BIN_HELLO before its name
+// returns the length of the request, -1 if it hasn't fully arrived yet, or
+// -2 if it is a frame too long to ever fit
+int next_request(Client *client) {
+    if (!client->binary && client->user == NULL && client->in_start < client->in_end
+        && client->in_buf[client->in_start] == BIN_HELLO) {
+        client->binary = 1;
+        client->in_start++;
     }
-    return -1;
+    return client->binary ? next_frame(client) : next_line(client);
+}
+
+// finds the next full frame in the client's input buffer
+// returns its length (length prefix included), -1 if it hasn't fully
+// arrived yet, or -2 if it is empty or too long to ever fit
+int next_frame(Client *client) {
+    size_t available = client->in_end - client->in_start;
+    if (available < 4) {
+        return -1;
+    }
+    uint32_t len = bin_get_u32(client->in_buf + client->in_start);
+    // the whole frame and the byte kept free must fit in MAX_LINE
+    if (len < 1 || len > MAX_LINE - 5) {
+        return -2;
+    }
+    return available < 4 + len ? -1 : (int)(4 + len);
+}
+
+// copies a name field into name (cut to fit in a User, like text names)
+// returns 0 on success, -1 if it is empty or has a null byte in it
+int field_name(char *name, const char *field, int len) {
+    if (len > MAX_NAME - 1) {
+        len = MAX_NAME - 1;
+    }
+    if (len == 0 || memchr(field, '\0', len) != NULL) {
+        return -1;
+    }
+    memcpy(name, field, len);
+    name[len] = '\0';
+    return 0;
+}
+
+// queues a response frame with no payload
+// returns 0 on success, -1 if the client has too much output queued
+int queue_status(Client *client, int opcode, int status) {
+    char frame[BIN_HEADER_SIZE];
+    bin_put_u32(frame, BIN_HEADER_SIZE - 4);
+    frame[4] = opcode;
+    frame[5] = status;
+    return queue_copy(client, frame, BIN_HEADER_SIZE);
 }
 
-// tokenizes the given command into different arguments
-int tokenize(char *cmd, char **cmd_argv) {
-    int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
-    while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-            perror("Too many arguments!");
-            cmd_argc = 0;
+// handles one binary request frame of len bytes at the start of the
+// client's input, and queues the response. the fields are used where they
+// are, without copying or tokenizing (see binary.h for the format)
+// returns 0 on success, 1 if the client quit, -1 if the client has too
+// much output queued
+int serve_frame(Client *client, int len, User **user_list_ptr) {
+    char *frame = client->in_buf + client->in_start;
+    int opcode = (unsigned char)frame[4];
+    // split the fields, which must fill the frame exactly
+    char *fields[BIN_MAX_FIELDS];
+    int field_lens[BIN_MAX_FIELDS];
+    int num_fields = 0;
+    char *at = frame + 5;
+    char *end = frame + len;
+    while (at < end) {
+        if (num_fields == BIN_MAX_FIELDS || end - at < 2 || bin_get_u16(at) > end - at - 2) {
+            return queue_status(client, opcode, BIN_BAD_REQUEST);
+        }
+        field_lens[num_fields] = bin_get_u16(at);
+        fields[num_fields] = at + 2;
+        at += 2 + field_lens[num_fields++];
+    }
+    if (opcode == BIN_QUIT) {
+        return 1;
+    }
+    if (client->user == NULL && opcode != BIN_LOGIN && opcode != BIN_PING) {
+        return queue_status(client, opcode, BIN_NOT_LOGGED_IN);
+    }
+
+    uint64_t start = stats_now();
+    User *user_list = __atomic_load_n(user_list_ptr, __ATOMIC_ACQUIRE);
+    StatCommand kind = STAT_INVALID;
+    int status = BIN_BAD_REQUEST;
+    Rendered *shared = NULL;
+    char reply[16];
+    int reply_len = 0;
+    char name[MAX_NAME];
+    switch (opcode) {
+        case BIN_LOGIN:
+            kind = STAT_LOGIN;
+            if (client->user == NULL && num_fields == 1 && field_name(name, fields[0], field_lens[0]) == 0) {
+                int created = create_user(name, user_list_ptr) == 0;
+                User *user = find_user(name, __atomic_load_n(user_list_ptr, __ATOMIC_ACQUIRE));
+                client->user = user;
+                reply_len = BIN_HEADER_SIZE + 5;
+                bin_put_u32(reply, reply_len - 4);
+                reply[4] = opcode;
+                reply[5] = BIN_OK;
+                bin_put_u32(reply + BIN_HEADER_SIZE, user->id);
+                reply[BIN_HEADER_SIZE + 4] = created;
+            }
+            break;
+        case BIN_LIST_USERS:
+            kind = STAT_LIST_USERS;
+            if (num_fields == 0) {
+                shared = cached_user_list(user_list, FORMAT_BINARY);
+            }
+            break;
+        case BIN_MAKE_FRIENDS:
+            kind = STAT_MAKE_FRIENDS;
+            if (num_fields == 1 && field_name(name, fields[0], field_lens[0]) == 0) {
+                static const int statuses[] = {BIN_OK, BIN_ALREADY_FRIENDS, BIN_BAD_REQUEST, BIN_SELF, BIN_NOT_FOUND};
+                status = statuses[make_friends(client->user->name, name, user_list)];
+            }
+            break;
+        case BIN_POST:
+            kind = STAT_POST;
+            if (num_fields == 2 && field_name(name, fields[0], field_lens[0]) == 0
+                && field_lens[1] > 0 && memchr(fields[1], '\0', field_lens[1]) == NULL) {
+                User *target = find_user(name, user_list);
+                // terminate the body in place for make_post (the byte after
+                // it is in the buffer, at worst the one kept free) and put
+                // back what was there
+                char *body = fields[1];
+                char saved = body[field_lens[1]];
+                body[field_lens[1]] = '\0';
+                int result = make_post(client->user, target, body);
+                body[field_lens[1]] = saved;
+                status = result == 0 ? BIN_OK : result == 1 ? BIN_NOT_FRIENDS : BIN_NOT_FOUND;
+            }
+            break;
+        case BIN_PROFILE:
+        case BIN_POSTS:
+            kind = opcode == BIN_PROFILE ? STAT_PROFILE : STAT_POSTS;
+            if (num_fields >= 1 && field_name(name, fields[0], field_lens[0]) == 0) {
+                User *user = find_user(name, user_list);
+                if (num_fields == 1 && opcode == BIN_PROFILE) {
+                    shared = cached_profile(user, FORMAT_BINARY);
+                    break;
+                }
+                // optional u32 limit and cursor
+                unsigned int page[2] = {DEFAULT_PAGE_SIZE, PAGE_NEWEST};
+                for (int i = 1; i < num_fields && i < 3; i++) {
+                    page[i - 1] = field_lens[i] == 4 ? bin_get_u32(fields[i]) : 0;
+                }
+                if (num_fields > 3 || page[0] == 0 || page[1] == 0) {
+                    break;
+                }
+                if (user == NULL) {
+                    status = BIN_NOT_FOUND;
+                } else {
+                    shared = post_page(user, opcode == BIN_PROFILE, page[0], page[1], FORMAT_BINARY);
+                }
+            }
             break;
+        case BIN_FEED:
+            kind = STAT_FEED;
+            if (num_fields == 0 || (num_fields == 1 && field_lens[0] == 4 && bin_get_u32(fields[0]) > 0)) {
+                unsigned int limit = num_fields == 1 ? bin_get_u32(fields[0]) : DEFAULT_PAGE_SIZE;
+                shared = feed_page(client->user, limit, FORMAT_BINARY);
+            }
+            break;
+        case BIN_MUTUAL:
+            kind = STAT_MUTUAL;
+            if (num_fields == 1 && field_name(name, fields[0], field_lens[0]) == 0) {
+                User *other = find_user(name, user_list);
+                if (other == NULL) {
+                    status = BIN_NOT_FOUND;
+                } else {
+                    shared = mutual_friends(client->user, other, FORMAT_BINARY);
+                }
+            }
+            break;
+        case BIN_SUGGEST:
+            kind = STAT_SUGGEST;
+            if (num_fields == 0 || (num_fields == 1 && field_lens[0] == 4 && bin_get_u32(fields[0]) > 0)) {
+                unsigned int k = num_fields == 1 ? bin_get_u32(fields[0]) : DEFAULT_SUGGESTIONS;
+                shared = suggest_friends(client->user, k, FORMAT_BINARY);
+            }
+            break;
+        case BIN_DISTANCE:
+        case BIN_PATH:
+            kind = STAT_DISTANCE;
+            if (num_fields == 2 && field_name(name, fields[0], field_lens[0]) == 0) {
+                char other[MAX_NAME];
+                if (field_name(other, fields[1], field_lens[1]) != 0) {
+                    break;
+                }
+                User *from = find_user(name, user_list);
+                User *to = find_user(other, user_list);
+                if (from == NULL || to == NULL) {
+                    status = BIN_NOT_FOUND;
+                } else {
+                    shared = distance_query(from, to, opcode == BIN_PATH, FORMAT_BINARY);
+                }
+            }
+            break;
+        case BIN_SEARCH:
+            kind = STAT_SEARCH;
+            if ((num_fields == 1 || (num_fields == 2 && field_lens[1] == 4 && bin_get_u32(fields[1]) > 0))
+                && memchr(fields[0], '\0', field_lens[0]) == NULL) {
+                unsigned int limit = num_fields == 2 ? bin_get_u32(fields[1]) : DEFAULT_PAGE_SIZE;
+                // terminated in place, as for BIN_POST
+                char *query = fields[0];
+                char saved = query[field_lens[0]];
+                query[field_lens[0]] = '\0';
+                shared = search_posts(query, limit, FORMAT_BINARY);
+                query[field_lens[0]] = saved;
+            }
+            break;
+        case BIN_PING:
+            kind = STAT_PING;
+            status = num_fields == 0 ? BIN_OK : BIN_BAD_REQUEST;
+            break;
+    }
+    stats_record(kind, stats_now() - start);
+
+    if (shared != NULL) {
+        return queue_output(client, shared->data, shared->len, shared);
+    } else if (reply_len > 0) {
+        return queue_copy(client, reply, reply_len);
+    }
+    return queue_status(client, opcode, status);
+}
+
+// finds the next full line in the client's input buffer, without looking
+// at bytes already scanned
+// returns the length of the line (network newline included), or -1
+int next_line(Client *client) {
+    size_t from = client->in_scanned > client->in_start ? client->in_scanned : client->in_start;
+    // a \r at the end of the scanned part may be completed by the next byte
+    if (from > client->in_start) {
+        from--;
+    }
+    int where = find_network_newline(client->in_buf + from, client->in_end - from);
+    if (where < 0) {
+        client->in_scanned = client->in_end;
+        return -1;
+    }
+    client->in_scanned = from + where;
+    return from + where - client->in_start;
+}
+
+// makes sure the input buffer has room to read into: moves the unhandled
+// input down to the start, or grows the buffer for a long line. a line
+// longer than MAX_LINE can't be handled and is dropped
+// returns 0 on success, -1 if the client should be disconnected
+int make_room(Client *client) {
+    if (client->in_start == client->in_end) {
+        client->in_start = client->in_end = client->in_scanned = 0;
+    }
+    if (client->in_end < client->in_cap - 1) {
+        return 0;
+    }
+
+    size_t pending = client->in_end - client->in_start;
+    if (client->in_start > 0) {
+        memmove(client->in_buf, client->in_buf + client->in_start, pending);
+        client->in_scanned -= client->in_start;
+        client->in_start = 0;
+        client->in_end = pending;
+    } else if (client->in_cap < MAX_LINE) {
+        char *in_buf = realloc(client->in_buf, client->in_cap * 2);
+        if (in_buf == NULL) {
+            perror("realloc");
+            exit(1);
         }
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc++;
-        next_token = strtok(NULL, DELIM);
+        client->in_buf = in_buf;
+        client->in_cap *= 2;
+    } else {
+        client->in_start = client->in_end = client->in_scanned = 0;
+        client->in_skip = 1;
+        return queue_output(client, "Line too long\n", 14, NULL);
     }
+    return 0;
+}
 
-    return cmd_argc;
+// locates and returns the position of the network newline (if it exists)
+int find_network_newline(const char *buf, int n) {
+    const char *end = buf + n;
+    const char *at = buf;
+    while ((at = memchr(at, '\n', end - at)) != NULL) {
+        if (at > buf && at[-1] == '\r') {
+            return at - buf + 1;
+        }
+        at++;
+    }
+    return -1;
 }
 
-// processes the array of arguments given, potentially using the other info passed to it
-char *process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, char *username) {
-    User *user_list = *user_list_ptr;
+// processes the parsed command given, potentially using the other info passed to it
+// output that isn't a constant string is returned through *shared as well,
+// and the caller releases it once written
+char *process_args(const Command *cmd, User **user_list_ptr, User *user, Rendered **shared) {
+    // the list head is set by whichever thread creates the first user
+    User *user_list = __atomic_load_n(user_list_ptr, __ATOMIC_ACQUIRE);
+    switch (cmd->id) {
     // nothing was typed when client hit enter
-    if (cmd_argc <= 0) {
+    case CMD_NONE:
         return "";
     // user is quitting, return null
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+    case CMD_QUIT:
         return NULL;
-    // user wants a user list, use modified list_users function to get correct output
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-        char *buf = list_users(user_list);
-        return buf;
+    // user wants a user list, served from the response cache when nobody joined since
+    case CMD_LIST_USERS:
+        *shared = cached_user_list(user_list, FORMAT_TEXT);
+        return (*shared)->data;
     // user wants to make friends with another, use modified make_friends function to get correct output
     // (and make the nessecary changes in the user structure)
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
-        switch (make_friends(username, cmd_argv[1], user_list)) {
+    case CMD_MAKE_FRIENDS:
+        switch (make_friends(user->name, cmd->argv[0].data, user_list)) {
             case 1:
                 return "You are already friends\n";
-            case 2:
-                return "At least one of you has entered the max number of friends\n";
             case 3:
                 return "You can't friend yourself\n";
             case 4:
@@ -299,49 +1649,204 @@ char *process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, char *us
         }
     // user wants to post to another user, use modified make_post function to get correct output
     // (and make the nessecary changes in the user structure)
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 3; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
-
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[2]);
-        for (int i = 3; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
-
-        User *author = find_user(username, user_list);
-        User *target = find_user(cmd_argv[1], user_list);
-        switch (make_post(author, target, contents)) {
+    case CMD_POST: {
+        // the body is the rest of the line, straight from the input buffer
+        // (make_post keeps its own copy of it)
+        User *target = find_user(cmd->argv[0].data, user_list);
+        switch (make_post(user, target, cmd->rest.data)) {
             case 1:
                 return "You can only post to your friends\n";
             case 2:
                 return "The user you want to post to does not exist\n";
-			default:
-				return "";
+            default:
+                return "";
+        }
+    }
+    // user wants to see a profile, served from the response cache when it hasn't changed,
+    // or a page of a profile's posts (with or without the rest of the profile), newest
+    // first, starting from a cursor given by the last page
+    case CMD_PROFILE:
+    case CMD_POSTS: {
+        User *other = find_user(cmd->argv[0].data, user_list);
+        if (cmd->id == CMD_PROFILE && cmd->argc == 1) {
+            if (other == NULL) {
+                return "User not found\n";
+            }
+            *shared = cached_profile(other, FORMAT_TEXT);
+            return (*shared)->data;
+        }
+        unsigned int limit = DEFAULT_PAGE_SIZE;
+        unsigned int cursor = PAGE_NEWEST;
+        if ((cmd->argc > 1 && parse_count(cmd->argv[1].data, &limit) < 0)
+            || (cmd->argc > 2 && parse_count(cmd->argv[2].data, &cursor) < 0)) {
+            return "Incorrect syntax\n";
         }
-    // user wants to see a profile, use print_user function to get correct output
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
-        if (print_user(user) == NULL) {
+        if (other == NULL) {
             return "User not found\n";
-        } else {
-            char *buf = print_user(user);
-            return buf;
         }
+        *shared = post_page(other, cmd->id == CMD_PROFILE, limit, cursor, FORMAT_TEXT);
+        return (*shared)->data;
+    }
+    // user wants the newest posts on their own and their friends' walls
+    case CMD_FEED: {
+        unsigned int limit = DEFAULT_PAGE_SIZE;
+        if (cmd->argc > 0 && parse_count(cmd->argv[0].data, &limit) < 0) {
+            return "Incorrect syntax\n";
+        }
+        *shared = feed_page(user, limit, FORMAT_TEXT);
+        return (*shared)->data;
+    }
+    // user wants the friends they have in common with another user
+    case CMD_MUTUAL: {
+        User *other = find_user(cmd->argv[0].data, user_list);
+        if (other == NULL) {
+            return "User not found\n";
+        }
+        *shared = mutual_friends(user, other, FORMAT_TEXT);
+        return (*shared)->data;
+    }
+    // user wants friends of their friends to make friends with, most in common first
+    case CMD_SUGGEST: {
+        unsigned int k = DEFAULT_SUGGESTIONS;
+        if (cmd->argc > 0 && parse_count(cmd->argv[0].data, &k) < 0) {
+            return "Incorrect syntax\n";
+        }
+        *shared = suggest_friends(user, k, FORMAT_TEXT);
+        return (*shared)->data;
+    }
+    // user wants to know how many friendships apart two users are, or the way there
+    case CMD_DISTANCE:
+    case CMD_PATH: {
+        User *from = find_user(cmd->argv[0].data, user_list);
+        User *to = find_user(cmd->argv[1].data, user_list);
+        if (from == NULL || to == NULL) {
+            return "User not found\n";
+        }
+        *shared = distance_query(from, to, cmd->id == CMD_PATH, FORMAT_TEXT);
+        return (*shared)->data;
+    }
+    // user wants the newest posts with all of the given words in them
+    case CMD_SEARCH:
+        *shared = search_posts(cmd->rest.data, DEFAULT_PAGE_SIZE, FORMAT_TEXT);
+        return (*shared)->data;
+    // user wants to see how much memory the user structure takes
+    case CMD_MEMORY: {
+        char *buf = memory_report();
+        *shared = rendered_new(buf, strlen(buf), 0);
+        return buf;
+    }
+    // user wants to see how well the response cache works
+    case CMD_CACHE: {
+        char *buf = cache_report();
+        *shared = rendered_new(buf, strlen(buf), 0);
+        return buf;
+    }
+    // snapshot the whole user structure to disk in the background
+    case CMD_SNAPSHOT: {
+        char *buf = start_snapshot();
+        *shared = rendered_new(buf, strlen(buf), 0);
+        return buf;
+    }
+    // counters and per command latencies of the whole server
+    case CMD_STATS: {
+        char *buf = stats_report();
+        *shared = rendered_new(buf, strlen(buf), 0);
+        return buf;
+    }
+    // a no-op with a reply, so pipelining clients (like friend_bench) can tell
+    // where the replies to their other commands end
+    case CMD_PING:
+        return "pong\n";
     // nothing was valid, return message accordingly
-    } else {
+    default:
         return "Incorrect syntax\n";
     }
+}
+
+// reads a positive decimal number, for page limits and cursors
+// returns 0 on success, -1 if arg isn't one
+int parse_count(const char *arg, unsigned int *count) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || *end != '\0' || errno != 0 || value == 0 || value > PAGE_NEWEST) {
+        return -1;
+    }
+    *count = value;
     return 0;
 }
+
+// SIGUSR1 handler, the snapshot is started by the next loop to wake up
+void request_snapshot(int sig) {
+    snapshot_requested = 1;
+}
+
+// forks a child that writes a snapshot of the user structure to
+// snapshot_path. the store is locked while forking so the child sees no
+// half-made change; after that the child works on its own copy on write
+// view and nothing waits for it
+// returns a message saying what happened (the caller frees it)
+char *start_snapshot(void) {
+    char *message = malloc(128);
+    if (message == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    // reap the last snapshot, or leave it be if it is still going
+    int status;
+    if (snapshot_pid > 0) {
+        if (waitpid(snapshot_pid, &status, WNOHANG) == 0) {
+            pthread_mutex_unlock(&snapshot_lock);
+            strcpy(message, "Snapshot already in progress\n");
+            return message;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "server: the last snapshot failed\n");
+        }
+    }
+
+    store_lock_all();
+    uint64_t lsn = journal_lsn();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the child only reads the store, and never takes its locks
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = snapshot_write(snapshot_path, lsn);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (result == 0) {
+            fprintf(stderr, "server: snapshot of %u users written to %s in %.1f ms\n",
+                    user_count(), snapshot_path,
+                    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+        _exit(result);
+    }
+    store_unlock_all();
+
+    if (pid < 0) {
+        perror("server: fork");
+        snapshot_pid = 0;
+        strcpy(message, "Snapshot failed\n");
+    } else {
+        snapshot_pid = pid;
+        snprintf(message, 128, "Snapshot started, writing to %s\n", snapshot_path);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return message;
+}
+
+// writes the stats report to stats_path every stats_interval seconds
+void *dump_stats(void *arg) {
+    // leave SIGUSR1 to the event loops, so it wakes one of them up
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    while (1) {
+        sleep(stats_interval);
+        stats_dump(stats_path);
+    }
+    return NULL;
+}
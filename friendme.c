@@ -2,10 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include "friends.h"
+#include "command.h"
 
 #define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
+
+// the commands friendme knows, and their arguments
+static const CommandSpec friendme_commands[NUM_COMMANDS] = {
+    [CMD_QUIT] = {1, 0, 0, 0},
+    [CMD_LIST_USERS] = {1, 0, 0, 0},
+    [CMD_MAKE_FRIENDS] = {1, 2, 2, 0}, // name1, name2
+    [CMD_POST] = {1, 2, 2, 1}, // author, target, then the body
+    [CMD_PROFILE] = {1, 1, 1, 0}, // name
+    [CMD_MEMORY] = {1, 0, 0, 0}
+};
 
 
 // print a formatted error message to stderr.
@@ -18,26 +27,23 @@ void error(char *msg) {
  * return:  -1 for quit command
  *          0 otherwise
  */
-int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
+int process_args(const Command *cmd, User **user_list_ptr) {
     User *user_list = *user_list_ptr;
 
-    if (cmd_argc <= 0) {
+    if (cmd->id == CMD_NONE) {
         return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+    } else if (cmd->id == CMD_QUIT) {
         return -1;
 
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
+    } else if (cmd->id == CMD_LIST_USERS) {
         char *buf = list_users(user_list);
         printf("%s", buf);
 
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 3) {
-        switch (make_friends(cmd_argv[1], cmd_argv[2], user_list)) {
+    } else if (cmd->id == CMD_MAKE_FRIENDS) {
+        switch (make_friends(cmd->argv[0].data, cmd->argv[1].data, user_list)) {
             case 1:
                 error("users are already friends");
                 break;
-            case 2:
-                error("at least one user you entered has the max number of friends");
-                break;
             case 3:
                 error("you must enter two different users");
                 break;
@@ -45,30 +51,11 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("at least one user you entered does not exist");
                 break;
         }
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 4) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 3; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
-
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[3]);
-        for (int i = 4; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
-
-        User *author = find_user(cmd_argv[1], user_list);
-        User *target = find_user(cmd_argv[2], user_list);
-        switch (make_post(author, target, contents)) {
+    } else if (cmd->id == CMD_POST) {
+        // the body is the rest of the line, as typed (make_post keeps its own copy)
+        User *author = find_user(cmd->argv[0].data, user_list);
+        User *target = find_user(cmd->argv[1].data, user_list);
+        switch (make_post(author, target, cmd->rest.data)) {
             case 1:
                 error("the users are not friends");
                 break;
@@ -76,14 +63,18 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("at least one user you entered does not exist");
                 break;
         }
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
+    } else if (cmd->id == CMD_PROFILE) {
+        User *user = find_user(cmd->argv[0].data, user_list);
         if (print_user(user) == NULL) {
             error("user not found");
         } else {
             char *buf = print_user(user);
             printf("%s", buf);
         }
+    } else if (cmd->id == CMD_MEMORY) {
+        char *buf = memory_report();
+        printf("%s", buf);
+        free(buf);
     } else {
         error("Incorrect syntax");
     }
@@ -91,28 +82,6 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
 }
 
 
-/*
- * tokenize the string stored in cmd
- * return the number of tokens, and store the tokens in cmd_argv
- */
-int tokenize(char *cmd, char **cmd_argv) {
-    int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
-    while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-            error("Too many arguments!");
-            cmd_argc = 0;
-            break;
-        }
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc++;
-        next_token = strtok(NULL, DELIM);
-    }
-
-    return cmd_argc;
-}
-
-
 int main(int argc, char* argv[]) {
     int batch_mode = (argc == 2);
     char input[INPUT_BUFFER_SIZE];
@@ -141,10 +110,10 @@ int main(int argc, char* argv[]) {
             printf("%s", input);
         }
 
-        char *cmd_argv[INPUT_ARG_MAX_NUM];
-        int cmd_argc = tokenize(input, cmd_argv);
+        Command cmd;
+        parse_command(input, strlen(input), friendme_commands, &cmd);
 
-        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &user_list) == -1) {
+        if (process_args(&cmd, &user_list) == -1) {
             break; // can only reach if quit command was entered
         }
 
@@ -1,7 +1,523 @@
 #include "friends.h"
+#include "slab.h"
+#include "strbuf.h"
+#include "binary.h"
+#include "search.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/*
+ * user directory: an open-addressing hash index over the fixed-size
+ * (MAX_NAME, zero padded) names of the users in one list, kept next to
+ * the insertion-ordered User->next list that list_users walks.
+ *
+ * the directory is bound to the list that was started most recently
+ * (create_user on an empty list); lookups on any other list fall back to
+ * a linear scan. when the table fills up a table twice the size is
+ * allocated and a few slots are migrated on every insert, so no single
+ * create_user call pays for a full rehash.
+ */
+#define DIR_INITIAL_CAP 64
+#define DIR_MIGRATE_STEP 64
+
+typedef struct dir_slot {
+    char key[MAX_NAME];
+    unsigned int hash;
+    User *user; // NULL marks an empty slot
+} DirSlot;
+
+typedef struct dir_table {
+    DirSlot *slots;
+    unsigned int cap; // always a power of two
+    unsigned int count;
+} DirTable;
+
+static struct {
+    const User *head; // list this directory indexes
+    User *tail;
+    DirTable cur; // receives all inserts
+    DirTable old; // being drained into cur, slots == NULL when not resizing
+    unsigned int migrate_pos;
+    unsigned long version; // bumped whenever a user is added
+} directory;
+
+
+/*
+ * locking, so the store can be shared by several server threads:
+ *   - dir_lock guards the directory and the User->next list.
+ *   - every user belongs to one of STORE_SHARDS shards (by id), and
+ *     that shard's lock guards the user's friends and posts.
+ * names never change once a user is created, and users are never freed,
+ * so a User pointer (and its name) can be used without holding any lock.
+ * when two shards are needed they are always locked in ascending order.
+ */
+#define STORE_SHARDS 64
+
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t shard_locks[STORE_SHARDS] = {
+    [0 ... STORE_SHARDS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+
+/*
+ * user ids: every user (in any list) gets the next id, and is registered in
+ * a two level table so ids resolve to users without a lock. pages are
+ * never moved once allocated, and a slot is filled (under dir_lock) before
+ * the id can be seen anywhere else. a page keeps its users' fields column
+ * by column: so far the User itself and a copy of its name, which is all
+ * most renders need of a friend or an author, and reading it from a dense
+ * column doesn't pull the much larger User into the cache.
+ */
+#define ID_PAGE_SIZE 4096
+#define ID_PAGES 16384 // up to 64M users
+
+typedef struct id_page {
+    User *users[ID_PAGE_SIZE];
+    char names[ID_PAGE_SIZE][MAX_NAME];
+} IdPage;
+
+/*
+ * storage: users come from one slab (guarded by dir_lock), posts and their
+ * bodies from a slab and an arena per shard (guarded by the shard lock the
+ * post is made under), so no allocation needs a lock of its own.
+ */
+#define USERS_PER_CHUNK 1024
+#define POSTS_PER_CHUNK 1024
+#define BODY_CHUNK_SIZE (64 * 1024)
+
+static Slab user_slab;
+static Slab post_slabs[STORE_SHARDS];
+static Arena body_arenas[STORE_SHARDS];
+static pthread_once_t storage_once = PTHREAD_ONCE_INIT;
+
+
+static void storage_init(void) {
+    slab_init(&user_slab, sizeof(User), USERS_PER_CHUNK);
+    for (int i = 0; i < STORE_SHARDS; i++) {
+        slab_init(&post_slabs[i], sizeof(Post), POSTS_PER_CHUNK);
+        arena_init(&body_arenas[i], BODY_CHUNK_SIZE);
+    }
+}
+
+
+static IdPage *id_pages[ID_PAGES];
+static unsigned int next_user_id;
+
+// sizes of the store for store_counts, updated lock free
+static unsigned long friend_links; // each friendship counts twice
+static unsigned long post_total;
+
+
+// give the user the next id and register it, with dir_lock held
+static int register_user_id(User *user) {
+    unsigned int id = next_user_id;
+    unsigned int page = id / ID_PAGE_SIZE;
+    if (page >= ID_PAGES) {
+        return 1;
+    }
+    if (id_pages[page] == NULL) {
+        IdPage *new_page = calloc(1, sizeof(IdPage));
+        if (new_page == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        __atomic_store_n(&id_pages[page], new_page, __ATOMIC_RELEASE);
+    }
+    user->id = id;
+    memcpy(id_pages[page]->names[id % ID_PAGE_SIZE], user->name, MAX_NAME);
+    __atomic_store_n(&id_pages[page]->users[id % ID_PAGE_SIZE], user, __ATOMIC_RELEASE);
+    __atomic_store_n(&next_user_id, id + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+ * return a pointer to the user with this id
+ * return NULL if no such user exists
+ */
+User *find_user_by_id(unsigned int id) {
+    if (id / ID_PAGE_SIZE >= ID_PAGES) {
+        return NULL;
+    }
+    IdPage *page = __atomic_load_n(&id_pages[id / ID_PAGE_SIZE], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&page->users[id % ID_PAGE_SIZE], __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * return the name of the user with this id, without touching the User
+ * return NULL if no such user exists
+ */
+const char *find_name_by_id(unsigned int id) {
+    if (find_user_by_id(id) == NULL) {
+        return NULL;
+    }
+    return id_pages[id / ID_PAGE_SIZE]->names[id % ID_PAGE_SIZE];
+}
+
+
+// FNV-1a over a zero padded key
+static unsigned int dir_hash(const char *key) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_NAME && key[i] != '\0'; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static void dir_table_init(DirTable *table, unsigned int cap) {
+    table->slots = calloc(cap, sizeof(DirSlot));
+    if (table->slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    table->cap = cap;
+    table->count = 0;
+}
+
+
+static void dir_table_put(DirTable *table, const char *key, unsigned int hash, User *user) {
+    unsigned int mask = table->cap - 1;
+    unsigned int i = hash & mask;
+    while (table->slots[i].user != NULL) {
+        i = (i + 1) & mask;
+    }
+    memcpy(table->slots[i].key, key, MAX_NAME);
+    table->slots[i].hash = hash;
+    table->slots[i].user = user;
+    table->count++;
+}
+
+
+static User *dir_table_get(const DirTable *table, const char *key, unsigned int hash) {
+    if (table->slots == NULL) {
+        return NULL;
+    }
+    unsigned int mask = table->cap - 1;
+    unsigned int i = hash & mask;
+    while (table->slots[i].user != NULL) {
+        if (table->slots[i].hash == hash && memcmp(table->slots[i].key, key, MAX_NAME) == 0) {
+            return table->slots[i].user;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+
+// move up to 'steps' slots from the old table into the current one
+static void dir_migrate(unsigned int steps) {
+    while (directory.old.slots != NULL && steps-- > 0) {
+        DirSlot *slot = &directory.old.slots[directory.migrate_pos];
+        if (slot->user != NULL) {
+            dir_table_put(&directory.cur, slot->key, slot->hash, slot->user);
+        }
+        directory.migrate_pos++;
+        if (directory.migrate_pos == directory.old.cap) {
+            free(directory.old.slots);
+            directory.old.slots = NULL;
+            directory.old.cap = 0;
+            directory.old.count = 0;
+        }
+    }
+}
+
+
+// (re)bind the directory to a new, empty list
+static void dir_reset(const User *head) {
+    free(directory.cur.slots);
+    free(directory.old.slots);
+    memset(&directory, 0, sizeof(directory));
+    directory.head = head;
+    dir_table_init(&directory.cur, DIR_INITIAL_CAP);
+}
+
+
+static void dir_insert(User *user) {
+    // keep the load factor of the current table under 3/4; the old table
+    // always finishes draining before the current one reaches that point
+    if ((directory.cur.count + 1) * 4 > directory.cur.cap * 3) {
+        dir_migrate(directory.old.cap);
+        directory.old = directory.cur;
+        directory.migrate_pos = 0;
+        dir_table_init(&directory.cur, directory.old.cap * 2);
+    }
+    dir_table_put(&directory.cur, user->name, dir_hash(user->name), user);
+    dir_migrate(DIR_MIGRATE_STEP);
+}
+
+
+static User *dir_lookup(const char *key) {
+    unsigned int hash = dir_hash(key);
+    User *user = dir_table_get(&directory.cur, key, hash);
+    if (user == NULL) {
+        user = dir_table_get(&directory.old, key, hash);
+    }
+    return user;
+}
+
+
+static unsigned int user_shard(const User *user) {
+    return user->id % STORE_SHARDS;
+}
+
+
+// copy name into a zero padded MAX_NAME key, return 1 if it doesn't fit
+static int make_key(const char *name, char *key) {
+    size_t len = strnlen(name, MAX_NAME);
+    if (len >= MAX_NAME) {
+        return 1;
+    }
+    memcpy(key, name, len);
+    memset(key + len, '\0', MAX_NAME - len);
+    return 0;
+}
+
+
+static void friend_set_init(FriendSet *set);
+
+
+/*
+ * home feeds. every user has a timeline of the newest FEED_CAP posts made
+ * on its wall or its friends' walls: make_post pushes each post onto the
+ * timelines of the wall's owner and all of the owner's friends (fan out
+ * on write), so reading a feed costs about as much as reading a page.
+ * pushing to every friend of a user with thousands of them would make
+ * each post to that wall slow, though, so once a user has more than
+ * feed_fanout_max friends its posts from then on (index feed_pull_from
+ * and up) only go on its own timeline, and feed_page reads them off the
+ * wall itself (fan out on read). those users are listed in hot_users, so
+ * a reader finds its hot friends by walking whichever of hot_users and
+ * its own friends is shorter.
+ *
+ * a store loaded from a snapshot or journal doesn't push its posts at all:
+ * each timeline is filled from the walls when it is first read instead.
+ *
+ * a timeline is guarded by the feed lock of its user's shard. feed locks
+ * are taken on their own or after shard locks, never the other way
+ * around, and never two at once.
+ */
+#define FEED_PUSH_ALL 0xffffffffu // feed_pull_from while every post is pushed
+#define FEED_INITIAL_CAP 8
+
+static pthread_mutex_t feed_locks[STORE_SHARDS] = {
+    [0 ... STORE_SHARDS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static unsigned int feed_fanout_max = FEED_FANOUT_MAX;
+static unsigned long feed_bytes; // timeline slots allocated, updated lock free
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned int *ids;
+    unsigned int count;
+    unsigned int cap;
+} hot_users = {PTHREAD_MUTEX_INITIALIZER};
+
+
+/*
+ * set how many friends a user can have before its posts stop being pushed
+ * to their feeds (0 to never push, -1 to always push), before any
+ * friendships are made
+ */
+void set_feed_fanout_max(unsigned int max_friends) {
+    feed_fanout_max = max_friends;
+}
+
+
+// put a post on a timeline in date order, dropping the oldest post if the
+// timeline is full, with the feed lock of the timeline's shard held
+static void timeline_push(Timeline *feed, Post *post) {
+    if (feed->count == feed->cap && feed->cap < FEED_CAP) {
+        unsigned int cap = feed->cap == 0 ? FEED_INITIAL_CAP : feed->cap * 2;
+        Post **items = malloc(sizeof(Post *) * cap);
+        if (items == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < feed->count; i++) {
+            items[i] = feed->items[(feed->start + i) & (feed->cap - 1)];
+        }
+        __atomic_add_fetch(&feed_bytes, sizeof(Post *) * (cap - feed->cap), __ATOMIC_RELAXED);
+        free(feed->items);
+        feed->items = items;
+        feed->start = 0;
+        feed->cap = cap;
+    }
+
+    // posts nearly always arrive in date order, so this rarely moves any
+    unsigned int mask = feed->cap - 1;
+    unsigned int pos = feed->count;
+    while (pos > 0 && feed->items[(feed->start + pos - 1) & mask]->date > post->date) {
+        pos--;
+    }
+    if (feed->count == feed->cap) {
+        if (pos == 0) {
+            return; // older than everything kept
+        }
+        feed->start = (feed->start + 1) & mask;
+        feed->count--;
+        pos--;
+    }
+    for (unsigned int i = feed->count; i > pos; i--) {
+        feed->items[(feed->start + i) & mask] = feed->items[(feed->start + i - 1) & mask];
+    }
+    feed->items[(feed->start + pos) & mask] = post;
+    feed->count++;
+}
+
+
+// put a new post on the feeds it belongs in, with the target's shard
+// locked for writing
+static void feed_fan_out(User *target, Post *post) {
+    unsigned int shard = user_shard(target);
+    pthread_mutex_lock(&feed_locks[shard]);
+    timeline_push(&target->feed, post);
+    pthread_mutex_unlock(&feed_locks[shard]);
+    if (target->feed_pull_from != FEED_PUSH_ALL) {
+        return; // readers pull it from the wall
+    }
+
+    for (unsigned int i = 0; i < target->friends.count; i++) {
+        User *friend = find_user_by_id(target->friends.ids[i]);
+        shard = user_shard(friend);
+        pthread_mutex_lock(&feed_locks[shard]);
+        timeline_push(&friend->feed, post);
+        pthread_mutex_unlock(&feed_locks[shard]);
+    }
+}
+
+
+// after the user gained friends (with its shard locked for writing), stop
+// pushing its posts if it has too many now
+static void feed_check_degree(User *user) {
+    if (user->feed_pull_from != FEED_PUSH_ALL || user->friends.count <= feed_fanout_max) {
+        return;
+    }
+    __atomic_store_n(&user->feed_pull_from, user->posts.count, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&hot_users.lock);
+    if (hot_users.count == hot_users.cap) {
+        unsigned int cap = hot_users.cap == 0 ? 64 : hot_users.cap * 2;
+        unsigned int *ids = realloc(hot_users.ids, sizeof(unsigned int) * cap);
+        if (ids == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        hot_users.ids = ids;
+        hot_users.cap = cap;
+    }
+    hot_users.ids[hot_users.count] = user->id;
+    __atomic_store_n(&hot_users.count, hot_users.count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hot_users.lock);
+}
+
+
+/*
+ * change hooks (e.g. a journal), called after every successful create_user,
+ * make_friends and make_post while the locks covering the change are still
+ * held: a change that depends on another (a post between friends, a
+ * friendship with a new user) can only happen after the hook for the
+ * other one has returned, so hooks see changes in an order that can be
+ * replayed.
+ */
+static StoreHooks hooks;
+
+
+/*
+ * set the hooks called on every change to the store (NULL to stop),
+ * before other threads start using it
+ */
+void set_store_hooks(const StoreHooks *new_hooks) {
+    if (new_hooks == NULL) {
+        memset(&hooks, 0, sizeof(hooks));
+    } else {
+        hooks = *new_hooks;
+    }
+}
+
+
+static void notify_user_created(const User *user) {
+    if (hooks.user_created != NULL) {
+        hooks.user_created(hooks.arg, user);
+    }
+}
+
+
+// create_user with dir_lock held for writing and a valid key
+static int create_user_locked(const char *key, User **user_ptr_add) {
+    const char *name = key;
+
+    int indexed = (*user_ptr_add == NULL || *user_ptr_add == directory.head);
+    if (indexed && *user_ptr_add != NULL && dir_lookup(key) != NULL) {
+        return 1;
+    }
+
+    // unindexed list, find the tail (or an existing user) by walking it
+    User *prev = NULL;
+    if (!indexed) {
+        User *curr = *user_ptr_add;
+        while (curr != NULL && strcmp(curr->name, name) != 0) {
+            prev = curr;
+            curr = curr->next;
+        }
+        if (curr != NULL) {
+            return 1;
+        }
+    }
+
+    User *new_user = slab_alloc(&user_slab);
+    memcpy(new_user->name, key, MAX_NAME);
+
+    for (int i = 0; i < MAX_NAME; i++) {
+        new_user->profile_pic[i] = '\0';
+    }
+
+    new_user->posts.items = NULL;
+    new_user->posts.count = 0;
+    new_user->posts.cap = 0;
+    new_user->feed.items = NULL;
+    new_user->feed.start = 0;
+    new_user->feed.count = 0;
+    new_user->feed.cap = 0;
+    new_user->feed_pull_from = FEED_PUSH_ALL;
+    new_user->next = NULL;
+    friend_set_init(&new_user->friends);
+    if (register_user_id(new_user) != 0) {
+        fprintf(stderr, "create_user: out of user ids\n");
+        exit(1);
+    }
+
+    // Add user to list
+    if (*user_ptr_add == NULL) {
+        // other threads may read the head without taking dir_lock
+        __atomic_store_n(user_ptr_add, new_user, __ATOMIC_RELEASE);
+        dir_reset(new_user);
+    } else if (indexed) {
+        directory.tail->next = new_user;
+    } else {
+        prev->next = new_user;
+        notify_user_created(new_user);
+        return 0;
+    }
+    directory.tail = new_user;
+    dir_insert(new_user);
+    directory.version++;
+    notify_user_created(new_user);
+    return 0;
+}
 
 
 /*
@@ -15,266 +531,2145 @@
  *       (don't forget about the null terminator).
  */
 int create_user(const char *name, User **user_ptr_add) {
-    if (strlen(name) >= MAX_NAME) {
+    char key[MAX_NAME];
+    if (make_key(name, key) != 0) {
         return 2;
     }
 
-    User *new_user = malloc(sizeof(User));
-    if (new_user == NULL) {
+    pthread_once(&storage_once, storage_init);
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = create_user_locked(key, user_ptr_add);
+    pthread_rwlock_unlock(&dir_lock);
+    return result;
+}
+
+
+/*
+ * return a pointer to the user with this name in the list starting with head 
+ * return NULL if no such user exists
+ */
+User *find_user(const char *name, const User *head) {
+    pthread_rwlock_rdlock(&dir_lock);
+    if (head != NULL && head == directory.head) {
+        char key[MAX_NAME];
+        User *user = NULL;
+        if (make_key(name, key) == 0) {
+            user = dir_lookup(key);
+        }
+        pthread_rwlock_unlock(&dir_lock);
+        return user;
+    }
+
+    while (head != NULL && strcmp(name, head->name) != 0) {
+        head = head->next;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+
+    return (User *)head;
+}
+
+
+// list_users with dir_lock held
+static char *render_user_list(const User *curr) {
+    StrBuf out;
+    sb_init(&out, 1024);
+    sb_puts(&out, "User List\n");
+    while (curr != NULL) {
+        sb_append(&out, "\t", 1);
+        sb_append(&out, curr->name, strnlen(curr->name, MAX_NAME));
+        sb_append(&out, "\n", 1);
+        curr = curr->next;
+    }
+    return sb_finish(&out);
+}
+
+
+// append an integer of the given size in bytes, little endian
+static void sb_put_uint(StrBuf *out, uint64_t value, int bytes) {
+    char buf[8];
+    for (int i = 0; i < bytes; i++) {
+        buf[i] = value >> (8 * i);
+    }
+    sb_append(out, buf, bytes);
+}
+
+
+// start a binary response frame, with its length left to frame_finish
+static void frame_start(StrBuf *out, int opcode) {
+    char header[BIN_HEADER_SIZE] = {0, 0, 0, 0, opcode, BIN_OK};
+    sb_append(out, header, BIN_HEADER_SIZE);
+}
+
+
+static char *frame_finish(StrBuf *out, size_t *len) {
+    bin_put_u32(out->data, out->len - 4);
+    *len = out->len;
+    return sb_finish(out);
+}
+
+
+// append a user as id, name length and name
+static void put_user_ref(StrBuf *out, unsigned int id) {
+    const char *name = find_name_by_id(id);
+    size_t len = strnlen(name, MAX_NAME);
+    sb_put_uint(out, id, 4);
+    sb_put_uint(out, len, 1);
+    sb_append(out, name, len);
+}
+
+
+// append the name of the user with this id
+static void append_name(StrBuf *out, unsigned int id) {
+    const char *name = find_name_by_id(id);
+    sb_append(out, name, strnlen(name, MAX_NAME));
+}
+
+
+// list_users as a binary frame, with dir_lock held
+static char *render_user_list_binary(const User *curr, size_t *len) {
+    StrBuf out;
+    sb_init(&out, 1024);
+    frame_start(&out, BIN_LIST_USERS);
+    sb_put_uint(&out, 0, 4);
+    uint32_t count = 0;
+    for (; curr != NULL; curr = curr->next) {
+        put_user_ref(&out, curr->id);
+        count++;
+    }
+    bin_put_u32(out.data + BIN_HEADER_SIZE, count);
+    return frame_finish(&out, len);
+}
+
+
+/*
+ * print the usernames of all users in the list starting at curr
+ */
+char *list_users(const User *curr) {
+    pthread_rwlock_rdlock(&dir_lock);
+    char *user_string = render_user_list(curr);
+    pthread_rwlock_unlock(&dir_lock);
+    return user_string;
+}
+
+
+/*
+ * friend sets. ids are kept sorted so friends print in a stable order (the
+ * order the users were created in) and sets can be merged or intersected
+ * cheaply; past FRIEND_INDEX_MIN friends a hash index of the same ids
+ * (load factor at most 1/2) answers membership checks.
+ */
+#define FRIEND_INDEX_MIN 64
+#define FRIEND_EMPTY 0xffffffffu
+
+static void friend_set_init(FriendSet *set) {
+    set->ids = set->inline_ids;
+    set->count = 0;
+    set->cap = FRIEND_INLINE;
+    set->index = NULL;
+    set->index_cap = 0;
+}
+
+
+static unsigned int friend_hash(unsigned int id) {
+    id ^= id >> 16;
+    id *= 0x7feb352du;
+    id ^= id >> 15;
+    return id;
+}
+
+
+static void friend_index_put(FriendSet *set, unsigned int id) {
+    unsigned int mask = set->index_cap - 1;
+    unsigned int i = friend_hash(id) & mask;
+    while (set->index[i] != FRIEND_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    set->index[i] = id;
+}
+
+
+// (re)build the hash index with room for at least 2 * cap ids
+static void friend_index_build(FriendSet *set) {
+    unsigned int index_cap = 2 * FRIEND_INDEX_MIN;
+    while (index_cap < 2 * set->cap) {
+        index_cap *= 2;
+    }
+    free(set->index);
+    set->index = malloc(sizeof(unsigned int) * index_cap);
+    if (set->index == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(set->index, 0xff, sizeof(unsigned int) * index_cap);
+    set->index_cap = index_cap;
+    for (unsigned int i = 0; i < set->count; i++) {
+        friend_index_put(set, set->ids[i]);
+    }
+}
+
+
+// position of the first id >= the given one
+static unsigned int friend_lower_bound(const FriendSet *set, unsigned int id) {
+    unsigned int lo = 0;
+    unsigned int hi = set->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (set->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+static int friend_set_contains(const FriendSet *set, unsigned int id) {
+    if (set->index != NULL) {
+        unsigned int mask = set->index_cap - 1;
+        unsigned int i = friend_hash(id) & mask;
+        while (set->index[i] != FRIEND_EMPTY) {
+            if (set->index[i] == id) {
+                return 1;
+            }
+            i = (i + 1) & mask;
+        }
+        return 0;
+    }
+    unsigned int pos = friend_lower_bound(set, id);
+    return pos < set->count && set->ids[pos] == id;
+}
+
+
+// add an id that isn't in the set yet
+static void friend_set_add(FriendSet *set, unsigned int id) {
+    if (set->count == set->cap) {
+        unsigned int cap = set->cap * 2;
+        unsigned int *ids;
+        if (set->ids == set->inline_ids) {
+            ids = malloc(sizeof(unsigned int) * cap);
+            if (ids != NULL) {
+                memcpy(ids, set->inline_ids, sizeof(set->inline_ids));
+            }
+        } else {
+            ids = realloc(set->ids, sizeof(unsigned int) * cap);
+        }
+        if (ids == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        set->ids = ids;
+        set->cap = cap;
+    }
+
+    unsigned int pos = friend_lower_bound(set, id);
+    memmove(set->ids + pos + 1, set->ids + pos, sizeof(unsigned int) * (set->count - pos));
+    set->ids[pos] = id;
+    set->count++;
+
+    if (set->count > FRIEND_INDEX_MIN && set->index_cap < 2 * set->cap) {
+        friend_index_build(set);
+    } else if (set->index != NULL) {
+        friend_index_put(set, id);
+    }
+}
+
+
+/*
+ * return 1 if other is one of user's friends, 0 otherwise
+ * (friendship is symmetric, so the order of the two users doesn't matter)
+ */
+int is_friend(const User *user, const User *other) {
+    pthread_rwlock_rdlock(&shard_locks[user_shard(user)]);
+    int result = friend_set_contains(&user->friends, other->id);
+    pthread_rwlock_unlock(&shard_locks[user_shard(user)]);
+    return result;
+}
+
+
+/*
+ * make two users friends with each other (symmetric - the id of
+ * each user is stored in the friend set of the other)
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the two users are already friends.
+ *   - 3 if the same user is passed in twice.
+ *   - 4 if at least one user does not exist.
+ * (2 used to mean a user had too many friends; friend sets are unbounded)
+ */
+int make_friends(const char *name1, const char *name2, User *head) {
+    User *user1 = find_user(name1, head);
+    User *user2 = find_user(name2, head);
+
+    if (user1 == NULL || user2 == NULL) {
+        return 4;
+    } else if (user1 == user2) { // Same user
+        return 3;
+    }
+
+    unsigned int shard1 = user_shard(user1);
+    unsigned int shard2 = user_shard(user2);
+    if (shard1 > shard2) {
+        unsigned int tmp = shard1;
+        shard1 = shard2;
+        shard2 = tmp;
+    }
+    pthread_rwlock_wrlock(&shard_locks[shard1]);
+    if (shard2 != shard1) {
+        pthread_rwlock_wrlock(&shard_locks[shard2]);
+    }
+
+    int result = 1; // Already friends.
+    if (!friend_set_contains(&user1->friends, user2->id)) {
+        friend_set_add(&user1->friends, user2->id);
+        friend_set_add(&user2->friends, user1->id);
+        // both profiles list the other's name now
+        user1->version++;
+        user2->version++;
+        feed_check_degree(user1);
+        feed_check_degree(user2);
+        __atomic_add_fetch(&friend_links, 2, __ATOMIC_RELAXED);
+        if (hooks.friends_made != NULL) {
+            hooks.friends_made(hooks.arg, user1, user2);
+        }
+        result = 0;
+    }
+
+    if (shard2 != shard1) {
+        pthread_rwlock_unlock(&shard_locks[shard2]);
+    }
+    pthread_rwlock_unlock(&shard_locks[shard1]);
+    return result;
+}
+
+
+/*
+ * cold posts: once set_post_budget is called, a shard whose bodies take
+ * more than its share of the budget writes its oldest arena chunk, as is,
+ * to the end of the cold segment (an append-only file) and frees it. the
+ * posts in that chunk only keep the offset their body landed at, and are
+ * read back with pread when rendered. hot_posts keeps each shard's posts
+ * with bodies in the arena in arena order, so the posts of the oldest
+ * chunk are at its front.
+ *
+ * a shard's bodies are spilled with its lock held for writing and read
+ * with it held for reading, like the rest of its posts. a profile that
+ * needs cold bodies isn't cached, and spilling drops the cached profiles
+ * of the walls it spills from, so the response cache doesn't bring cold
+ * bodies back into memory. posts restored
+ * from a snapshot are already file backed, and never spilled.
+ */
+#define HOT_INITIAL_CAP 1024
+
+typedef struct hot_posts {
+    Post **items;
+    unsigned int start;
+    unsigned int count;
+    unsigned int cap; // a power of two
+} HotPosts;
+
+static size_t shard_budget; // body bytes a shard keeps, 0 for no limit
+static int cold_fd = -1;
+static int cold_failed; // set once a write fails, after which nothing is spilled
+static uint64_t cold_end; // bytes handed out in the cold segment, updated lock free
+static unsigned long cold_posts; // updated lock free
+static HotPosts hot_posts[STORE_SHARDS];
+
+static void drop_cached_profiles(User *user);
+
+
+/*
+ * keep post bodies within about budget bytes of memory from now on, by
+ * spilling the oldest ones to a cold segment at cold_path (truncated
+ * first). called before any post is made
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the cold segment couldn't be opened.
+ */
+int set_post_budget(size_t budget, const char *cold_path) {
+    int fd = open(cold_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(cold_path);
+        return 1;
+    }
+    cold_fd = fd;
+    // at least the chunk being filled always stays
+    shard_budget = budget / STORE_SHARDS > 0 ? budget / STORE_SHARDS : 1;
+    return 0;
+}
+
+
+// remember a new post with its body in the shard's arena, with the shard
+// locked for writing
+static void hot_push(HotPosts *hot, Post *post) {
+    if (hot->count == hot->cap) {
+        unsigned int cap = hot->cap == 0 ? HOT_INITIAL_CAP : hot->cap * 2;
+        Post **items = malloc(sizeof(Post *) * cap);
+        if (items == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < hot->count; i++) {
+            items[i] = hot->items[(hot->start + i) & (hot->cap - 1)];
+        }
+        free(hot->items);
+        hot->items = items;
+        hot->start = 0;
+        hot->cap = cap;
+    }
+    hot->items[(hot->start + hot->count) & (hot->cap - 1)] = post;
+    hot->count++;
+}
+
+
+// write len bytes at offset of the cold segment
+// return 0 on success, 1 if the write failed
+static int cold_write(const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(cold_fd, data, len, offset);
+        if (written < 0) {
+            return 1;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+
+// while the shard is over budget, move its oldest chunk of bodies to the
+// cold segment, with the shard locked for writing
+static void spill_cold(unsigned int shard) {
+    Arena *arena = &body_arenas[shard];
+    HotPosts *hot = &hot_posts[shard];
+    while (arena->bytes_reserved > shard_budget && arena->first != arena->last) {
+        ArenaChunk *chunk = arena->first;
+        uint64_t offset = __atomic_fetch_add(&cold_end, chunk->used, __ATOMIC_RELAXED);
+        if (cold_write(chunk->data, chunk->used, offset) != 0) {
+            perror("cold segment");
+            __atomic_store_n(&cold_failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        unsigned int moved = 0;
+        while (moved < hot->count) {
+            Post *post = hot->items[(hot->start + moved) & (hot->cap - 1)];
+            if (post->contents < chunk->data || post->contents >= chunk->data + chunk->used) {
+                break;
+            }
+            post->cold_offset = offset + (post->contents - chunk->data);
+            post->contents = NULL;
+            drop_cached_profiles(find_user_by_id(post->target_id));
+            moved++;
+        }
+        hot->start = (hot->start + moved) & (hot->cap - 1);
+        hot->count -= moved;
+        __atomic_add_fetch(&cold_posts, moved, __ATOMIC_RELAXED);
+        arena_drop_first(arena);
+    }
+}
+
+
+/*
+ * return the body of a post: in place while it's in memory, or read from
+ * the cold segment into buf (which has room for length + 1 bytes) once it
+ * has been spilled. the post's shard must be locked (or the store left
+ * alone, as in a snapshot child). a body that can't be read back is lost
+ * for good, so that is fatal.
+ */
+const char *post_body(const Post *post, char *buf) {
+    if (post->contents != NULL) {
+        return post->contents;
+    }
+    size_t done = 0;
+    while (done < post->length) {
+        ssize_t got = pread(cold_fd, buf + done, post->length - done, post->cold_offset + done);
+        if (got <= 0) {
+            perror("cold segment");
+            exit(1);
+        }
+        done += got;
+    }
+    buf[post->length] = '\0';
+    return buf;
+}
+
+
+// append a post's body, with its shard locked
+static void append_body(StrBuf *out, const Post *post) {
+    if (post->contents != NULL) {
+        sb_append(out, post->contents, post->length);
+        return;
+    }
+    // post_body fills length + 1 bytes, the last one being sb's terminator
+    char *dest = sb_extend(out, post->length);
+    post_body(post, dest);
+}
+
+
+#define SEPARATOR "------------------------------------------\n"
+
+
+// append a post to the output, saying whose wall it's on if with_target
+static void append_post(StrBuf *out, const Post *post, int with_target) {
+    sb_puts(out, "From: ");
+    append_name(out, post->author_id);
+    if (with_target) {
+        sb_puts(out, "\nTo: ");
+        append_name(out, post->target_id);
+    }
+    sb_puts(out, "\nDate: ");
+    sb_puts(out, post->date_text);
+    sb_append(out, "\n", 1);
+    append_body(out, post);
+    sb_append(out, "\n", 1);
+}
+
+
+// append the posts with index in [from, to), newest first
+static void append_posts(StrBuf *out, const PostList *posts, unsigned int from, unsigned int to) {
+    for (unsigned int i = to; i > from; i--) {
+        append_post(out, posts->items[i - 1], 0);
+        if (i - 1 > from) {
+            sb_puts(out, "\n===\n\n");
+        }
+    }
+}
+
+
+// after a page that stopped short of the oldest post, say where to go on
+static void append_next(StrBuf *out, unsigned int from) {
+    if (from > 0) {
+        char line[32];
+        snprintf(line, sizeof(line), "Next: %u\n", from);
+        sb_puts(out, line);
+    }
+}
+
+
+// print_user with the user's shard locked for reading, showing the posts
+// with index in [from, to)
+static char *render_profile(const User *user, unsigned int from, unsigned int to) {
+    StrBuf out;
+    sb_init(&out, 256);
+    sb_puts(&out, "Name: ");
+    sb_puts(&out, user->name);
+    sb_puts(&out, "\n\n" SEPARATOR "Friends:\n");
+    for (unsigned int i = 0; i < user->friends.count; i++) {
+        append_name(&out, user->friends.ids[i]);
+        sb_append(&out, "\n", 1);
+    }
+    sb_puts(&out, SEPARATOR "Posts:\n");
+    append_posts(&out, &user->posts, from, to);
+    sb_puts(&out, SEPARATOR);
+    append_next(&out, from);
+    return sb_finish(&out);
+}
+
+
+// append the posts with index in [from, to) in binary: their count, the
+// posts newest first, then the cursor of the next page (0 if none)
+static void put_posts(StrBuf *out, const PostList *posts, unsigned int from, unsigned int to) {
+    sb_put_uint(out, to - from, 4);
+    for (unsigned int i = to; i > from; i--) {
+        const Post *post = posts->items[i - 1];
+        sb_put_uint(out, (uint64_t)post->date, 8);
+        sb_put_uint(out, post->author_id, 4);
+        sb_put_uint(out, post->length, 4);
+        append_body(out, post);
+    }
+    sb_put_uint(out, from, 4);
+}
+
+
+// render_profile as a binary frame
+static char *render_profile_binary(const User *user, unsigned int from, unsigned int to, size_t *len) {
+    StrBuf out;
+    sb_init(&out, 256);
+    frame_start(&out, BIN_PROFILE);
+    put_user_ref(&out, user->id);
+    sb_put_uint(&out, user->friends.count, 4);
+    for (unsigned int i = 0; i < user->friends.count; i++) {
+        put_user_ref(&out, user->friends.ids[i]);
+    }
+    put_posts(&out, &user->posts, from, to);
+    return frame_finish(&out, len);
+}
+
+
+/*
+ * return a page of the user's posts, newest first: at most limit posts
+ * older than the cursor before (PAGE_NEWEST to start at the newest), with
+ * the rest of the profile if with_profile is set. when older posts are
+ * left, the page ends with the cursor of the next one. costs the size of
+ * the page, however many posts the user has. the caller releases the
+ * returned reference.
+ */
+Rendered *post_page(const User *user, int with_profile, unsigned int limit, unsigned int before,
+                    RenderFormat format) {
+    unsigned int shard = user_shard(user);
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    unsigned int to = before < user->posts.count ? before : user->posts.count;
+    unsigned int from = to > limit ? to - limit : 0;
+    size_t len;
+    char *data;
+    if (with_profile) {
+        if (format == FORMAT_BINARY) {
+            data = render_profile_binary(user, from, to, &len);
+        } else {
+            data = render_profile(user, from, to);
+            len = strlen(data);
+        }
+    } else {
+        StrBuf out;
+        sb_init(&out, 256);
+        if (format == FORMAT_BINARY) {
+            frame_start(&out, BIN_POSTS);
+            put_posts(&out, &user->posts, from, to);
+            data = frame_finish(&out, &len);
+        } else {
+            sb_puts(&out, "Posts:\n");
+            append_posts(&out, &user->posts, from, to);
+            sb_puts(&out, SEPARATOR);
+            append_next(&out, from);
+            len = out.len;
+            data = sb_finish(&out);
+        }
+    }
+    pthread_rwlock_unlock(&shard_locks[shard]);
+    return rendered_new(data, len, 0);
+}
+
+
+// add a post as the user's newest, with the user's shard locked for writing
+static void post_list_append(PostList *list, Post *post) {
+    if (list->count == list->cap) {
+        unsigned int cap = list->cap == 0 ? 4 : list->cap * 2;
+        Post **items = realloc(list->items, sizeof(Post *) * cap);
+        if (items == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = post;
+}
+
+
+/*
+ * posts restored from a snapshot or journal aren't indexed while the
+ * store loads: restore_post queues them, and start_search_index indexes
+ * them on a thread of its own once loading is done, in the order they
+ * were made (a snapshot restores them a wall at a time). until it gets
+ * through the queue, new posts are queued behind them (so they still get
+ * document ids in the order they were made) and search_posts says search
+ * isn't ready.
+ */
+#define SEARCH_BATCH 256 // posts the indexing thread takes off the queue at a time
+
+static struct {
+    pthread_mutex_t lock;
+    Post **posts;
+    size_t count;
+    size_t cap;
+    size_t next; // the first post not indexed yet
+    int building; // set while posts are queued, read lock free
+} search_queue = {PTHREAD_MUTEX_INITIALIZER};
+
+
+// queue a post to be indexed, with search_queue.lock held
+static void search_queue_push(Post *post) {
+    if (search_queue.count == search_queue.cap) {
+        size_t cap = search_queue.cap == 0 ? 1024 : search_queue.cap * 2;
+        Post **posts = realloc(search_queue.posts, sizeof(Post *) * cap);
+        if (posts == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        search_queue.posts = posts;
+        search_queue.cap = cap;
+    }
+    search_queue.posts[search_queue.count++] = post;
+}
+
+
+// add a new post to the search index, or to the queue while it's built
+static void index_post(Post *post) {
+    if (__atomic_load_n(&search_queue.building, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&search_queue.lock);
+        if (search_queue.building) {
+            search_queue_push(post);
+            pthread_mutex_unlock(&search_queue.lock);
+            return;
+        }
+        pthread_mutex_unlock(&search_queue.lock);
+    }
+    search_add(post->contents, post);
+}
+
+
+// a restored post in the order it was made
+typedef struct post_order {
+    time_t date; // the latest of the post's and those before it on the wall
+    size_t index; // in the queue
+} PostOrder;
+
+
+static int oldest_first(const void *a, const void *b) {
+    const PostOrder *post_a = a;
+    const PostOrder *post_b = b;
+    if (post_a->date != post_b->date) {
+        return post_a->date < post_b->date ? -1 : 1;
+    }
+    return post_a->index < post_b->index ? -1 : post_a->index > post_b->index;
+}
+
+
+// put restored posts (in the order they were queued) in the order they
+// were made. a wall's own posts keep their order (if the clock went back,
+// the wall's order wins)
+static void order_restored(Post **posts, size_t count) {
+    PostOrder *order = malloc(sizeof(PostOrder) * (count > 0 ? count : 1));
+    Post **queued = malloc(sizeof(Post *) * (count > 0 ? count : 1));
+    if (order == NULL || queued == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        order[i].date = posts[i]->date;
+        if (i > 0 && posts[i - 1]->target_id == posts[i]->target_id && order[i - 1].date > posts[i]->date) {
+            order[i].date = order[i - 1].date;
+        }
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(PostOrder), oldest_first);
+    memcpy(queued, posts, sizeof(Post *) * count);
+    for (size_t i = 0; i < count; i++) {
+        posts[i] = queued[order[i].index];
+    }
+    free(queued);
+    free(order);
+}
+
+
+// add a queued post to the index, with its wall's shard locked for reading
+// since a post queued after loading may have been spilled since
+static void index_queued(Post *post) {
+    unsigned int shard = user_shard(find_user_by_id(post->target_id));
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    if (post->contents != NULL) {
+        search_add(post->contents, post);
+    } else {
+        char *buf = malloc(post->length + 1);
+        if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        search_add(post_body(post, buf), post);
+        free(buf);
+    }
+    pthread_rwlock_unlock(&shard_locks[shard]);
+}
+
+
+// index the restored posts in order, then what was queued meanwhile, then
+// let new posts be indexed directly
+static void *build_search_index(void *arg) {
+    pthread_mutex_lock(&search_queue.lock);
+    Post **restored = search_queue.posts;
+    size_t num_restored = search_queue.count;
+    search_queue.posts = NULL;
+    search_queue.count = search_queue.cap = 0;
+    pthread_mutex_unlock(&search_queue.lock);
+    order_restored(restored, num_restored);
+    for (size_t i = 0; i < num_restored; i++) {
+        index_queued(restored[i]);
+    }
+    free(restored);
+
+    Post *batch[SEARCH_BATCH];
+    while (1) {
+        unsigned int count = 0;
+        pthread_mutex_lock(&search_queue.lock);
+        while (count < SEARCH_BATCH && search_queue.next < search_queue.count) {
+            batch[count++] = search_queue.posts[search_queue.next++];
+        }
+        if (count == 0) {
+            free(search_queue.posts);
+            search_queue.posts = NULL;
+            search_queue.count = search_queue.cap = search_queue.next = 0;
+            __atomic_store_n(&search_queue.building, 0, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&search_queue.lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&search_queue.lock);
+        for (unsigned int i = 0; i < count; i++) {
+            index_queued(batch[i]);
+        }
+    }
+}
+
+
+/*
+ * start indexing the posts restored so far in the background, once the
+ * store is loaded. does nothing if none were.
+ */
+void start_search_index(void) {
+    if (!__atomic_load_n(&search_queue.building, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, build_search_index, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+
+/*
+ * print a user profile
+ * return the profile, or "User not found" if the user is NULL
+ * (the caller frees the returned string)
+ */
+char *print_user(const User *user) {
+    if (user == NULL) {
+        return strdup("User not found\n");
+    }
+
+    pthread_rwlock_rdlock(&shard_locks[user_shard(user)]);
+    char *profile_string = render_profile(user, 0, user->posts.count);
+    pthread_rwlock_unlock(&shard_locks[user_shard(user)]);
+    return profile_string;
+}
+
+
+/*
+ * make a new post from 'author' to the 'target' user,
+ * containing (a copy of) the given contents, IF the users are friends
+ *
+ * return:
+ *   - 0 on success
+ *   - 1 if users exist but are not friends
+ *   - 2 if either User pointer is NULL
+ */
+int make_post(const User *author, User *target, const char *contents) {
+    if (target == NULL || author == NULL) {
+        return 2;
+    }
+
+    pthread_rwlock_wrlock(&shard_locks[user_shard(target)]);
+    if (!friend_set_contains(&target->friends, author->id)) {
+        pthread_rwlock_unlock(&shard_locks[user_shard(target)]);
+        return 1;
+    }
+
+    // Create post
+    unsigned int shard = user_shard(target);
+    Post *new_post = slab_alloc(&post_slabs[shard]);
+    new_post->author_id = author->id;
+    new_post->target_id = target->id;
+    new_post->length = strlen(contents);
+    new_post->contents = arena_strndup(&body_arenas[shard], contents, new_post->length);
+    time(&new_post->date);
+    // format the date once, instead of on every profile render
+    struct tm local;
+    asctime_r(localtime_r(&new_post->date, &local), new_post->date_text);
+    post_list_append(&target->posts, new_post);
+    feed_fan_out(target, new_post);
+    index_post(new_post);
+    target->version++;
+    __atomic_add_fetch(&post_total, 1, __ATOMIC_RELAXED);
+    if (hooks.post_made != NULL) {
+        hooks.post_made(hooks.arg, target, new_post);
+    }
+    if (shard_budget > 0 && !__atomic_load_n(&cold_failed, __ATOMIC_RELAXED)) {
+        hot_push(&hot_posts[shard], new_post);
+        spill_cold(shard);
+    }
+    pthread_rwlock_unlock(&shard_locks[user_shard(target)]);
+
+    return 0;
+}
+
+
+// render posts from all over, saying whose wall each is on: text under the
+// given title, or a binary frame with the given opcode. each post is
+// rendered with its wall's shard locked for reading, since its body may
+// be spilled meanwhile
+static Rendered *render_wall_posts(Post **posts, unsigned int count, const char *title, int opcode,
+                                   RenderFormat format) {
+    StrBuf out;
+    size_t len;
+    sb_init(&out, 256);
+    if (format == FORMAT_BINARY) {
+        frame_start(&out, opcode);
+        sb_put_uint(&out, count, 4);
+    } else {
+        sb_puts(&out, title);
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int shard = user_shard(find_user_by_id(posts[i]->target_id));
+        pthread_rwlock_rdlock(&shard_locks[shard]);
+        if (format == FORMAT_BINARY) {
+            sb_put_uint(&out, (uint64_t)posts[i]->date, 8);
+            sb_put_uint(&out, posts[i]->author_id, 4);
+            sb_put_uint(&out, posts[i]->target_id, 4);
+            sb_put_uint(&out, posts[i]->length, 4);
+            append_body(&out, posts[i]);
+        } else {
+            append_post(&out, posts[i], 1);
+            if (i + 1 < count) {
+                sb_puts(&out, "\n===\n\n");
+            }
+        }
+        pthread_rwlock_unlock(&shard_locks[shard]);
+    }
+    if (format == FORMAT_BINARY) {
+        char *data = frame_finish(&out, &len);
+        return rendered_new(data, len, 0);
+    }
+    sb_puts(&out, SEPARATOR);
+    len = out.len;
+    return rendered_new(sb_finish(&out), len, 0);
+}
+
+
+// offer a post to a min-heap (by date) of at most limit posts. return 0 if
+// the heap is full and the post is no newer than any in it, in which case
+// older posts needn't be offered either
+static int newest_offer(Post **heap, unsigned int *count, unsigned int limit, Post *post) {
+    unsigned int i;
+    if (*count < limit) {
+        for (i = (*count)++; i > 0 && heap[(i - 1) / 2]->date > post->date; i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = post;
+        return 1;
+    }
+    if (post->date <= heap[0]->date) {
+        return 0;
+    }
+    // replaces the oldest
+    for (i = 0; 2 * i + 1 < limit; ) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < limit && heap[child + 1]->date < heap[child]->date) {
+            child++;
+        }
+        if (heap[child]->date >= post->date) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = post;
+    return 1;
+}
+
+
+static int newest_first(const void *a, const void *b) {
+    time_t date_a = (*(Post * const *)a)->date;
+    time_t date_b = (*(Post * const *)b)->date;
+    return date_a < date_b ? 1 : date_a > date_b ? -1 : 0;
+}
+
+
+// with the user's shard locked for reading, return (malloc'd) the ids of
+// its friends whose newest posts aren't pushed, and their number in *count
+static unsigned int *hot_friends(const User *user, unsigned int *count) {
+    const FriendSet *friends = &user->friends;
+    unsigned int *ids = NULL;
+    *count = 0;
+    if (friends->count == 0 || __atomic_load_n(&hot_users.count, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    if (friends->count <= __atomic_load_n(&hot_users.count, __ATOMIC_RELAXED)) {
+        ids = malloc(sizeof(unsigned int) * friends->count);
+        if (ids == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (unsigned int i = 0; i < friends->count; i++) {
+            const User *friend = find_user_by_id(friends->ids[i]);
+            if (__atomic_load_n(&friend->feed_pull_from, __ATOMIC_RELAXED) != FEED_PUSH_ALL) {
+                ids[(*count)++] = friend->id;
+            }
+        }
+        return ids;
+    }
+
+    pthread_mutex_lock(&hot_users.lock);
+    ids = malloc(sizeof(unsigned int) * hot_users.count);
+    if (ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < hot_users.count; i++) {
+        if (friend_set_contains(friends, hot_users.ids[i])) {
+            ids[(*count)++] = hot_users.ids[i];
+        }
+    }
+    pthread_mutex_unlock(&hot_users.lock);
+    return ids;
+}
+
+
+// offer the newest of the first count posts on a wall to a heap of the
+// newest FEED_CAP, with the wall's shard locked for reading, stopping at
+// the first one too old to make it
+static void feed_offer_wall(Post **heap, unsigned int *found, const User *wall, unsigned int count) {
+    for (unsigned int i = count; i > 0; i--) {
+        if (!newest_offer(heap, found, FEED_CAP, wall->posts.items[i - 1])) {
+            break;
+        }
+    }
+}
+
+
+// fill a stale timeline (see restore_feeds) with what make_post would have
+// pushed there: the newest FEED_CAP posts from the user's own wall and from
+// the pushed part of its friends' walls, along with anything pushed to it
+// since it went stale
+static void feed_fill(User *user) {
+    Post *newest[FEED_CAP];
+    unsigned int found = 0;
+    unsigned int shard = user_shard(user);
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    feed_offer_wall(newest, &found, user, user->posts.count);
+    unsigned int num_friends = user->friends.count;
+    unsigned int *friend_ids = malloc(sizeof(unsigned int) * (num_friends > 0 ? num_friends : 1));
+    if (friend_ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(friend_ids, user->friends.ids, sizeof(unsigned int) * num_friends);
+    pthread_rwlock_unlock(&shard_locks[shard]);
+
+    for (unsigned int i = 0; i < num_friends; i++) {
+        const User *friend = find_user_by_id(friend_ids[i]);
+        unsigned int friend_shard = user_shard(friend);
+        pthread_rwlock_rdlock(&shard_locks[friend_shard]);
+        unsigned int pull_from = __atomic_load_n(&friend->feed_pull_from, __ATOMIC_RELAXED);
+        unsigned int pushed = pull_from < friend->posts.count ? pull_from : friend->posts.count;
+        feed_offer_wall(newest, &found, friend, pushed);
+        pthread_rwlock_unlock(&shard_locks[friend_shard]);
+    }
+    free(friend_ids);
+
+    pthread_mutex_lock(&feed_locks[shard]);
+    Timeline *feed = &user->feed;
+    if (!feed->stale) {
+        pthread_mutex_unlock(&feed_locks[shard]);
+        return; // another reader filled it first
+    }
+    // posts made since it went stale, unless the walls gave them already
+    for (unsigned int i = 0; i < feed->count; i++) {
+        Post *post = feed->items[(feed->start + i) & (feed->cap - 1)];
+        unsigned int j = 0;
+        while (j < found && newest[j] != post) {
+            j++;
+        }
+        if (j == found) {
+            newest_offer(newest, &found, FEED_CAP, post);
+        }
+    }
+    qsort(newest, found, sizeof(Post *), newest_first);
+
+    unsigned int cap = FEED_INITIAL_CAP;
+    while (cap < found) {
+        cap *= 2;
+    }
+    if (found > feed->cap) {
+        free(feed->items);
+        feed->items = malloc(sizeof(Post *) * cap);
+        if (feed->items == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        __atomic_add_fetch(&feed_bytes, sizeof(Post *) * (cap - feed->cap), __ATOMIC_RELAXED);
+        feed->cap = cap;
+    }
+    for (unsigned int i = 0; i < found; i++) {
+        feed->items[i] = newest[found - 1 - i];
+    }
+    feed->start = 0;
+    feed->count = found;
+    __atomic_store_n(&feed->stale, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&feed_locks[shard]);
+}
+
+
+/*
+ * return the user's feed: the newest limit (at most FEED_CAP) posts made on
+ * its wall or its friends' walls, newest first. the caller releases the
+ * returned reference.
+ */
+Rendered *feed_page(const User *user, unsigned int limit, RenderFormat format) {
+    Post *newest[FEED_CAP];
+    unsigned int found = 0;
+    if (limit == 0) {
+        return render_wall_posts(newest, 0, "Feed:\n", BIN_FEED, format);
+    }
+    if (limit > FEED_CAP) {
+        limit = FEED_CAP;
+    }
+    if (__atomic_load_n(&user->feed.stale, __ATOMIC_ACQUIRE)) {
+        feed_fill((User *)user);
+    }
+
+    // everything pushed to the user, newest first
+    unsigned int shard = user_shard(user);
+    pthread_mutex_lock(&feed_locks[shard]);
+    const Timeline *feed = &user->feed;
+    for (unsigned int i = feed->count; i > 0; i--) {
+        if (!newest_offer(newest, &found, limit, feed->items[(feed->start + i - 1) & (feed->cap - 1)])) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&feed_locks[shard]);
+
+    // and what hot friends didn't push, from their walls
+    unsigned int num_hot;
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    unsigned int *hot = hot_friends(user, &num_hot);
+    pthread_rwlock_unlock(&shard_locks[shard]);
+    for (unsigned int i = 0; i < num_hot; i++) {
+        const User *friend = find_user_by_id(hot[i]);
+        unsigned int friend_shard = user_shard(friend);
+        pthread_rwlock_rdlock(&shard_locks[friend_shard]);
+        for (unsigned int j = friend->posts.count; j > friend->feed_pull_from; j--) {
+            if (!newest_offer(newest, &found, limit, friend->posts.items[j - 1])) {
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&shard_locks[friend_shard]);
+    }
+    free(hot);
+
+    qsort(newest, found, sizeof(Post *), newest_first);
+    return render_wall_posts(newest, found, "Feed:\n", BIN_FEED, format);
+}
+
+
+/*
+ * return the newest posts (at most SEARCH_MAX) with every word of the
+ * query in them, newest first. words are runs of letters and digits, and
+ * case doesn't matter. while the index of a loaded store is still being
+ * built, return that search isn't ready (a BIN_NOT_READY frame) instead.
+ * the caller releases the returned reference.
+ */
+Rendered *search_posts(const char *query, unsigned int limit, RenderFormat format) {
+    if (__atomic_load_n(&search_queue.building, __ATOMIC_ACQUIRE)) {
+        StrBuf out;
+        size_t len;
+        sb_init(&out, 64);
+        if (format == FORMAT_BINARY) {
+            frame_start(&out, BIN_SEARCH);
+            out.data[5] = BIN_NOT_READY;
+            return rendered_new(frame_finish(&out, &len), len, 0);
+        }
+        sb_puts(&out, "Search isn't ready yet, try again soon\n");
+        len = out.len;
+        return rendered_new(sb_finish(&out), len, 0);
+    }
+
+    Post *found[SEARCH_MAX];
+    if (limit > SEARCH_MAX) {
+        limit = SEARCH_MAX;
+    }
+    unsigned int count = search_find(query, limit, (void **)found);
+    return render_wall_posts(found, count, "Search results:\n", BIN_SEARCH, format);
+}
+
+
+/*
+ * graph queries, run on the sorted id arrays of friend sets. two sets are
+ * intersected by merging them, four ids from each side at a time with
+ * SSE2 when the compiler has it; when one set is much smaller, each of
+ * its ids is looked up in the other by galloping instead, so a user with
+ * a few friends costs about the same against one with thousands.
+ */
+#define GALLOP_RATIO 32
+#define INTERSECT_SLACK 4
+#define MUTUAL_COUNTED 0xffffffffu // the user and its friends, in mutual_counts
+
+
+// index of the first id >= target in ids[from, count), by doubling steps
+// then a binary search
+static unsigned int gallop(const unsigned int *ids, unsigned int from, unsigned int count,
+                           unsigned int target) {
+    unsigned int lo = from;
+    unsigned int step = 1;
+    while (lo + step < count && ids[lo + step] < target) {
+        lo += step;
+        step *= 2;
+    }
+    unsigned int hi = lo + step < count ? lo + step : count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (ids[mid] < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+// write the ids in both sorted arrays to out (unless it's NULL), in order,
+// and return how many there are. out is written past the last id found, so
+// it needs room for INTERSECT_SLACK ids more than the smaller array has
+static unsigned int intersect_ids(const unsigned int *a, unsigned int a_count,
+                                  const unsigned int *b, unsigned int b_count, unsigned int *out) {
+    if (a_count > b_count) {
+        const unsigned int *ids = a;
+        a = b;
+        b = ids;
+        unsigned int count = a_count;
+        a_count = b_count;
+        b_count = count;
+    }
+    unsigned int found = 0;
+    if (a_count == 0) {
+        return 0;
+    }
+
+    unsigned int i = 0;
+    unsigned int j = 0;
+    if (b_count / a_count >= GALLOP_RATIO) {
+        for (; i < a_count; i++) {
+            j = gallop(b, j, b_count, a[i]);
+            if (j == b_count) {
+                break;
+            } else if (b[j] == a[i]) {
+                if (out != NULL) {
+                    out[found] = a[i];
+                }
+                found++;
+            }
+        }
+        return found;
+    }
+
+#ifdef __SSE2__
+    // compare all 16 pairs of a block of four from each side by rotating
+    // one of them, then move past whichever block ends lower (or both)
+    while (i + 4 <= a_count && j + 4 <= b_count) {
+        __m128i block_a = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i block_b = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i equal = _mm_cmpeq_epi32(block_a, block_b);
+        for (int turn = 0; turn < 3; turn++) {
+            block_b = _mm_shuffle_epi32(block_b, _MM_SHUFFLE(0, 3, 2, 1));
+            equal = _mm_or_si128(equal, _mm_cmpeq_epi32(block_a, block_b));
+        }
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        // without branches, which would be mispredicted about half the time
+        // (but most blocks don't match at all)
+        if (out != NULL && mask != 0) {
+            for (int k = 0; k < 4; k++) {
+                out[found] = a[i + k];
+                found += (mask >> k) & 1;
+            }
+        } else {
+            found += __builtin_popcount(mask);
+        }
+        unsigned int a_last = a[i + 3];
+        unsigned int b_last = b[j + 3];
+        i += (a_last <= b_last) * 4;
+        j += (b_last <= a_last) * 4;
+    }
+#endif
+    // what's left (all of it without SSE2), one id at a time
+    while (i < a_count && j < b_count) {
+        unsigned int id_a = a[i];
+        unsigned int id_b = b[j];
+        if (out != NULL) {
+            out[found] = id_a;
+        }
+        found += id_a == id_b;
+        i += id_a <= id_b;
+        j += id_b <= id_a;
+    }
+    return found;
+}
+
+
+/*
+ * return the friends user and other have in common, in id order. the
+ * caller releases the returned reference.
+ */
+Rendered *mutual_friends(const User *user, const User *other, RenderFormat format) {
+    unsigned int shard1 = user_shard(user);
+    unsigned int shard2 = user_shard(other);
+    if (shard1 > shard2) {
+        unsigned int tmp = shard1;
+        shard1 = shard2;
+        shard2 = tmp;
+    }
+    pthread_rwlock_rdlock(&shard_locks[shard1]);
+    if (shard2 != shard1) {
+        pthread_rwlock_rdlock(&shard_locks[shard2]);
+    }
+    unsigned int most = user->friends.count < other->friends.count ? user->friends.count : other->friends.count;
+    unsigned int *common = malloc(sizeof(unsigned int) * (most + INTERSECT_SLACK));
+    if (common == NULL) {
         perror("malloc");
         exit(1);
     }
-    strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
-
-    for (int i = 0; i < MAX_NAME; i++) {
-        new_user->profile_pic[i] = '\0';
+    unsigned int found = intersect_ids(user->friends.ids, user->friends.count,
+                                       other->friends.ids, other->friends.count, common);
+    if (shard2 != shard1) {
+        pthread_rwlock_unlock(&shard_locks[shard2]);
     }
+    pthread_rwlock_unlock(&shard_locks[shard1]);
 
-    new_user->first_post = NULL;
-    new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
+    StrBuf out;
+    size_t len;
+    sb_init(&out, 256);
+    if (format == FORMAT_BINARY) {
+        frame_start(&out, BIN_MUTUAL);
+        sb_put_uint(&out, found, 4);
+        for (unsigned int i = 0; i < found; i++) {
+            put_user_ref(&out, common[i]);
+        }
+        free(common);
+        char *data = frame_finish(&out, &len);
+        return rendered_new(data, len, 0);
+    }
+    sb_puts(&out, "Mutual friends:\n");
+    for (unsigned int i = 0; i < found; i++) {
+        append_name(&out, common[i]);
+        sb_append(&out, "\n", 1);
     }
+    sb_puts(&out, SEPARATOR);
+    free(common);
+    len = out.len;
+    return rendered_new(sb_finish(&out), len, 0);
+}
 
-    // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
+
+typedef struct suggestion {
+    unsigned int id;
+    unsigned int mutual;
+} Suggestion;
+
+// per thread scratch for suggest_friends: a count for every user id (0
+// outside of a query), and the ids counted so far, to reset them after
+static __thread unsigned int *mutual_counts;
+static __thread unsigned int mutual_counts_cap;
+static __thread unsigned int *counted;
+static __thread unsigned int counted_cap;
+
+
+// 1 if suggestion a ranks below b: fewer friends in common, or as many but
+// a newer user
+static int suggestion_below(const Suggestion *a, const Suggestion *b) {
+    return a->mutual < b->mutual || (a->mutual == b->mutual && a->id > b->id);
+}
+
+
+static int best_first(const void *a, const void *b) {
+    return suggestion_below(a, b) ? 1 : suggestion_below(b, a) ? -1 : 0;
+}
+
+
+// offer a suggestion to a heap of at most k, the lowest ranked on top
+static void top_offer(Suggestion *heap, unsigned int *count, unsigned int k, Suggestion offer) {
+    unsigned int i;
+    if (*count < k) {
+        for (i = (*count)++; i > 0 && suggestion_below(&offer, &heap[(i - 1) / 2]); i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = offer;
+        return;
+    }
+    if (!suggestion_below(&heap[0], &offer)) {
+        return;
     }
+    for (i = 0; 2 * i + 1 < k; ) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < k && suggestion_below(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!suggestion_below(&heap[child], &offer)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = offer;
+}
 
-    if (*user_ptr_add == NULL) {
-        *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
-        free(new_user);
-        return 1;
-    } else {
-        prev->next = new_user;
-        return 0;
+
+// render suggestions, best first
+static Rendered *render_suggestions(const Suggestion *top, unsigned int found, RenderFormat format) {
+    StrBuf out;
+    size_t len;
+    sb_init(&out, 256);
+    if (format == FORMAT_BINARY) {
+        frame_start(&out, BIN_SUGGEST);
+        sb_put_uint(&out, found, 4);
+        for (unsigned int i = 0; i < found; i++) {
+            put_user_ref(&out, top[i].id);
+            sb_put_uint(&out, top[i].mutual, 4);
+        }
+        char *data = frame_finish(&out, &len);
+        return rendered_new(data, len, 0);
+    }
+    sb_puts(&out, "Suggestions:\n");
+    for (unsigned int i = 0; i < found; i++) {
+        char mutual[32];
+        snprintf(mutual, sizeof(mutual), " (%u mutual)\n", top[i].mutual);
+        append_name(&out, top[i].id);
+        sb_puts(&out, mutual);
     }
+    sb_puts(&out, SEPARATOR);
+    len = out.len;
+    return rendered_new(sb_finish(&out), len, 0);
 }
 
 
 /*
- * return a pointer to the user with this name in the list starting with head 
- * return NULL if no such user exists
+ * return up to k (at most SUGGEST_MAX) friends of the user's friends who
+ * aren't its friends yet, most friends in common first (older users first
+ * among equals), with how many they have in common. costs the number of
+ * friends the user's friends have. the caller releases the returned
+ * reference.
  */
-User *find_user(const char *name, const User *head) {
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
+Rendered *suggest_friends(const User *user, unsigned int k, RenderFormat format) {
+    if (k == 0) {
+        return render_suggestions(NULL, 0, format);
+    }
+    if (k > SUGGEST_MAX) {
+        k = SUGGEST_MAX;
+    }
+    unsigned int num_users = user_count();
+    if (num_users > mutual_counts_cap) {
+        unsigned int *counts = realloc(mutual_counts, sizeof(unsigned int) * num_users);
+        if (counts == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(counts + mutual_counts_cap, 0, sizeof(unsigned int) * (num_users - mutual_counts_cap));
+        mutual_counts = counts;
+        mutual_counts_cap = num_users;
     }
 
-    return (User *)head;
+    unsigned int shard = user_shard(user);
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    unsigned int num_friends = user->friends.count;
+    unsigned int *friends = malloc(sizeof(unsigned int) * (num_friends > 0 ? num_friends : 1));
+    if (friends == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(friends, user->friends.ids, sizeof(unsigned int) * num_friends);
+    pthread_rwlock_unlock(&shard_locks[shard]);
+
+    // the user and its friends are never suggested (friends newer than
+    // the query, which mutual_counts has no room for, can't be anyway)
+    mutual_counts[user->id] = MUTUAL_COUNTED;
+    for (unsigned int i = 0; i < num_friends; i++) {
+        if (friends[i] < num_users) {
+            mutual_counts[friends[i]] = MUTUAL_COUNTED;
+        }
+    }
+    unsigned int num_counted = 0;
+    for (unsigned int i = 0; i < num_friends; i++) {
+        const User *friend = find_user_by_id(friends[i]);
+        unsigned int friend_shard = user_shard(friend);
+        pthread_rwlock_rdlock(&shard_locks[friend_shard]);
+        for (unsigned int j = 0; j < friend->friends.count; j++) {
+            unsigned int id = friend->friends.ids[j];
+            // (users newer than the query are left out)
+            if (id >= num_users || mutual_counts[id] == MUTUAL_COUNTED) {
+                continue;
+            }
+            if (mutual_counts[id]++ == 0) {
+                if (num_counted == counted_cap) {
+                    counted_cap = counted_cap == 0 ? 1024 : counted_cap * 2;
+                    counted = realloc(counted, sizeof(unsigned int) * counted_cap);
+                    if (counted == NULL) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                counted[num_counted++] = id;
+            }
+        }
+        pthread_rwlock_unlock(&shard_locks[friend_shard]);
+    }
+
+    Suggestion top[SUGGEST_MAX];
+    unsigned int found = 0;
+    for (unsigned int i = 0; i < num_counted; i++) {
+        Suggestion offer = {counted[i], mutual_counts[counted[i]]};
+        top_offer(top, &found, k, offer);
+        mutual_counts[counted[i]] = 0;
+    }
+    mutual_counts[user->id] = 0;
+    for (unsigned int i = 0; i < num_friends; i++) {
+        if (friends[i] < num_users) {
+            mutual_counts[friends[i]] = 0;
+        }
+    }
+    free(friends);
+    qsort(top, found, sizeof(Suggestion), best_first);
+    return render_suggestions(top, found, format);
 }
 
 
 /*
- * print the usernames of all users in the list starting at curr
+ * degrees of separation, by bidirectional breadth first search: one search
+ * from each end, a level at a time, always growing the smaller frontier,
+ * until one reaches a user the other has seen. each side keeps a visited
+ * bitmap over user ids and a queue of the ids it visited, which doubles as
+ * its frontiers; with a path, each also records which friend every user
+ * was reached through. these live in per thread scratch that only grows,
+ * and the bits set are cleared off the queues afterwards, so a query
+ * allocates nothing once its thread has run one of the same size. a query
+ * gives up after DISTANCE_MAX_HOPS hops or after looking at
+ * DISTANCE_MAX_WORK friend ids, so one far apart pair can't hold up the
+ * thread serving it for long.
  */
-char *list_users(const User *curr) {
-    int num_chars = 11;
-    const User *clone = curr;
-    while (clone != NULL) {
-        int user_chars = strlen(clone->name) + 2;
-        num_chars = num_chars + user_chars;
-        clone = clone->next;
-    }
+#define DISTANCE_MAX_WORK (1 << 22)
 
-    char *user_string = malloc(sizeof(char) * num_chars);
-    if (user_string == NULL) {
-        perror("malloc");
-        exit(-1);
+static __thread struct {
+    uint64_t *seen[2]; // a bit per user id, for the search from each end
+    unsigned int *via[2]; // the friend a user was reached through, NULL until a path is asked for
+    unsigned int cap; // user ids the above have room for
+    unsigned int *queue[2];
+    unsigned int queue_cap[2];
+} bfs;
+
+
+static int bfs_seen(int side, unsigned int id) {
+    return (bfs.seen[side][id / 64] >> (id % 64)) & 1;
+}
+
+
+static void bfs_mark(int side, unsigned int id) {
+    bfs.seen[side][id / 64] |= (uint64_t)1 << (id % 64);
+}
+
+
+// make room in the scratch for num_users user ids
+static void bfs_reserve(unsigned int num_users, int with_path) {
+    unsigned int cap = (num_users + 63) / 64 * 64;
+    for (int side = 0; side < 2; side++) {
+        if (cap > bfs.cap) {
+            uint64_t *seen = realloc(bfs.seen[side], cap / 8);
+            if (seen == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            memset(seen + bfs.cap / 64, 0, (cap - bfs.cap) / 8);
+            bfs.seen[side] = seen;
+            if (bfs.via[side] != NULL) {
+                free(bfs.via[side]);
+                bfs.via[side] = NULL;
+            }
+        }
+        if (with_path && bfs.via[side] == NULL) {
+            bfs.via[side] = malloc(sizeof(unsigned int) * (cap > bfs.cap ? cap : bfs.cap));
+            if (bfs.via[side] == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+    }
+    if (cap > bfs.cap) {
+        bfs.cap = cap;
     }
+}
 
-    strcpy(user_string, "User List\n");
-    while (curr != NULL) {
-        strcat(user_string, "\t");
-        strcat(user_string, curr->name);
-        strcat(user_string, "\n");
-        curr = curr->next;
+
+static void bfs_push(int side, unsigned int *count, unsigned int id) {
+    if (*count == bfs.queue_cap[side]) {
+        bfs.queue_cap[side] = bfs.queue_cap[side] == 0 ? 1024 : bfs.queue_cap[side] * 2;
+        bfs.queue[side] = realloc(bfs.queue[side], sizeof(unsigned int) * bfs.queue_cap[side]);
+        if (bfs.queue[side] == NULL) {
+            perror("realloc");
+            exit(1);
+        }
     }
-    return user_string;
+    bfs.queue[side][(*count)++] = id;
 }
 
 
 /*
- * make two users friends with each other (symmetric - a pointer to
- * each user must be stored in the 'friends' array of the other)
+ * find the shortest chain of friendships from one user to another. if path
+ * isn't NULL (it needs room for DISTANCE_MAX_HOPS + 1 ids), the ids of the
+ * users on it are written there, from first to last.
  *
  * return:
- *   - 0 on success.
- *   - 1 if the two users are already friends.
- *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
- *   - 3 if the same user is passed in twice.
- *   - 4 if at least one user does not exist.
+ *   - the number of friendships on the path (0 for the same user)
+ *   - -1 if there is no path
+ *   - -2 if the search gave up before finding one
  */
-int make_friends(const char *name1, const char *name2, User *head) {
-    User *user1 = find_user(name1, head);
-    User *user2 = find_user(name2, head);
+int friend_distance(const User *from, const User *to, unsigned int *path) {
+    if (from == to) {
+        if (path != NULL) {
+            path[0] = from->id;
+        }
+        return 0;
+    }
+    unsigned int num_users = user_count();
+    bfs_reserve(num_users, path != NULL);
 
-    if (user1 == NULL || user2 == NULL) {
-        return 4;
-    } else if (user1 == user2) { // Same user
-        return 3;
+    const User *ends[2] = {from, to};
+    unsigned int level_start[2] = {0, 0};
+    unsigned int count[2] = {0, 0};
+    int depth[2] = {0, 0};
+    for (int side = 0; side < 2; side++) {
+        bfs_push(side, &count[side], ends[side]->id);
+        bfs_mark(side, ends[side]->id);
     }
 
-    int i, j;
-    for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
+    int result = -2;
+    unsigned int meet = 0;
+    long work = 0;
+    while (depth[0] + depth[1] < DISTANCE_MAX_HOPS && work < DISTANCE_MAX_WORK) {
+        int side = count[0] - level_start[0] <= count[1] - level_start[1] ? 0 : 1;
+        if (level_start[side] == count[side]) {
+            result = -1; // everyone reachable from this end was seen
             break;
-        } else if (user1->friends[i] == user2) { // Already friends.
-            return 1;
         }
-    }
-
-    for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
+        unsigned int level_end = count[side];
+        // a level of hubs can be far more than the budget: give up mid level
+        for (unsigned int i = level_start[side];
+             i < level_end && result == -2 && work < DISTANCE_MAX_WORK; i++) {
+            const User *user = find_user_by_id(bfs.queue[side][i]);
+            unsigned int shard = user_shard(user);
+            pthread_rwlock_rdlock(&shard_locks[shard]);
+            work += user->friends.count;
+            for (unsigned int j = 0; j < user->friends.count; j++) {
+                unsigned int id = user->friends.ids[j];
+                // (users newer than the query are left out)
+                if (id >= num_users || bfs_seen(side, id)) {
+                    continue;
+                }
+                bfs_mark(side, id);
+                bfs_push(side, &count[side], id);
+                if (path != NULL) {
+                    bfs.via[side][id] = user->id;
+                }
+                // the other side only ever sees this level's neighbours
+                // from its own last level, so the first meeting is shortest
+                if (bfs_seen(!side, id)) {
+                    meet = id;
+                    result = depth[0] + depth[1] + 1;
+                    break;
+                }
+            }
+            pthread_rwlock_unlock(&shard_locks[shard]);
+        }
+        level_start[side] = level_end;
+        depth[side]++;
+        if (result != -2) {
             break;
         }
     }
 
-    if (i == MAX_FRIENDS || j == MAX_FRIENDS) { // Too many friends.
-        return 2;
+    if (result > 0 && path != NULL) {
+        // meet is result - hops from the other end away from from
+        int hops = 0;
+        for (unsigned int id = meet; id != from->id; id = bfs.via[0][id]) {
+            hops++;
+        }
+        path[hops] = meet;
+        for (int i = hops; i > 0; i--) {
+            path[i - 1] = bfs.via[0][path[i]];
+        }
+        for (int i = hops; i < result; i++) {
+            path[i + 1] = bfs.via[1][path[i]];
+        }
     }
 
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
-    return 0;
+    // clear the bits this query set, for the next one
+    for (int side = 0; side < 2; side++) {
+        for (unsigned int i = 0; i < count[side]; i++) {
+            unsigned int id = bfs.queue[side][i];
+            bfs.seen[side][id / 64] = 0;
+        }
+    }
+    return result;
 }
 
 
-// print a post
-char *print_post(const Post *post) {
-    if (post == NULL) {
-        return NULL;
-    }
+/*
+ * return how many friendships apart two users are, and who's on the way
+ * there if with_path is set, rendered. in the binary format a path that
+ * wasn't found is a BIN_NO_PATH or BIN_TOO_FAR status. the caller releases
+ * the returned reference.
+ */
+Rendered *distance_query(const User *from, const User *to, int with_path, RenderFormat format) {
+    unsigned int path[DISTANCE_MAX_HOPS + 1];
+    int distance = friend_distance(from, to, with_path ? path : NULL);
 
-    int post_chars = 1; // 1 = \0
-    post_chars = post_chars + strlen(post->author) + 7; // 7 is "From: " and \n
-    post_chars = post_chars + strlen(asctime(localtime(post->date))) + 7; // 7 is "Date: " and \n
-    post_chars = post_chars + strlen(post->contents) + 1; // 1 is \n
+    StrBuf out;
+    size_t len;
+    sb_init(&out, 128);
+    if (format == FORMAT_BINARY) {
+        frame_start(&out, with_path ? BIN_PATH : BIN_DISTANCE);
+        if (distance < 0) {
+            out.data[5] = distance == -1 ? BIN_NO_PATH : BIN_TOO_FAR;
+        } else if (with_path) {
+            sb_put_uint(&out, distance + 1, 4);
+            for (int i = 0; i <= distance; i++) {
+                put_user_ref(&out, path[i]);
+            }
+        } else {
+            sb_put_uint(&out, distance, 4);
+        }
+        char *data = frame_finish(&out, &len);
+        return rendered_new(data, len, 0);
+    }
 
-    char *post_string = malloc(sizeof(char) * post_chars);
-    if (post_string == NULL) {
-        perror("malloc");
-        exit(-1);
+    if (distance == -1) {
+        sb_puts(&out, "No path\n");
+    } else if (distance == -2) {
+        sb_puts(&out, "Too far to tell\n");
+    } else if (with_path) {
+        sb_puts(&out, "Path: ");
+        for (int i = 0; i <= distance; i++) {
+            if (i > 0) {
+                sb_puts(&out, " -> ");
+            }
+            append_name(&out, path[i]);
+        }
+        sb_append(&out, "\n", 1);
+    } else {
+        char line[32];
+        snprintf(line, sizeof(line), "Distance: %d\n", distance);
+        sb_puts(&out, line);
     }
+    len = out.len;
+    return rendered_new(sb_finish(&out), len, 0);
+}
 
-    strcpy(post_string, "From: ");
-    strcat(post_string, post->author);
-    strcat(post_string, "\nDate: ");
-    strcat(post_string, asctime(localtime(post->date)));
-    strcat(post_string, "\n");
-    strcat(post_string, post->contents);
-    strcat(post_string, "\n");
 
-    return post_string;
+/*
+ * return the number of users created so far (ids go from 0 to this - 1)
+ */
+unsigned int user_count(void) {
+    // lock free, so it also works in a process forked with the store locked
+    return __atomic_load_n(&next_user_id, __ATOMIC_ACQUIRE);
 }
 
 
 /*
- * print a user profile
- * return:
- *   - 0 on success.
- *   - 1 if the user is NULL.
+ * get the number of users, friendships and posts in the store, without
+ * taking any lock (so the three may be a moment apart)
  */
-char *print_user(const User *user) {
-    if (user == NULL) {
-        char *profile_string = malloc(sizeof(char) * 16);
-        strcpy(profile_string, "User not found\n");
-        return profile_string;
-    }
+void store_counts(unsigned long *users, unsigned long *friendships, unsigned long *posts) {
+    *users = user_count();
+    *friendships = __atomic_load_n(&friend_links, __ATOMIC_RELAXED) / 2;
+    *posts = __atomic_load_n(&post_total, __ATOMIC_RELAXED);
+}
 
-    int profile_chars = 130; // 130 = characters in each separator bar + one null terminator
-    profile_chars = profile_chars + strlen(user->name) + 8; // 8 is "Name: " and two \n"
-    profile_chars = profile_chars + 9; // 9 is "Friends:\n"
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-        profile_chars = profile_chars + strlen(user->friends[i]->name) + 1; // 1 is \n
+
+/*
+ * lock the whole store for writing, so nothing is halfway through a change
+ * (e.g. while forking a process to write a snapshot of it)
+ */
+void store_lock_all(void) {
+    pthread_rwlock_wrlock(&dir_lock);
+    for (int i = 0; i < STORE_SHARDS; i++) {
+        pthread_rwlock_wrlock(&shard_locks[i]);
     }
-    profile_chars = profile_chars + 7; // 7 is "Posts:\n"
-    const Post *curr = user->first_post;
-    while (curr != NULL) {
-        profile_chars = profile_chars + strlen(print_post(curr));
-        curr = curr->next;
-        if (curr != NULL) {
-            profile_chars = profile_chars + 6;
-        }
+}
+
+
+void store_unlock_all(void) {
+    for (int i = STORE_SHARDS - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&shard_locks[i]);
     }
+    pthread_rwlock_unlock(&dir_lock);
+}
 
-    char *profile_string = malloc(sizeof(char) * profile_chars);
-    if (profile_string == NULL) {
-        perror("malloc");
-        exit(-1);
+
+/*
+ * give a user one side of its friendships back, from a snapshot: ids must be
+ * sorted and not contain the user itself. the other side is restored with
+ * the other user.
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the user already has friends, or the ids aren't valid.
+ */
+int restore_friends(User *user, const unsigned int *ids, unsigned int count) {
+    unsigned int num_users = user_count();
+    for (unsigned int i = 0; i < count; i++) {
+        if (ids[i] >= num_users || ids[i] == user->id || (i > 0 && ids[i] <= ids[i - 1])) {
+            return 1;
+        }
     }
 
-    strcpy(profile_string, "Name: ");
-    strcat(profile_string, user->name);
-    strcat(profile_string, "\n\n------------------------------------------\nFriends:\n");
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-        strcat(profile_string, user->friends[i]->name);
-        strcat(profile_string, "\n");
+    pthread_rwlock_wrlock(&shard_locks[user_shard(user)]);
+    FriendSet *set = &user->friends;
+    if (set->count > 0) {
+        pthread_rwlock_unlock(&shard_locks[user_shard(user)]);
+        return 1;
     }
-    strcat(profile_string, "------------------------------------------\nPosts:\n");
-    const Post *curr2 = user->first_post;
-    while (curr2 != NULL) {
-        strcat(profile_string, print_post(curr2));
-        curr2 = curr2->next;
-        if (curr != NULL) {
-            strcat(profile_string, "\n===\n\n");
+    if (count > set->cap) {
+        set->ids = malloc(sizeof(unsigned int) * count);
+        if (set->ids == NULL) {
+            perror("malloc");
+            exit(1);
         }
+        set->cap = count;
     }
-    strcat(profile_string, "------------------------------------------\n");
-
-    return profile_string;
+    memcpy(set->ids, ids, sizeof(unsigned int) * count);
+    set->count = count;
+    __atomic_add_fetch(&friend_links, count, __ATOMIC_RELAXED);
+    if (set->count > FRIEND_INDEX_MIN) {
+        friend_index_build(set);
+    }
+    feed_check_degree(user);
+    user->version++;
+    pthread_rwlock_unlock(&shard_locks[user_shard(user)]);
+    return 0;
 }
 
 
 /*
- * make a new post from 'author' to the 'target' user,
- * containing the given contents, IF the users are friends
+ * give a user back a post from a snapshot, as its newest post. unlike
+ * make_post the contents are not copied (they stay wherever the snapshot
+ * keeps them, which must live as long as the store), the date and its
+ * text are taken as is, and friendship isn't checked. it isn't put on any
+ * feeds or in the search index yet: once every post is back,
+ * restore_feeds has the feeds filled and start_search_index indexes it.
  *
  * return:
- *   - 0 on success
- *   - 1 if users exist but are not friends
- *   - 2 if either User pointer is NULL
+ *   - 0 on success.
+ *   - 1 if the author doesn't exist.
  */
-int make_post(const User *author, User *target, char *contents) {
-    if (target == NULL || author == NULL) {
-        return 2;
+int restore_post(User *target, unsigned int author_id, time_t date,
+                 const char *date_text, const char *contents) {
+    const User *author = find_user_by_id(author_id);
+    if (author == NULL) {
+        return 1;
     }
 
-    int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
-            friends = 1;
-            break;
-        }
+    unsigned int shard = user_shard(target);
+    pthread_rwlock_wrlock(&shard_locks[shard]);
+    Post *new_post = slab_alloc(&post_slabs[shard]);
+    new_post->author_id = author_id;
+    new_post->target_id = target->id;
+    new_post->contents = (char *)contents;
+    new_post->length = strlen(contents);
+    new_post->date = date;
+    memcpy(new_post->date_text, date_text, DATE_SIZE);
+    new_post->date_text[DATE_SIZE - 1] = '\0';
+    post_list_append(&target->posts, new_post);
+    pthread_mutex_lock(&search_queue.lock);
+    search_queue_push(new_post);
+    search_queue.building = 1;
+    pthread_mutex_unlock(&search_queue.lock);
+    target->version++;
+    __atomic_add_fetch(&post_total, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard_locks[shard]);
+    return 0;
+}
+
+
+/*
+ * after posts were restored (restore_post leaves the feeds alone), have
+ * every user's timeline filled from the walls the first time its feed is
+ * read, so loading doesn't pay for feeds nobody reads. call it before the
+ * store is shared.
+ */
+void restore_feeds(void) {
+    unsigned int num_users = user_count();
+    for (unsigned int id = 0; id < num_users; id++) {
+        find_user_by_id(id)->feed.stale = 1;
     }
+}
 
-    if (friends == 0) {
-        return 1;
+
+
+// bytes malloc would hand out for a request of n bytes (glibc: 8 bytes of
+// header, 16 byte granularity, 32 byte minimum)
+static size_t malloc_footprint(size_t n) {
+    size_t size = (n + 8 + 15) / 16 * 16;
+    return size < 32 ? 32 : size;
+}
+
+
+/*
+ * return a report of the memory used by users, posts and post bodies
+ * (those spilled to the cold segment only count there), including the
+ * bytes per post the old one-malloc-per-piece layout (Post, timestamp and
+ * body allocated separately) would have used
+ */
+char *memory_report(void) {
+    pthread_once(&storage_once, storage_init);
+
+    pthread_rwlock_rdlock(&dir_lock);
+    size_t num_users = user_slab.num_objs;
+    size_t user_bytes = slab_bytes(&user_slab);
+    pthread_rwlock_unlock(&dir_lock);
+
+    size_t num_posts = 0;
+    size_t post_bytes = 0;
+    size_t timeline_bytes = __atomic_load_n(&feed_bytes, __ATOMIC_RELAXED);
+    size_t body_used = 0;
+    size_t body_bytes = 0;
+    size_t malloc_bytes = 0;
+    for (int i = 0; i < STORE_SHARDS; i++) {
+        pthread_rwlock_rdlock(&shard_locks[i]);
+        num_posts += post_slabs[i].num_objs;
+        post_bytes += slab_bytes(&post_slabs[i]);
+        body_used += body_arenas[i].bytes_used;
+        body_bytes += body_arenas[i].bytes_reserved;
+        pthread_rwlock_unlock(&shard_locks[i]);
+    }
+    // estimate with the average body length
+    if (num_posts > 0) {
+        malloc_bytes = malloc_footprint(sizeof(Post)) + malloc_footprint(sizeof(time_t))
+                       + malloc_footprint(body_used / num_posts);
     }
 
-    // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
+    // per post cost once chunks are full: the slab slot plus the body
+    size_t per_post = 0;
+    if (num_posts > 0) {
+        per_post = (num_posts * post_slabs[0].obj_size + body_used) / num_posts;
+    }
+    char *report = malloc(512);
+    if (report == NULL) {
         perror("malloc");
         exit(1);
     }
-    strncpy(new_post->author, author->name, MAX_NAME);
-    new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
+    snprintf(report, 512,
+             "Memory\n"
+             "\tusers: %zu (%zu bytes)\n"
+             "\tposts: %zu (%zu bytes)\n"
+             "\tpost bodies: %zu bytes used, %zu bytes reserved\n"
+             "\tbytes per post: %zu (separate mallocs: ~%zu)\n"
+             "\tfeed timelines: %zu bytes\n"
+             "\tcold posts: %lu (%llu bytes on disk)\n",
+             num_users, user_bytes, num_posts, post_bytes, body_used, body_bytes,
+             per_post, malloc_bytes, timeline_bytes, __atomic_load_n(&cold_posts, __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&cold_end, __ATOMIC_RELAXED));
+    return report;
+}
+
+
+/*
+ * response cache. every user keeps the last profile rendered for it, tagged
+ * with the user's version at the time; the user list is cached the same way
+ * against the directory's version. versions only change under the write
+ * lock of the data they cover, so a reader holding the read lock can trust
+ * a cached render whose version matches. cache_locks only guard swapping
+ * the cached pointers and taking references to them.
+ */
+static pthread_mutex_t cache_locks[STORE_SHARDS] = {
+    [0 ... STORE_SHARDS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_mutex_t user_list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Rendered *user_list_cache[NUM_FORMATS];
+
+static unsigned long profile_hits;
+static unsigned long profile_misses;
+static unsigned long user_list_hits;
+static unsigned long user_list_misses;
+
+
+/*
+ * wrap a malloc'd string in a Rendered holding one reference, which the
+ * caller owns (along with the string itself, through the Rendered)
+ */
+Rendered *rendered_new(char *data, size_t len, unsigned long version) {
+    Rendered *rendered = malloc(sizeof(Rendered));
+    if (rendered == NULL) {
         perror("malloc");
         exit(1);
     }
-    time(new_post->date);
-    new_post->next = target->first_post;
-    target->first_post = new_post;
+    rendered->refs = 1;
+    rendered->version = version;
+    rendered->len = len;
+    rendered->data = data;
+    return rendered;
+}
 
-    return 0;
+
+/*
+ * drop one reference, freeing the response once nobody holds it
+ */
+void rendered_release(Rendered *rendered) {
+    if (rendered != NULL && __atomic_sub_fetch(&rendered->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(rendered->data);
+        free(rendered);
+    }
+}
+
+
+static Rendered *rendered_ref(Rendered *rendered) {
+    __atomic_add_fetch(&rendered->refs, 1, __ATOMIC_RELAXED);
+    return rendered;
+}
+
+
+// take a reference to *slot if it was rendered from this version
+static Rendered *cache_get(Rendered **slot, unsigned long version, pthread_mutex_t *lock) {
+    Rendered *found = NULL;
+    pthread_mutex_lock(lock);
+    if (*slot != NULL && (*slot)->version == version) {
+        found = rendered_ref(*slot);
+    }
+    pthread_mutex_unlock(lock);
+    return found;
+}
+
+
+// replace *slot with a fresh render (unless a newer one got there first)
+static void cache_put(Rendered **slot, Rendered *rendered, pthread_mutex_t *lock) {
+    Rendered *old = NULL;
+    pthread_mutex_lock(lock);
+    if (*slot == NULL || (*slot)->version <= rendered->version) {
+        old = *slot;
+        *slot = rendered_ref(rendered);
+    }
+    pthread_mutex_unlock(lock);
+    rendered_release(old);
+}
+
+
+// forget the user's cached profiles, with its shard locked for writing
+static void drop_cached_profiles(User *user) {
+    unsigned int shard = user_shard(user);
+    for (int format = 0; format < NUM_FORMATS; format++) {
+        pthread_mutex_lock(&cache_locks[shard]);
+        Rendered *old = user->profile_cache[format];
+        user->profile_cache[format] = NULL;
+        pthread_mutex_unlock(&cache_locks[shard]);
+        rendered_release(old);
+    }
+}
+
+
+/*
+ * return the profile of the user rendered in the given format, from the
+ * cache when the user hasn't changed since it was last rendered, or "User
+ * not found" (a BIN_NOT_FOUND frame) if the user is NULL. the caller
+ * releases the returned reference.
+ */
+Rendered *cached_profile(const User *user, RenderFormat format) {
+    if (user == NULL) {
+        StrBuf out;
+        size_t len;
+        sb_init(&out, 16);
+        if (format == FORMAT_BINARY) {
+            frame_start(&out, BIN_PROFILE);
+            out.data[5] = BIN_NOT_FOUND;
+            return rendered_new(frame_finish(&out, &len), len, 0);
+        }
+        sb_puts(&out, "User not found\n");
+        len = out.len;
+        return rendered_new(sb_finish(&out), len, 0);
+    }
+
+    User *cached_user = (User *)user;
+    unsigned int shard = user_shard(user);
+    pthread_rwlock_rdlock(&shard_locks[shard]);
+    unsigned long version = user->version;
+    Rendered *rendered = cache_get(&cached_user->profile_cache[format], version, &cache_locks[shard]);
+    if (rendered != NULL) {
+        pthread_rwlock_unlock(&shard_locks[shard]);
+        __atomic_add_fetch(&profile_hits, 1, __ATOMIC_RELAXED);
+        return rendered;
+    }
+
+    size_t len;
+    char *data;
+    if (format == FORMAT_BINARY) {
+        data = render_profile_binary(user, 0, user->posts.count, &len);
+    } else {
+        data = render_profile(user, 0, user->posts.count);
+        len = strlen(data);
+    }
+    // a wall's bodies are spilled oldest first, so if its oldest post is
+    // hot they all are
+    int cold_bodies = user->posts.count > 0 && user->posts.items[0]->contents == NULL;
+    pthread_rwlock_unlock(&shard_locks[shard]);
+    __atomic_add_fetch(&profile_misses, 1, __ATOMIC_RELAXED);
+
+    rendered = rendered_new(data, len, version);
+    if (!cold_bodies) {
+        cache_put(&cached_user->profile_cache[format], rendered, &cache_locks[shard]);
+    }
+    return rendered;
+}
+
+
+// render the list starting at head, with dir_lock held
+static Rendered *render_list_as(const User *head, RenderFormat format, unsigned long version) {
+    size_t len;
+    char *data;
+    if (format == FORMAT_BINARY) {
+        data = render_user_list_binary(head, &len);
+    } else {
+        data = render_user_list(head);
+        len = strlen(data);
+    }
+    return rendered_new(data, len, version);
+}
+
+
+/*
+ * return the list of users starting at head rendered in the given format,
+ * from the cache when no user was added since it was last rendered. only
+ * the list the user directory is bound to is cached. the caller releases
+ * the returned reference.
+ */
+Rendered *cached_user_list(const User *head, RenderFormat format) {
+    pthread_rwlock_rdlock(&dir_lock);
+    if (head == NULL || head != directory.head) {
+        Rendered *rendered = render_list_as(head, format, 0);
+        pthread_rwlock_unlock(&dir_lock);
+        return rendered;
+    }
+
+    unsigned long version = directory.version;
+    Rendered *rendered = cache_get(&user_list_cache[format], version, &user_list_cache_lock);
+    if (rendered != NULL) {
+        pthread_rwlock_unlock(&dir_lock);
+        __atomic_add_fetch(&user_list_hits, 1, __ATOMIC_RELAXED);
+        return rendered;
+    }
+
+    rendered = render_list_as(head, format, version);
+    pthread_rwlock_unlock(&dir_lock);
+    __atomic_add_fetch(&user_list_misses, 1, __ATOMIC_RELAXED);
+
+    cache_put(&user_list_cache[format], rendered, &user_list_cache_lock);
+    return rendered;
 }
 
+
+/*
+ * return the hit and miss counts of the response cache
+ */
+char *cache_report(void) {
+    char *report = malloc(256);
+    if (report == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    snprintf(report, 256,
+             "Cache\n"
+             "\tprofile: %lu hits, %lu misses\n"
+             "\tlist_users: %lu hits, %lu misses\n",
+             __atomic_load_n(&profile_hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&profile_misses, __ATOMIC_RELAXED),
+             __atomic_load_n(&user_list_hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&user_list_misses, __ATOMIC_RELAXED));
+    return report;
+}
@@ -1,33 +1,170 @@
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
 #include <time.h>
+#include <stdint.h>
 
 #define MAX_NAME 32 // max username AND profile_pic filename lengths
-#define MAX_FRIENDS 10 
+#define DATE_SIZE 26 // asctime output, newline and null terminator included
+#define FRIEND_INLINE 4 // friend ids stored inside the User before allocating
+
+// a user's friends, as a sorted array of user ids. small sets live in
+// inline_ids; large ones also get an open addressing hash index so
+// membership checks stay O(1) for users with thousands of friends.
+typedef struct friend_set {
+    unsigned int *ids; // sorted ascending, points at inline_ids while small
+    unsigned int count;
+    unsigned int cap;
+    unsigned int *index; // NULL until count passes FRIEND_INDEX_MIN
+    unsigned int index_cap;
+    unsigned int inline_ids[FRIEND_INLINE];
+} FriendSet;
+
+// a rendered response, shared by the response cache and everyone it was
+// handed to; freed when the last reference is released
+typedef struct rendered {
+    int refs;
+    unsigned long version; // version of the data it was rendered from
+    size_t len;
+    char *data;
+} Rendered;
+
+// the formats responses are rendered (and cached) in: the text protocol,
+// or frames of the binary protocol (see binary.h)
+typedef enum render_format {
+    FORMAT_TEXT,
+    FORMAT_BINARY,
+    NUM_FORMATS
+} RenderFormat;
+
+// a user's posts, oldest first, so a page of them is a slice. a post's
+// index never changes, which makes it a stable cursor for paging
+typedef struct post_list {
+    struct post **items;
+    unsigned int count;
+    unsigned int cap;
+} PostList;
+
+// the newest posts from a user's wall and its friends' walls, by date,
+// oldest first in a ring; see feed_page
+typedef struct timeline {
+    struct post **items; // NULL until the first post arrives
+    unsigned int start;
+    unsigned int count;
+    unsigned int cap; // a power of two, at most FEED_CAP
+    int stale; // filled from the walls on its first read, see restore_feeds
+} Timeline;
 
 typedef struct user {
     char name[MAX_NAME];
     char profile_pic[MAX_NAME];
-    struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
+    unsigned int id; // dense, in creation order, never reused
+    unsigned long version; // bumped whenever the profile changes
+    Rendered *profile_cache[NUM_FORMATS]; // last rendered profile, may be out of date
+    PostList posts;
+    Timeline feed;
+    unsigned int feed_pull_from; // index of the first post not pushed to friends' feeds
+    FriendSet friends;
     struct user *next;
 } User;
 
+// authors and walls are referenced by id (see find_name_by_id), which keeps
+// a Post at 64 bytes
 typedef struct post {
-    char author[MAX_NAME];
-    char *contents;
-    time_t *date;
-    struct post *next;
+    char *contents; // NULL once the body is spilled, see post_body
+    uint64_t cold_offset; // where the body is in the cold segment, once spilled
+    time_t date;
+    unsigned int length; // of the body, null terminator not included
+    unsigned int author_id;
+    unsigned int target_id; // whose wall it's on
+    char date_text[DATE_SIZE]; // date formatted by asctime
 } Post;
 
+// a page cursor that starts at the newest post
+#define PAGE_NEWEST 0xffffffffu
+
+#define FEED_CAP 128 // posts kept in a timeline, and the longest feed_page
+#define FEED_FANOUT_MAX 256 // default of set_feed_fanout_max
+#define SUGGEST_MAX 100 // most suggestions suggest_friends makes
+#define DISTANCE_MAX_HOPS 16 // longest path friend_distance looks for
+#define SEARCH_MAX 100 // most posts search_posts returns
+
+// called after every change to the store, see set_store_hooks
+typedef struct store_hooks {
+    void *arg; // passed to every hook
+    void (*user_created)(void *arg, const User *user);
+    void (*friends_made)(void *arg, const User *user1, const User *user2);
+    void (*post_made)(void *arg, const User *target, const Post *post);
+} StoreHooks;
+
+void set_store_hooks(const StoreHooks *new_hooks);
+
 int create_user(const char *name, User **user_ptr_add);
 
 User *find_user(const char *name, const User *head);
 
+User *find_user_by_id(unsigned int id);
+
+const char *find_name_by_id(unsigned int id);
+
+int is_friend(const User *user, const User *other);
+
 char *list_users(const User *curr);
 
 int make_friends(const char *name1, const char *name2, User *head);
 
 char *print_user(const User *user);
 
-int make_post(const User *author, User *target, char *contents);
+int make_post(const User *author, User *target, const char *contents);
+
+int set_post_budget(size_t budget, const char *cold_path);
+
+const char *post_body(const Post *post, char *buf);
+
+unsigned int user_count(void);
+
+void store_counts(unsigned long *users, unsigned long *friendships, unsigned long *posts);
+
+void store_lock_all(void);
+
+void store_unlock_all(void);
+
+int restore_friends(User *user, const unsigned int *ids, unsigned int count);
+
+int restore_post(User *target, unsigned int author_id, time_t date,
+                 const char *date_text, const char *contents);
+
+void restore_feeds(void);
+
+void start_search_index(void);
+
+char *memory_report(void);
+
+Rendered *rendered_new(char *data, size_t len, unsigned long version);
+
+void rendered_release(Rendered *rendered);
+
+Rendered *cached_profile(const User *user, RenderFormat format);
+
+Rendered *cached_user_list(const User *head, RenderFormat format);
+
+Rendered *post_page(const User *user, int with_profile, unsigned int limit, unsigned int before,
+                    RenderFormat format);
+
+void set_feed_fanout_max(unsigned int max_friends);
+
+Rendered *feed_page(const User *user, unsigned int limit, RenderFormat format);
+
+Rendered *mutual_friends(const User *user, const User *other, RenderFormat format);
+
+Rendered *suggest_friends(const User *user, unsigned int k, RenderFormat format);
+
+int friend_distance(const User *from, const User *to, unsigned int *path);
+
+Rendered *distance_query(const User *from, const User *to, int with_path, RenderFormat format);
+
+Rendered *search_posts(const char *query, unsigned int limit, RenderFormat format);
 
+char *cache_report(void);
 
+#endif
@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/wait.h>
+#include "friends.h"
+
+// microbenchmarks for the friends.c api alone, no network involved. every
+// size runs in a forked child, since the store is global and can't be
+// emptied, and every result is printed as one line of key=value pairs:
+//
+//   bench=<function> users=<N> posts=<P> ops=<count> ns_per_op=<time>
+//
+// the feed_* lines compare the feed strategies (see bench_feed) on the same
+// skewed friend graph.
+//
+// the set of lines and their order only depend on the -u and -p limits, so
+// two runs can be compared line by line (e.g. in ci).
+
+// monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, fixed seed so every run does the same work
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+void report(const char *bench, long users, long posts, long ops, uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    printf("bench=%s users=%ld posts=%ld ops=%ld ns_per_op=%.1f\n",
+           bench, users, posts, ops, (double)elapsed / ops);
+    fflush(stdout);
+}
+
+void user_name(char *name, long i) {
+    snprintf(name, MAX_NAME, "user%ld", i);
+}
+
+// a store of num_users users, each friends with the next four
+void bench_users(long num_users) {
+    User *head = NULL;
+    char name[MAX_NAME], other[MAX_NAME];
+    uint64_t rng = 88172645463325252ULL;
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        create_user(name, &head);
+    }
+    report("create_user", num_users, 0, num_users, start);
+
+    long lookups = num_users < 1000000 ? 1000000 : num_users;
+    long found = 0;
+    start = now_ns();
+    for (long i = 0; i < lookups; i++) {
+        user_name(name, next_random(&rng) % num_users);
+        found += find_user(name, head) != NULL;
+    }
+    report("find_user", num_users, 0, lookups, start);
+    if (found != lookups) {
+        fprintf(stderr, "friends_bench: lost users\n");
+        exit(1);
+    }
+
+    start = now_ns();
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        for (long j = 1; j <= 4; j++) {
+            user_name(other, (i + j) % num_users);
+            make_friends(name, other, head);
+        }
+    }
+    report("make_friends", num_users, 0, num_users * 4, start);
+
+    // every user has eight friends and no posts
+    long renders = 100000;
+    start = now_ns();
+    for (long i = 0; i < renders; i++) {
+        free(print_user(find_user_by_id(next_random(&rng) % num_users)));
+    }
+    report("print_user", num_users, 0, renders, start);
+
+    long lists = 10000000 / num_users;
+    start = now_ns();
+    for (long i = 0; i < lists; i++) {
+        free(list_users(head));
+    }
+    report("list_users", num_users, 0, lists, start);
+}
+
+// two friends, one of them writing num_posts posts on the other's wall
+void bench_posts(long num_posts) {
+    User *head = NULL;
+    create_user("author", &head);
+    create_user("target", &head);
+    make_friends("author", "target", head);
+    User *author = find_user("author", head);
+    User *target = find_user("target", head);
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < num_posts; i++) {
+        char contents[64];
+        snprintf(contents, sizeof(contents), "benchmark post number %ld with some filler", i);
+        make_post(author, target, contents);
+    }
+    report("make_post", 2, num_posts, num_posts, start);
+
+    long renders = 1000000 / num_posts;
+    start = now_ns();
+    for (long i = 0; i < renders; i++) {
+        free(print_user(target));
+    }
+    report("print_user", 2, num_posts, renders, start);
+
+    // a page of 20 from the middle, which shouldn't depend on num_posts
+    long pages = 100000;
+    start = now_ns();
+    for (long i = 0; i < pages; i++) {
+        rendered_release(post_page(target, 0, 20, num_posts / 2, FORMAT_TEXT));
+    }
+    report("post_page", 2, num_posts, pages, start);
+}
+
+// two users with num_friends friends each, half of them shared, in a store
+// of 4 * num_friends users where everyone else has 16 random friends: the
+// friends in common of the two, and suggestions for one of them
+void bench_graph(long num_friends) {
+    User *head = NULL;
+    char name[MAX_NAME], other[MAX_NAME];
+    uint64_t rng = 88172645463325252ULL;
+    long num_users = num_friends * 4;
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        create_user(name, &head);
+    }
+    // user0 befriends users [2, 2 + n), user1 users [2 + n / 2, 2 + 3n / 2)
+    for (long i = 0; i < num_friends; i++) {
+        user_name(name, 2 + i);
+        make_friends("user0", name, head);
+        user_name(name, 2 + num_friends / 2 + i);
+        make_friends("user1", name, head);
+    }
+    for (long i = 2; i < num_users; i++) {
+        user_name(name, i);
+        for (int j = 0; j < 8; j++) {
+            user_name(other, 2 + next_random(&rng) % (num_users - 2));
+            make_friends(name, other, head);
+        }
+    }
+    User *user0 = find_user("user0", head);
+    User *user1 = find_user("user1", head);
+
+    long queries = 10000000 / num_friends;
+    uint64_t start = now_ns();
+    for (long i = 0; i < queries; i++) {
+        rendered_release(mutual_friends(user0, user1, FORMAT_BINARY));
+    }
+    report("mutual_friends", num_users, 0, queries, start);
+
+    queries = 1000000 / num_friends;
+    start = now_ns();
+    for (long i = 0; i < queries; i++) {
+        rendered_release(suggest_friends(user0, 10, FORMAT_BINARY));
+    }
+    report("suggest_friends", num_users, 0, queries, start);
+}
+
+// the feed strategies compared by bench_feed, as set_feed_fanout_max values
+struct feed_strategy {
+    const char *name;
+    unsigned int fanout_max;
+};
+
+const struct feed_strategy feed_strategies[] = {
+    {"push", (unsigned int)-1}, // fan out every post on write
+    {"pull", 0}, // read every feed off the friends' walls
+    {"hybrid", FEED_FANOUT_MAX}, // push, except for users with many friends
+};
+const struct feed_strategy *feed_strategy;
+
+// num_users users with a power law friend count (preferential attachment:
+// each new user befriends four users picked in proportion to the friends
+// they have). returns every friendship's two ends, so a random element is
+// a user picked the same way, and their number in *num_ends
+unsigned int *power_law_graph(long num_users, User **head, uint64_t *rng, long *num_ends_ptr) {
+    char name[MAX_NAME], other[MAX_NAME];
+    long max_ends = num_users * 8 + 2;
+    unsigned int *ends = malloc(sizeof(unsigned int) * max_ends);
+    if (ends == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long num_ends = 0;
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        create_user(name, head);
+    }
+    make_friends("user0", "user1", *head);
+    ends[num_ends++] = 0;
+    ends[num_ends++] = 1;
+    for (long i = 2; i < num_users; i++) {
+        user_name(name, i);
+        for (int j = 0; j < 4; j++) {
+            unsigned int friend = ends[next_random(rng) % num_ends];
+            user_name(other, friend);
+            if (make_friends(name, other, *head) == 0) {
+                ends[num_ends++] = i;
+                ends[num_ends++] = friend;
+            }
+        }
+    }
+    *num_ends_ptr = num_ends;
+    return ends;
+}
+
+// num_users users, each befriending four others picked at random
+void random_graph(long num_users, User **head, uint64_t *rng) {
+    char name[MAX_NAME], other[MAX_NAME];
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        create_user(name, head);
+    }
+    for (long i = 0; i < num_users; i++) {
+        user_name(name, i);
+        for (int j = 0; j < 4; j++) {
+            user_name(other, next_random(rng) % num_users);
+            make_friends(name, other, *head);
+        }
+    }
+}
+
+// a power law graph of num_users users (see power_law_graph), then one
+// post per user, each on a wall picked in proportion to its friends by
+// one of that wall's friends, then feeds of random users
+void bench_feed(long num_users) {
+    User *head = NULL;
+    uint64_t rng = 88172645463325252ULL;
+    long num_ends;
+    set_feed_fanout_max(feed_strategy->fanout_max);
+    unsigned int *ends = power_law_graph(num_users, &head, &rng, &num_ends);
+
+    long posts = num_users;
+    uint64_t start = now_ns();
+    for (long i = 0; i < posts; i++) {
+        User *target = find_user_by_id(ends[next_random(&rng) % num_ends]);
+        User *author = find_user_by_id(target->friends.ids[next_random(&rng) % target->friends.count]);
+        make_post(author, target, "benchmark post with some filler");
+    }
+    char bench[32];
+    snprintf(bench, sizeof(bench), "feed_%s_post", feed_strategy->name);
+    report(bench, num_users, posts, posts, start);
+
+    long reads = 100000;
+    start = now_ns();
+    for (long i = 0; i < reads; i++) {
+        rendered_release(feed_page(find_user_by_id(next_random(&rng) % num_users), 20, FORMAT_TEXT));
+    }
+    snprintf(bench, sizeof(bench), "feed_%s_read", feed_strategy->name);
+    report(bench, num_users, posts, reads, start);
+    free(ends);
+}
+
+// distances and paths between random pairs of users, in the store built
+void time_distances(const char *graph, long num_users, uint64_t *rng) {
+    char bench[32];
+    unsigned int path[DISTANCE_MAX_HOPS + 1];
+    long queries = 10000;
+    for (int with_path = 0; with_path < 2; with_path++) {
+        uint64_t start = now_ns();
+        for (long i = 0; i < queries; i++) {
+            User *from = find_user_by_id(next_random(rng) % num_users);
+            User *to = find_user_by_id(next_random(rng) % num_users);
+            friend_distance(from, to, with_path ? path : NULL);
+        }
+        snprintf(bench, sizeof(bench), "%s_%s", with_path ? "path" : "distance", graph);
+        report(bench, num_users, 0, queries, start);
+    }
+}
+
+void bench_distance_random(long num_users) {
+    User *head = NULL;
+    uint64_t rng = 88172645463325252ULL;
+    random_graph(num_users, &head, &rng);
+    time_distances("random", num_users, &rng);
+}
+
+void bench_distance_power_law(long num_users) {
+    User *head = NULL;
+    uint64_t rng = 88172645463325252ULL;
+    long num_ends;
+    free(power_law_graph(num_users, &head, &rng, &num_ends));
+    time_distances("power_law", num_users, &rng);
+}
+
+// a word's rank out of 10000, the common ones far more likely: the smaller
+// of two draws from 0 to 99 picks the word, then it's squared
+unsigned long skewed_word(uint64_t *rng) {
+    uint64_t a = next_random(rng) % 100;
+    uint64_t b = next_random(rng) % 100;
+    return (a < b ? a : b) * (a < b ? a : b);
+}
+
+// num_posts posts of eight skewed_word words each, then searches for one
+// and two words picked the same way (so mostly with long posting lists)
+void bench_search(long num_posts) {
+    User *head = NULL;
+    uint64_t rng = 88172645463325252ULL;
+    create_user("author", &head);
+    create_user("target", &head);
+    make_friends("author", "target", head);
+    User *author = find_user("author", head);
+    User *target = find_user("target", head);
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < num_posts; i++) {
+        char contents[256];
+        int len = 0;
+        for (int j = 0; j < 8; j++) {
+            len += snprintf(contents + len, sizeof(contents) - len, "word%lu ", skewed_word(&rng));
+        }
+        make_post(author, target, contents);
+    }
+    report("make_post_indexed", 2, num_posts, num_posts, start);
+
+    long queries = 100000;
+    for (int words = 1; words <= 2; words++) {
+        start = now_ns();
+        for (long i = 0; i < queries; i++) {
+            char query[64];
+            unsigned long rank1 = skewed_word(&rng);
+            unsigned long rank2 = skewed_word(&rng);
+            snprintf(query, sizeof(query), words == 1 ? "word%lu" : "word%lu word%lu", rank1, rank2);
+            rendered_release(search_posts(query, 20, FORMAT_BINARY));
+        }
+        report(words == 1 ? "search_one_word" : "search_two_words", 2, num_posts, queries, start);
+    }
+}
+
+// bench_posts with post bodies capped at COLD_BUDGET bytes of memory, so
+// all but the newest are spilled to a cold segment: pages of the oldest
+// posts come back from it, pages of the newest from memory
+#define COLD_BUDGET (1 << 20)
+#define COLD_PATH "friends_bench.cold"
+
+void bench_cold(long num_posts) {
+    User *head = NULL;
+    if (set_post_budget(COLD_BUDGET, COLD_PATH) != 0) {
+        exit(1);
+    }
+    unlink(COLD_PATH); // still open, gone once the child exits
+    create_user("author", &head);
+    create_user("target", &head);
+    make_friends("author", "target", head);
+    User *author = find_user("author", head);
+    User *target = find_user("target", head);
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < num_posts; i++) {
+        char contents[64];
+        snprintf(contents, sizeof(contents), "benchmark post number %ld with some filler", i);
+        make_post(author, target, contents);
+    }
+    report("make_post_cold", 2, num_posts, num_posts, start);
+
+    long pages = 100000;
+    start = now_ns();
+    for (long i = 0; i < pages; i++) {
+        rendered_release(post_page(target, 0, 20, 20, FORMAT_TEXT));
+    }
+    report("post_page_cold", 2, num_posts, pages, start);
+
+    start = now_ns();
+    for (long i = 0; i < pages; i++) {
+        rendered_release(post_page(target, 0, 20, PAGE_NEWEST, FORMAT_TEXT));
+    }
+    report("post_page_hot", 2, num_posts, pages, start);
+}
+
+// runs bench(size) in a child with a fresh store
+void run_child(void (*bench)(long), long size) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        bench(size);
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "friends_bench: run of size %ld failed\n", size);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    long max_users = 1000000;
+    long max_posts = 100000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:p:")) != -1) {
+        switch (opt) {
+            case 'u':
+                max_users = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                max_posts = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-u max users] [-p max posts]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    for (long users = 1000; users <= max_users; users *= 10) {
+        run_child(bench_users, users);
+    }
+    for (long posts = 10; posts <= max_posts; posts *= 10) {
+        run_child(bench_posts, posts);
+    }
+    for (long posts = 100000; posts <= max_posts * 10; posts *= 10) {
+        run_child(bench_cold, posts);
+    }
+    for (long posts = 10000; posts <= max_posts * 10; posts *= 10) {
+        run_child(bench_search, posts);
+    }
+    for (long users = 1000; users <= max_users; users *= 10) {
+        run_child(bench_distance_random, users);
+        run_child(bench_distance_power_law, users);
+    }
+    for (long friends = 100; friends <= 10000; friends *= 10) {
+        run_child(bench_graph, friends);
+    }
+    for (long users = 1000; users <= max_users; users *= 10) {
+        for (size_t i = 0; i < sizeof(feed_strategies) / sizeof(feed_strategies[0]); i++) {
+            feed_strategy = &feed_strategies[i];
+            run_child(bench_feed, users);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include "friends.h"
+#include "journal.h"
+#include "strbuf.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+
+
+/*
+ * the journal: the store's change hooks append records to a pending buffer
+ * (under buf_lock, while the store still holds the locks of the change, so
+ * records come out in a replayable order), and journal_commit swaps that
+ * buffer out and writes it with one write and at most one fsync (under
+ * io_lock, so commits from different threads go out in order). a thread
+ * that waited for io_lock finds its records already written and synced by
+ * whoever held it: that is the group commit.
+ */
+static struct {
+    int fd; // -1 while there is no journal
+    Durability mode;
+    long interval_ms;
+    pthread_mutex_t buf_lock; // guards pending and next_lsn
+    pthread_mutex_t io_lock; // guards everything below it
+    StrBuf pending;
+    uint64_t next_lsn;
+    StrBuf writing;
+    uint64_t synced_lsn;
+    struct timespec last_sync;
+} journal = {
+    .fd = -1,
+    .buf_lock = PTHREAD_MUTEX_INITIALIZER,
+    .io_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320u : 0);
+        }
+        crc_table[i] = crc;
+    }
+}
+
+
+// continue a crc32 (as used by zlib) over more data; start from 0
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+// the crc of a record: the header after the crc field, then the payload
+static uint32_t record_crc(const JournalHeader *header, const void *payload1, size_t len1,
+                           const void *payload2, size_t len2) {
+    uint32_t crc = crc32_update(0, (const char *)header + sizeof(header->crc),
+                                sizeof(*header) - sizeof(header->crc));
+    crc = crc32_update(crc, payload1, len1);
+    return crc32_update(crc, payload2, len2);
+}
+
+
+// append one record (payload in up to two pieces) to the pending buffer
+static void journal_append(uint32_t type, const void *data1, size_t len1,
+                           const void *data2, size_t len2) {
+    JournalHeader header;
+    header.len = len1 + len2;
+    header.type = type;
+    header.reserved = 0;
+
+    pthread_mutex_lock(&journal.buf_lock);
+    header.lsn = journal.next_lsn++;
+    header.crc = record_crc(&header, data1, len1, data2, len2);
+    sb_append(&journal.pending, (const char *)&header, sizeof(header));
+    sb_append(&journal.pending, data1, len1);
+    if (len2 > 0) {
+        sb_append(&journal.pending, data2, len2);
+    }
+    pthread_mutex_unlock(&journal.buf_lock);
+}
+
+
+static void journal_user_created(void *arg, const User *user) {
+    journal_append(JOURNAL_USER, user->name, strnlen(user->name, MAX_NAME), NULL, 0);
+}
+
+
+static void journal_friends_made(void *arg, const User *user1, const User *user2) {
+    uint32_t ids[2] = {user1->id, user2->id};
+    journal_append(JOURNAL_FRIENDS, ids, sizeof(ids), NULL, 0);
+}
+
+
+static void journal_post_made(void *arg, const User *target, const Post *post) {
+    struct {
+        uint32_t target;
+        uint32_t author;
+        int64_t date;
+    } fixed = {target->id, post->author_id, post->date};
+    journal_append(JOURNAL_POST, &fixed, sizeof(fixed), post->contents, post->length + 1);
+}
+
+
+// apply one record to the store, counting posts in *num_posts
+// return 0 on success, 1 if it doesn't fit the store
+static int journal_apply(const JournalHeader *header, const char *payload, User **user_list_ptr,
+                         uint64_t *num_posts) {
+    if (header->type == JOURNAL_USER) {
+        char name[MAX_NAME];
+        if (header->len >= MAX_NAME) {
+            return 1;
+        }
+        memcpy(name, payload, header->len);
+        name[header->len] = '\0';
+        return create_user(name, user_list_ptr) != 0;
+    } else if (header->type == JOURNAL_FRIENDS && header->len == 2 * sizeof(uint32_t)) {
+        uint32_t ids[2];
+        memcpy(ids, payload, sizeof(ids));
+        User *user1 = find_user_by_id(ids[0]);
+        User *user2 = find_user_by_id(ids[1]);
+        if (user1 == NULL || user2 == NULL) {
+            return 1;
+        }
+        return make_friends(user1->name, user2->name, *user_list_ptr) != 0;
+    } else if (header->type == JOURNAL_POST && header->len > 16 && payload[header->len - 1] == '\0') {
+        uint32_t target_id, author_id;
+        int64_t date;
+        memcpy(&target_id, payload, 4);
+        memcpy(&author_id, payload + 4, 4);
+        memcpy(&date, payload + 8, 8);
+        User *target = find_user_by_id(target_id);
+        if (target == NULL) {
+            return 1;
+        }
+        time_t when = date;
+        struct tm local;
+        char date_text[DATE_SIZE];
+        asctime_r(localtime_r(&when, &local), date_text);
+        // the body stays in the mapped journal
+        (*num_posts)++;
+        return restore_post(target, author_id, when, date_text, payload + 16) != 0;
+    }
+    return 1;
+}
+
+
+/*
+ * replay the journal at path on top of the store, skipping records up to
+ * and including after_lsn (already in a loaded snapshot). the file stays
+ * mapped: replayed post bodies are used from it in place. a torn record at
+ * the end (a crash mid write) is cut off, so new records follow the last
+ * whole one. sets *last_lsn to the lsn of the last record in the journal,
+ * or leaves it alone if there are none.
+ *
+ * return:
+ *   - 0 on success (a missing journal is an empty one).
+ *   - 1 if the journal can't be read or doesn't fit the store.
+ */
+int journal_replay(const char *path, User **user_list_ptr, uint64_t after_lsn, uint64_t *last_lsn) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return access(path, F_OK) == 0 ? (perror(path), 1) : 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+
+    size_t off = 0;
+    uint64_t num_posts = 0;
+    while (off + sizeof(JournalHeader) <= (size_t)st.st_size) {
+        JournalHeader header;
+        memcpy(&header, base + off, sizeof(header));
+        const char *payload = base + off + sizeof(header);
+        if (header.len > st.st_size - off - sizeof(header)
+            || record_crc(&header, payload, header.len, NULL, 0) != header.crc) {
+            break; // torn tail
+        }
+        if (header.lsn > after_lsn && journal_apply(&header, payload, user_list_ptr, &num_posts) != 0) {
+            fprintf(stderr, "%s: record %lu doesn't fit the store\n", path, (unsigned long)header.lsn);
+            close(fd);
+            return 1;
+        }
+        *last_lsn = header.lsn;
+        off += sizeof(header) + header.len;
+    }
+
+    if (off < (size_t)st.st_size) {
+        fprintf(stderr, "%s: dropping %lu bytes of torn records\n", path,
+                (unsigned long)(st.st_size - off));
+        if (ftruncate(fd, off) != 0) {
+            perror(path);
+        }
+    }
+    close(fd);
+    // replayed posts went on the walls only
+    if (num_posts > 0) {
+        restore_feeds();
+    }
+    return 0;
+}
+
+
+/*
+ * start journaling every change to the store into path (appending), with
+ * the given durability. last_lsn is the lsn of the last change already in
+ * the store (from a snapshot or replay), 0 if there are none.
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the journal can't be opened.
+ */
+int journal_open(const char *path, Durability mode, long interval_ms, uint64_t last_lsn) {
+    journal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal.fd < 0) {
+        perror(path);
+        return 1;
+    }
+    journal.mode = mode;
+    journal.interval_ms = interval_ms;
+    sb_init(&journal.pending, JOURNAL_BUFFER_SIZE);
+    sb_init(&journal.writing, JOURNAL_BUFFER_SIZE);
+    journal.next_lsn = last_lsn + 1;
+    journal.synced_lsn = last_lsn;
+    clock_gettime(CLOCK_MONOTONIC, &journal.last_sync);
+
+    StoreHooks journal_hooks = {NULL, journal_user_created, journal_friends_made, journal_post_made};
+    set_store_hooks(&journal_hooks);
+    return 0;
+}
+
+
+/*
+ * write every record appended so far, and fsync them unless the durability
+ * is JOURNAL_INTERVAL and the last fsync was less than interval_ms ago.
+ * once this returns, the caller's own changes are as durable as the mode
+ * promises.
+ *
+ * return:
+ *   - 0 on success (or if there is no journal).
+ *   - 1 if the journal couldn't be written.
+ */
+int journal_commit(void) {
+    if (journal.fd < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.io_lock);
+    pthread_mutex_lock(&journal.buf_lock);
+    StrBuf batch = journal.pending;
+    journal.pending = journal.writing;
+    journal.writing = batch;
+    uint64_t last_lsn = journal.next_lsn - 1;
+    pthread_mutex_unlock(&journal.buf_lock);
+
+    int err = 0;
+    size_t done = 0;
+    while (done < journal.writing.len) {
+        ssize_t nbytes = write(journal.fd, journal.writing.data + done, journal.writing.len - done);
+        if (nbytes < 0) {
+            perror("journal: write");
+            err = 1;
+            break;
+        }
+        done += nbytes;
+    }
+    journal.writing.len = 0;
+
+    if (!err && journal.synced_lsn < last_lsn) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long since_ms = (now.tv_sec - journal.last_sync.tv_sec) * 1000
+                        + (now.tv_nsec - journal.last_sync.tv_nsec) / 1000000;
+        if (journal.mode != JOURNAL_INTERVAL || since_ms >= journal.interval_ms) {
+            if (fdatasync(journal.fd) != 0) {
+                perror("journal: fdatasync");
+                err = 1;
+            } else {
+                journal.synced_lsn = last_lsn;
+                journal.last_sync = now;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal.io_lock);
+    return err;
+}
+
+
+/*
+ * return the lsn of the last record appended (0 if none)
+ */
+uint64_t journal_lsn(void) {
+    pthread_mutex_lock(&journal.buf_lock);
+    uint64_t lsn = journal.next_lsn > 0 ? journal.next_lsn - 1 : 0;
+    pthread_mutex_unlock(&journal.buf_lock);
+    return lsn;
+}
+
+
+/*
+ * return the durability mode, for callers deciding when to commit
+ */
+Durability journal_mode(void) {
+    return journal.mode;
+}
+
+
+/*
+ * return how long (in ms) an event loop may wait before calling
+ * journal_commit, so interval fsyncs happen even when nothing else does,
+ * or -1 if it may wait forever
+ */
+long journal_timeout(void) {
+    if (journal.fd < 0 || journal.mode != JOURNAL_INTERVAL) {
+        return -1;
+    }
+    return journal.interval_ms;
+}
@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include "friends.h"
+
+// when journal records reach the disk:
+// - JOURNAL_PER_OP: written and fsync'd after every command, before its reply
+// - JOURNAL_BATCH: written and fsync'd once per event loop iteration (group
+//   commit), before the replies of that iteration go out
+// - JOURNAL_INTERVAL: written once per iteration, fsync'd at most every
+//   interval_ms (replies don't wait, a crash can lose the last interval)
+typedef enum durability {
+    JOURNAL_PER_OP,
+    JOURNAL_BATCH,
+    JOURNAL_INTERVAL
+} Durability;
+
+// record types
+#define JOURNAL_USER 1 // payload: the name
+#define JOURNAL_FRIENDS 2 // payload: uint32_t id1, uint32_t id2
+#define JOURNAL_POST 3 // payload: uint32_t target, uint32_t author, int64_t date, null terminated body
+
+/*
+ * every record starts with this header, followed by len bytes of payload.
+ * crc is the crc32 of everything after it (the rest of the header and the
+ * payload), so a torn write at the end of the journal can be detected.
+ */
+typedef struct journal_header {
+    uint32_t crc;
+    uint32_t len;
+    uint64_t lsn; // log sequence number, one up from the previous record
+    uint32_t type;
+    uint32_t reserved;
+} JournalHeader;
+
+int journal_replay(const char *path, User **user_list_ptr, uint64_t after_lsn, uint64_t *last_lsn);
+
+int journal_open(const char *path, Durability mode, long interval_ms, uint64_t last_lsn);
+
+int journal_commit(void);
+
+uint64_t journal_lsn(void);
+
+Durability journal_mode(void);
+
+long journal_timeout(void);
@@ -0,0 +1,472 @@
+#include "search.h"
+#include "slab.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+/*
+ * full text search: an inverted index from every term (a word, lowercased)
+ * to the ids of the documents it appears in, its posting list. documents
+ * get ids in the order they're added, so every posting list is sorted and
+ * the newest documents are at its end.
+ *
+ * posting lists are compressed: ids are grouped in blocks of
+ * POSTING_BLOCK, and every id but the first of a block is stored as a
+ * varint of the gap from the one before it. each block has a skip entry
+ * with its first id and where the rest of it starts, so a list can be
+ * searched by galloping over the skip entries and decoding one block.
+ *
+ * terms are spread over INDEX_SHARDS shards by hash, each with its own
+ * lock, term table and storage. a document is added with the locks of all
+ * the shards its terms fall in held (taken in ascending order), and only
+ * takes its id once it holds them: two documents with a shard in common
+ * are added one after the other, in id order, which keeps every list
+ * sorted without a lock over the whole index.
+ */
+#define INDEX_SHARDS 64
+#define POSTING_BLOCK 64
+#define TERMS_INITIAL_CAP 1024
+#define LISTS_PER_CHUNK 1024
+
+// the ids of documents are resolved through a two level table, like users
+#define DOC_PAGE_SIZE 65536
+#define DOC_PAGES 65536
+
+typedef struct skip {
+    unsigned int first_id;
+    unsigned int offset; // of the varints of the rest of the block
+} Skip;
+
+typedef struct posting_list {
+    char term[SEARCH_MAX_TERM]; // zero padded
+    unsigned char *bytes; // NULL until the second id
+    unsigned int len;
+    unsigned int cap;
+    Skip *skips;
+    unsigned int num_blocks;
+    unsigned int skips_cap;
+    unsigned int count;
+    unsigned int last_id;
+} PostingList;
+
+typedef struct term_slot {
+    unsigned int hash;
+    PostingList *list; // NULL marks an empty slot
+} TermSlot;
+
+typedef struct index_shard {
+    pthread_rwlock_t lock;
+    TermSlot *slots;
+    unsigned int cap; // always a power of two
+    unsigned int num_terms;
+    Slab lists;
+    // read lock free by search_counts
+    unsigned long postings;
+    unsigned long bytes; // of the term table, lists, varints and skips
+} IndexShard;
+
+// a term of a document or query, as tokenize splits them
+typedef struct term {
+    unsigned int hash;
+    unsigned int shard;
+    char text[SEARCH_MAX_TERM]; // zero padded
+} Term;
+
+static IndexShard shards[INDEX_SHARDS];
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static void **doc_pages[DOC_PAGES];
+static unsigned int next_doc_id;
+
+// tokenize's output, per thread so it only grows
+static __thread Term *scratch;
+static __thread unsigned int scratch_cap;
+
+
+static void index_init(void) {
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        IndexShard *shard = &shards[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->slots = calloc(TERMS_INITIAL_CAP, sizeof(TermSlot));
+        if (shard->slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        shard->cap = TERMS_INITIAL_CAP;
+        slab_init(&shard->lists, sizeof(PostingList), LISTS_PER_CHUNK);
+        shard->bytes = sizeof(TermSlot) * TERMS_INITIAL_CAP;
+    }
+}
+
+
+static int term_order(const void *a, const void *b) {
+    const Term *term_a = a;
+    const Term *term_b = b;
+    if (term_a->shard != term_b->shard) {
+        return term_a->shard < term_b->shard ? -1 : 1;
+    } else if (term_a->hash != term_b->hash) {
+        return term_a->hash < term_b->hash ? -1 : 1;
+    }
+    return memcmp(term_a->text, term_b->text, SEARCH_MAX_TERM);
+}
+
+
+// split text into its distinct terms: runs of ascii letters and digits and
+// of non-ascii bytes (so utf-8 words stay whole), lowercased and cut to
+// SEARCH_MAX_TERM - 1 bytes. return how many, in *terms sorted by shard
+static unsigned int tokenize(const char *text, Term **terms) {
+    unsigned int count = 0;
+    const unsigned char *at = (const unsigned char *)text;
+    while (*at != '\0') {
+        if (!(*at >= 0x80 || (*at >= '0' && *at <= '9') || ((*at | 0x20) >= 'a' && (*at | 0x20) <= 'z'))) {
+            at++;
+            continue;
+        }
+        if (count == scratch_cap) {
+            scratch_cap = scratch_cap == 0 ? 64 : scratch_cap * 2;
+            scratch = realloc(scratch, sizeof(Term) * scratch_cap);
+            if (scratch == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        Term *term = &scratch[count++];
+        memset(term->text, 0, SEARCH_MAX_TERM);
+        unsigned int len = 0;
+        unsigned int hash = 2166136261u; // fnv-1a
+        for (; *at >= 0x80 || (*at >= '0' && *at <= '9') || ((*at | 0x20) >= 'a' && (*at | 0x20) <= 'z'); at++) {
+            if (len < SEARCH_MAX_TERM - 1) {
+                char c = *at >= 'A' && *at <= 'Z' ? *at | 0x20 : *at;
+                term->text[len++] = c;
+                hash = (hash ^ (unsigned char)c) * 16777619u;
+            }
+        }
+        term->hash = hash;
+        term->shard = (hash >> 16) % INDEX_SHARDS;
+    }
+
+    qsort(scratch, count, sizeof(Term), term_order);
+    unsigned int distinct = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (distinct == 0 || term_order(&scratch[distinct - 1], &scratch[i]) != 0) {
+            scratch[distinct++] = scratch[i];
+        }
+    }
+    *terms = scratch;
+    return distinct;
+}
+
+
+// the posting list of a term, with its shard locked (for writing if
+// create is set, to add the term when it's new), or NULL
+static PostingList *term_list(IndexShard *shard, const Term *term, int create) {
+    unsigned int mask = shard->cap - 1;
+    unsigned int i = term->hash & mask;
+    for (; shard->slots[i].list != NULL; i = (i + 1) & mask) {
+        if (shard->slots[i].hash == term->hash
+            && memcmp(shard->slots[i].list->term, term->text, SEARCH_MAX_TERM) == 0) {
+            return shard->slots[i].list;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    PostingList *list = slab_alloc(&shard->lists);
+    memcpy(list->term, term->text, SEARCH_MAX_TERM);
+    shard->slots[i].hash = term->hash;
+    shard->slots[i].list = list;
+    __atomic_add_fetch(&shard->num_terms, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shard->bytes, sizeof(PostingList), __ATOMIC_RELAXED);
+
+    // keep the table at most 3/4 full
+    if (shard->num_terms * 4 > shard->cap * 3) {
+        unsigned int cap = shard->cap * 2;
+        TermSlot *slots = calloc(cap, sizeof(TermSlot));
+        if (slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (unsigned int j = 0; j < shard->cap; j++) {
+            if (shard->slots[j].list != NULL) {
+                unsigned int k = shard->slots[j].hash & (cap - 1);
+                while (slots[k].list != NULL) {
+                    k = (k + 1) & (cap - 1);
+                }
+                slots[k] = shard->slots[j];
+            }
+        }
+        free(shard->slots);
+        __atomic_add_fetch(&shard->bytes, sizeof(TermSlot) * (cap - shard->cap), __ATOMIC_RELAXED);
+        shard->slots = slots;
+        shard->cap = cap;
+    }
+    return list;
+}
+
+
+// add an id, larger than any in the list, with the list's shard locked
+// for writing
+static void posting_append(IndexShard *shard, PostingList *list, unsigned int id) {
+    if (list->count % POSTING_BLOCK == 0) {
+        if (list->num_blocks == list->skips_cap) {
+            unsigned int cap = list->skips_cap == 0 ? 1 : list->skips_cap * 2;
+            Skip *skips = realloc(list->skips, sizeof(Skip) * cap);
+            if (skips == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            __atomic_add_fetch(&shard->bytes, sizeof(Skip) * (cap - list->skips_cap), __ATOMIC_RELAXED);
+            list->skips = skips;
+            list->skips_cap = cap;
+        }
+        list->skips[list->num_blocks].first_id = id;
+        list->skips[list->num_blocks].offset = list->len;
+        list->num_blocks++;
+    } else {
+        if (list->cap - list->len < 5) {
+            unsigned int cap = list->cap == 0 ? 16 : list->cap * 2;
+            unsigned char *bytes = realloc(list->bytes, cap);
+            if (bytes == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            __atomic_add_fetch(&shard->bytes, cap - list->cap, __ATOMIC_RELAXED);
+            list->bytes = bytes;
+            list->cap = cap;
+        }
+        unsigned int gap = id - list->last_id;
+        while (gap >= 0x80) {
+            list->bytes[list->len++] = gap | 0x80;
+            gap >>= 7;
+        }
+        list->bytes[list->len++] = gap;
+    }
+    list->last_id = id;
+    list->count++;
+    __atomic_add_fetch(&shard->postings, 1, __ATOMIC_RELAXED);
+}
+
+
+// decode block b of a list into ids, return how many it has
+static unsigned int block_decode(const PostingList *list, unsigned int b, unsigned int *ids) {
+    unsigned int count = b + 1 < list->num_blocks ? POSTING_BLOCK : list->count - b * POSTING_BLOCK;
+    const unsigned char *at = list->bytes + list->skips[b].offset;
+    unsigned int id = list->skips[b].first_id;
+    ids[0] = id;
+    for (unsigned int i = 1; i < count; i++) {
+        unsigned int gap = 0;
+        int shift = 0;
+        while (*at & 0x80) {
+            gap |= (unsigned int)(*at++ & 0x7f) << shift;
+            shift += 7;
+        }
+        gap |= (unsigned int)*at++ << shift;
+        id += gap;
+        ids[i] = id;
+    }
+    return count;
+}
+
+
+// where a query is in one posting list: the block decoded last
+typedef struct cursor {
+    const PostingList *list;
+    int block; // -1 before the first lookup
+    unsigned int count;
+    unsigned int ids[POSTING_BLOCK];
+} Cursor;
+
+
+static int by_count(const void *a, const void *b) {
+    unsigned int count_a = (*(Cursor * const *)a)->list->count;
+    unsigned int count_b = (*(Cursor * const *)b)->list->count;
+    return count_a < count_b ? -1 : count_a > count_b;
+}
+
+
+// return 1 if the cursor's list has id. ids looked up must go down from
+// one call to the next, so the blocks they're in are found by galloping
+// down the skip entries from the last one decoded
+static int cursor_has(Cursor *cursor, unsigned int id) {
+    const PostingList *list = cursor->list;
+    if (list->skips[0].first_id > id) {
+        return 0;
+    }
+    int b = cursor->block >= 0 ? cursor->block : (int)list->num_blocks - 1;
+    if (list->skips[b].first_id > id) {
+        // first_id of hi is past id, of lo isn't (block 0's never is)
+        int hi = b;
+        int lo = b - 1;
+        int step = 1;
+        while (lo > 0 && list->skips[lo].first_id > id) {
+            hi = lo;
+            step *= 2;
+            lo = hi - step > 0 ? hi - step : 0;
+        }
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (list->skips[mid].first_id <= id) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        b = lo;
+    }
+    if (b != cursor->block) {
+        cursor->count = block_decode(list, b, cursor->ids);
+        cursor->block = b;
+    }
+
+    unsigned int lo = 0;
+    unsigned int hi = cursor->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (cursor->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < cursor->count && cursor->ids[lo] == id;
+}
+
+
+// register the document with the next id, with the shards of all its terms locked
+static unsigned int doc_register(void *doc) {
+    unsigned int id = __atomic_fetch_add(&next_doc_id, 1, __ATOMIC_RELAXED);
+    unsigned int page = id / DOC_PAGE_SIZE;
+    void **slots = __atomic_load_n(&doc_pages[page], __ATOMIC_ACQUIRE);
+    if (slots == NULL) {
+        // documents with no shard in common can get here at once
+        slots = calloc(DOC_PAGE_SIZE, sizeof(void *));
+        if (slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        void **expected = NULL;
+        if (!__atomic_compare_exchange_n(&doc_pages[page], &expected, slots, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(slots);
+            slots = expected;
+        }
+    }
+    __atomic_store_n(&slots[id % DOC_PAGE_SIZE], doc, __ATOMIC_RELEASE);
+    return id;
+}
+
+
+/*
+ * add a document to the index, under every term in its text. text only
+ * needs to live until this returns; doc is what search_find hands back.
+ * return the document's id (ids go up from 0 in the order documents are
+ * added)
+ */
+unsigned int search_add(const char *text, void *doc) {
+    pthread_once(&index_once, index_init);
+    Term *terms;
+    unsigned int count = tokenize(text, &terms);
+    for (unsigned int i = 0; i < count; i++) {
+        if (i == 0 || terms[i].shard != terms[i - 1].shard) {
+            pthread_rwlock_wrlock(&shards[terms[i].shard].lock);
+        }
+    }
+
+    unsigned int id = doc_register(doc);
+    for (unsigned int i = 0; i < count; i++) {
+        IndexShard *shard = &shards[terms[i].shard];
+        posting_append(shard, term_list(shard, &terms[i], 1), id);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i == 0 || terms[i].shard != terms[i - 1].shard) {
+            pthread_rwlock_unlock(&shards[terms[i].shard].lock);
+        }
+    }
+    return id;
+}
+
+
+/*
+ * find the newest documents (at most limit) whose text has every term in
+ * the query, and put them in docs, newest first. return how many there
+ * are (0 if the query has no terms)
+ */
+unsigned int search_find(const char *query, unsigned int limit, void **docs) {
+    pthread_once(&index_once, index_init);
+    Term *terms;
+    unsigned int count = tokenize(query, &terms);
+    if (count == 0) {
+        return 0;
+    }
+    Cursor *cursors = malloc(sizeof(Cursor) * count);
+    Cursor **order = malloc(sizeof(Cursor *) * count);
+    if (cursors == NULL || order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i == 0 || terms[i].shard != terms[i - 1].shard) {
+            pthread_rwlock_rdlock(&shards[terms[i].shard].lock);
+        }
+    }
+    unsigned int found = 0;
+    int missing = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        cursors[i].list = term_list(&shards[terms[i].shard], &terms[i], 0);
+        cursors[i].block = -1;
+        order[i] = &cursors[i];
+        missing |= cursors[i].list == NULL;
+    }
+
+    if (!missing) {
+        // walk the shortest list from its newest id down, looking each one
+        // up in the others, until there are enough
+        qsort(order, count, sizeof(Cursor *), by_count);
+        Cursor *driver = order[0];
+        for (int b = (int)driver->list->num_blocks - 1; b >= 0 && found < limit; b--) {
+            unsigned int ids = block_decode(driver->list, b, driver->ids);
+            for (unsigned int i = ids; i > 0 && found < limit; i--) {
+                unsigned int id = driver->ids[i - 1];
+                unsigned int k = 1;
+                while (k < count && cursor_has(order[k], id)) {
+                    k++;
+                }
+                if (k == count) {
+                    docs[found++] = __atomic_load_n(&doc_pages[id / DOC_PAGE_SIZE][id % DOC_PAGE_SIZE],
+                                                    __ATOMIC_ACQUIRE);
+                }
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i == 0 || terms[i].shard != terms[i - 1].shard) {
+            pthread_rwlock_unlock(&shards[terms[i].shard].lock);
+        }
+    }
+    free(order);
+    free(cursors);
+    return found;
+}
+
+
+/*
+ * get the number of distinct terms, of postings (a term in a document),
+ * and the bytes the index takes, without taking any lock
+ */
+void search_counts(unsigned long *terms, unsigned long *postings, unsigned long *bytes) {
+    pthread_once(&index_once, index_init);
+    *terms = 0;
+    *postings = 0;
+    *bytes = 0;
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        *terms += __atomic_load_n(&shards[i].num_terms, __ATOMIC_RELAXED);
+        *postings += __atomic_load_n(&shards[i].postings, __ATOMIC_RELAXED);
+        *bytes += __atomic_load_n(&shards[i].bytes, __ATOMIC_RELAXED);
+    }
+}
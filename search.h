@@ -0,0 +1,12 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#define SEARCH_MAX_TERM 32 // longer words are cut to this, null terminator included
+
+unsigned int search_add(const char *text, void *doc);
+
+unsigned int search_find(const char *query, unsigned int limit, void **docs);
+
+void search_counts(unsigned long *terms, unsigned long *postings, unsigned long *bytes);
+
+#endif
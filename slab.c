@@ -0,0 +1,117 @@
+#include "slab.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/*
+ * set up an empty slab handing out objects of obj_size bytes,
+ * per_chunk of them at a time
+ */
+void slab_init(Slab *slab, size_t obj_size, size_t per_chunk) {
+    // keep every object pointer aligned
+    size_t align = sizeof(void *);
+    slab->obj_size = (obj_size + align - 1) / align * align;
+    slab->per_chunk = per_chunk;
+    slab->chunk = NULL;
+    slab->chunk_used = per_chunk;
+    slab->num_chunks = 0;
+    slab->num_objs = 0;
+}
+
+
+/*
+ * return a zeroed object from the slab, starting a new chunk when the
+ * current one is used up (chunks are never freed)
+ */
+void *slab_alloc(Slab *slab) {
+    if (slab->chunk_used == slab->per_chunk) {
+        slab->chunk = calloc(slab->per_chunk, slab->obj_size);
+        if (slab->chunk == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        slab->chunk_used = 0;
+        slab->num_chunks++;
+    }
+
+    void *obj = slab->chunk + slab->chunk_used * slab->obj_size;
+    slab->chunk_used++;
+    slab->num_objs++;
+    return obj;
+}
+
+
+/*
+ * return the number of bytes reserved by the slab's chunks
+ */
+size_t slab_bytes(const Slab *slab) {
+    return slab->num_chunks * slab->per_chunk * slab->obj_size;
+}
+
+
+/*
+ * set up an empty arena that grows chunk_size bytes at a time
+ */
+void arena_init(Arena *arena, size_t chunk_size) {
+    arena->first = NULL;
+    arena->last = NULL;
+    arena->chunk_size = chunk_size;
+    arena->bytes_used = 0;
+    arena->bytes_reserved = 0;
+}
+
+
+/*
+ * copy the first len bytes of str into the arena, null terminated
+ * strings that don't fit in a regular chunk get a chunk of their own
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    ArenaChunk *chunk = arena->last;
+    if (chunk == NULL || chunk->size - chunk->used < len + 1) {
+        size_t size = len + 1 > arena->chunk_size ? len + 1 : arena->chunk_size;
+        chunk = malloc(sizeof(ArenaChunk) + size);
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        if (arena->last == NULL) {
+            arena->first = chunk;
+        } else {
+            arena->last->next = chunk;
+        }
+        arena->last = chunk;
+        arena->bytes_reserved += sizeof(ArenaChunk) + size;
+    }
+
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+    arena->bytes_used += len + 1;
+    return copy;
+}
+
+
+/*
+ * free the oldest chunk, once nothing points into it any more. the chunk
+ * being filled is never freed
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the arena has no chunk but the one being filled.
+ */
+int arena_drop_first(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    if (chunk == NULL || chunk == arena->last) {
+        return 1;
+    }
+    arena->first = chunk->next;
+    arena->bytes_used -= chunk->used;
+    arena->bytes_reserved -= sizeof(ArenaChunk) + chunk->size;
+    free(chunk);
+    return 0;
+}
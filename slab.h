@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+// fixed size object allocator: objects are carved out of large chunks and
+// never freed individually. callers serialize access to one Slab.
+typedef struct slab {
+    size_t obj_size;
+    size_t per_chunk; // objects per chunk
+    char *chunk; // chunk currently being carved up
+    size_t chunk_used; // objects handed out from the current chunk
+    size_t num_chunks;
+    size_t num_objs;
+} Slab;
+
+// append-only byte arena for variable length data (post bodies). strings
+// are packed back to back into chunks, oldest chunk first; only the
+// oldest chunk can be freed, once its strings have been moved elsewhere.
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct arena {
+    ArenaChunk *first;
+    ArenaChunk *last;
+    size_t chunk_size;
+    size_t bytes_used; // bytes handed out
+    size_t bytes_reserved; // bytes in all chunks, headers included
+} Arena;
+
+void slab_init(Slab *slab, size_t obj_size, size_t per_chunk);
+
+void *slab_alloc(Slab *slab);
+
+size_t slab_bytes(const Slab *slab);
+
+void arena_init(Arena *arena, size_t chunk_size);
+
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+int arena_drop_first(Arena *arena);
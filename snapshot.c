@@ -0,0 +1,249 @@
+#include "snapshot.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+
+// write the zeros that pad a section of len bytes to a multiple of 8
+static int write_padding(FILE *out, size_t len) {
+    static const char zeros[8];
+    size_t pad = ALIGN8(len) - len;
+    return pad > 0 && fwrite(zeros, 1, pad, out) != pad;
+}
+
+
+/*
+ * write a snapshot of every user, friendship and post to path (through a
+ * temporary file that is renamed over it once complete). takes no locks, so
+ * it is meant to run in a child forked with the store locked, or with
+ * nothing else touching the store. journal_lsn is the lsn of the last
+ * journal record covered by the store as it is now, so a replay on top of
+ * the snapshot can skip everything up to it.
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the file couldn't be written.
+ */
+int snapshot_write(const char *path, uint64_t journal_lsn) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    // first pass: section sizes
+    SnapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_users = user_count();
+    header.journal_lsn = journal_lsn;
+    for (uint32_t id = 0; id < header.num_users; id++) {
+        const User *user = find_user_by_id(id);
+        header.num_friend_ids += user->friends.count;
+        header.num_posts += user->posts.count;
+        for (unsigned int i = 0; i < user->posts.count; i++) {
+            header.bodies_len += user->posts.items[i]->length + 1;
+        }
+    }
+    header.users_off = ALIGN8(sizeof(SnapHeader));
+    header.friends_off = header.users_off + ALIGN8(sizeof(SnapUser) * header.num_users);
+    header.posts_off = header.friends_off + ALIGN8(sizeof(uint32_t) * header.num_friend_ids);
+    header.bodies_off = header.posts_off + ALIGN8(sizeof(SnapPost) * header.num_posts);
+    int err = fwrite(&header, sizeof(header), 1, out) != 1 || write_padding(out, sizeof(header));
+
+    // users
+    uint64_t next_friend = 0;
+    uint64_t next_post = 0;
+    for (uint32_t id = 0; id < header.num_users && !err; id++) {
+        const User *user = find_user_by_id(id);
+        SnapUser snap_user;
+        memset(&snap_user, 0, sizeof(snap_user));
+        memcpy(snap_user.name, user->name, MAX_NAME);
+        snap_user.first_friend = next_friend;
+        snap_user.num_friends = user->friends.count;
+        snap_user.first_post = next_post;
+        snap_user.num_posts = user->posts.count;
+        next_friend += snap_user.num_friends;
+        next_post += snap_user.num_posts;
+        err = fwrite(&snap_user, sizeof(snap_user), 1, out) != 1;
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(SnapUser) * header.num_users);
+    }
+
+    // friend ids
+    for (uint32_t id = 0; id < header.num_users && !err; id++) {
+        const FriendSet *set = &find_user_by_id(id)->friends;
+        err = set->count > 0 && fwrite(set->ids, sizeof(uint32_t), set->count, out) != set->count;
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(uint32_t) * header.num_friend_ids);
+    }
+
+    // posts (oldest first, as users keep them), then bodies in the same order
+    uint64_t body_off = 0;
+    for (uint32_t id = 0; id < header.num_users && !err; id++) {
+        const PostList *list = &find_user_by_id(id)->posts;
+        Post *const *posts = list->items;
+        for (uint32_t i = 0; i < list->count && !err; i++) {
+            SnapPost snap_post;
+            memset(&snap_post, 0, sizeof(snap_post));
+            snap_post.date = posts[i]->date;
+            snap_post.body_off = body_off;
+            snap_post.author_id = posts[i]->author_id;
+            snap_post.body_len = posts[i]->length;
+            memcpy(snap_post.date_text, posts[i]->date_text, DATE_SIZE);
+            body_off += snap_post.body_len + 1;
+            err = fwrite(&snap_post, sizeof(snap_post), 1, out) != 1;
+        }
+    }
+    if (!err) {
+        err = write_padding(out, sizeof(SnapPost) * header.num_posts);
+    }
+    // spilled bodies are read back into buf, grown to the longest one
+    char *buf = NULL;
+    size_t buf_size = 0;
+    for (uint32_t id = 0; id < header.num_users && !err; id++) {
+        const PostList *list = &find_user_by_id(id)->posts;
+        for (uint32_t i = 0; i < list->count && !err; i++) {
+            const Post *post = list->items[i];
+            size_t len = post->length + 1;
+            if (post->contents == NULL && len > buf_size) {
+                free(buf);
+                buf_size = len * 2;
+                buf = malloc(buf_size);
+                if (buf == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+            }
+            err = fwrite(post_body(post, buf), 1, len, out) != len;
+        }
+    }
+    free(buf);
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        err = 1;
+    }
+    if (fclose(out) != 0 || err) {
+        perror(tmp_path);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+// check that a section of count items of size bytes at off fits in the file
+static int section_ok(uint64_t off, uint64_t count, uint64_t size, uint64_t file_size) {
+    return off % 8 == 0 && off <= file_size && count <= (file_size - off) / size;
+}
+
+
+/*
+ * load a snapshot written by snapshot_write into an empty store. the file
+ * is mmap'd and stays mapped for good: post bodies are used in place
+ * rather than copied. sets *journal_lsn to the lsn of the last journal
+ * record the snapshot includes.
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the file can't be read or isn't a valid snapshot.
+ *   - 2 if the store isn't empty.
+ */
+int snapshot_load(const char *path, User **user_list_ptr, uint64_t *journal_lsn) {
+    if (user_count() != 0) {
+        return 2;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapHeader)) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        close(fd);
+        return 1;
+    }
+    uint64_t file_size = st.st_size;
+    const char *base = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void *)base, file_size, MADV_SEQUENTIAL);
+
+    const SnapHeader *header = (const SnapHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION
+        || !section_ok(header->users_off, header->num_users, sizeof(SnapUser), file_size)
+        || !section_ok(header->friends_off, header->num_friend_ids, sizeof(uint32_t), file_size)
+        || !section_ok(header->posts_off, header->num_posts, sizeof(SnapPost), file_size)
+        || !section_ok(header->bodies_off, header->bodies_len, 1, file_size)
+        || (header->bodies_len > 0 && base[header->bodies_off + header->bodies_len - 1] != '\0')) {
+        fprintf(stderr, "%s: not a valid snapshot\n", path);
+        munmap((void *)base, file_size);
+        return 1;
+    }
+    const SnapUser *users = (const SnapUser *)(base + header->users_off);
+    const uint32_t *friend_ids = (const uint32_t *)(base + header->friends_off);
+    const SnapPost *posts = (const SnapPost *)(base + header->posts_off);
+    const char *bodies = base + header->bodies_off;
+
+    // users first, so every id in the friend lists and posts exists
+    for (uint32_t id = 0; id < header->num_users; id++) {
+        char name[MAX_NAME];
+        memcpy(name, users[id].name, MAX_NAME);
+        name[MAX_NAME - 1] = '\0';
+        if (create_user(name, user_list_ptr) != 0 || find_user_by_id(id) == NULL) {
+            fprintf(stderr, "%s: bad user %u\n", path, id);
+            return 1;
+        }
+    }
+
+    for (uint32_t id = 0; id < header->num_users; id++) {
+        const SnapUser *snap_user = &users[id];
+        User *user = find_user_by_id(id);
+        if (snap_user->first_friend > header->num_friend_ids
+            || snap_user->num_friends > header->num_friend_ids - snap_user->first_friend
+            || snap_user->first_post > header->num_posts
+            || snap_user->num_posts > header->num_posts - snap_user->first_post
+            || restore_friends(user, friend_ids + snap_user->first_friend, snap_user->num_friends) != 0) {
+            fprintf(stderr, "%s: bad user %u\n", path, id);
+            return 1;
+        }
+
+        const SnapPost *snap_post = posts + snap_user->first_post;
+        for (uint32_t i = 0; i < snap_user->num_posts; i++, snap_post++) {
+            if (snap_post->body_off >= header->bodies_len
+                || snap_post->body_len >= header->bodies_len - snap_post->body_off
+                || bodies[snap_post->body_off + snap_post->body_len] != '\0'
+                || restore_post(user, snap_post->author_id, snap_post->date,
+                                snap_post->date_text, bodies + snap_post->body_off) != 0) {
+                fprintf(stderr, "%s: bad post %lu\n", path, (unsigned long)(snap_post - posts));
+                return 1;
+            }
+        }
+    }
+    restore_feeds();
+    *journal_lsn = header->journal_lsn;
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include "friends.h"
+
+#define SNAPSHOT_MAGIC "FRIENDS\x01"
+#define SNAPSHOT_VERSION 2
+
+/*
+ * snapshot file layout. everything refers to everything else by user id or
+ * by offset, never by pointer, so a snapshot can be mmap'd and used as is:
+ *
+ *   SnapHeader
+ *   SnapUser[num_users]        in id order
+ *   uint32_t[num_friend_ids]   every user's sorted friend ids, back to back
+ *   SnapPost[num_posts]        every user's posts, oldest first, back to back
+ *   char[bodies_len]           null terminated post bodies
+ *
+ * all integers are in host byte order, and every section starts 8 byte aligned.
+ */
+typedef struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_users;
+    uint64_t num_friend_ids;
+    uint64_t num_posts;
+    uint64_t users_off;
+    uint64_t friends_off;
+    uint64_t posts_off;
+    uint64_t bodies_off;
+    uint64_t bodies_len;
+    uint64_t journal_lsn; // the last journal record the snapshot includes
+} SnapHeader;
+
+typedef struct snap_user {
+    char name[MAX_NAME];
+    uint64_t first_friend; // index into the friend ids
+    uint64_t first_post; // index into the posts
+    uint32_t num_friends;
+    uint32_t num_posts;
+} SnapUser;
+
+typedef struct snap_post {
+    int64_t date;
+    uint64_t body_off; // offset into the bodies
+    uint32_t author_id;
+    uint32_t body_len; // not counting the null terminator
+    char date_text[DATE_SIZE];
+} SnapPost;
+
+int snapshot_write(const char *path, uint64_t journal_lsn);
+
+int snapshot_load(const char *path, User **user_list_ptr, uint64_t *journal_lsn);
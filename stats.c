@@ -0,0 +1,265 @@
+#include "friends.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "search.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#define REPORT_SIZE 2048
+
+
+/*
+ * every thread counts into its own ThreadStats (no sharing, no atomic read
+ * modify writes on the hot path), and the reports add up all of them. a
+ * thread is the only writer of its counters, so it updates them with plain
+ * relaxed stores; readers use relaxed loads and may see a count a moment
+ * old, which is fine for metrics.
+ */
+typedef struct thread_stats {
+    uint64_t latency[NUM_STAT_COMMANDS][STAT_BUCKETS];
+    uint64_t max_latency[NUM_STAT_COMMANDS];
+    uint64_t counters[NUM_STAT_COUNTERS];
+    struct thread_stats *next;
+} ThreadStats;
+
+static const char *command_names[NUM_STAT_COMMANDS] = {
+    "login", "list_users", "make_friends", "post", "profile", "posts", "feed", "mutual", "suggest",
+    "distance", "search", "ping", "admin", "invalid"
+};
+
+static const char *counter_names[NUM_STAT_COUNTERS] = {
+    "bytes_in", "bytes_out", "accepted", "closed", "wakeups", "syscalls"
+};
+
+static ThreadStats *all_stats; // every thread's stats, newest first
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadStats *local_stats;
+static uint64_t start_time;
+
+
+// this thread's stats, created and registered on first use
+static ThreadStats *get_local_stats(void) {
+    if (local_stats == NULL) {
+        local_stats = calloc(1, sizeof(ThreadStats));
+        if (local_stats == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        pthread_mutex_lock(&all_stats_lock);
+        if (start_time == 0) {
+            start_time = stats_now();
+        }
+        local_stats->next = all_stats;
+        __atomic_store_n(&all_stats, local_stats, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&all_stats_lock);
+    }
+    return local_stats;
+}
+
+
+static int bucket_index(uint64_t value) {
+    if (value < 16) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+
+// the smallest value that lands in the bucket
+static uint64_t bucket_value(int index) {
+    if (index < 16) {
+        return index;
+    }
+    int msb = index / 16 + 3;
+    return (uint64_t)(16 + index % 16) << (msb - 4);
+}
+
+
+static inline void bump(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * return the kind a command is timed as
+ */
+StatCommand stats_command_kind(CommandId id) {
+    switch (id) {
+    case CMD_LIST_USERS:
+        return STAT_LIST_USERS;
+    case CMD_MAKE_FRIENDS:
+        return STAT_MAKE_FRIENDS;
+    case CMD_POST:
+        return STAT_POST;
+    case CMD_PROFILE:
+        return STAT_PROFILE;
+    case CMD_POSTS:
+        return STAT_POSTS;
+    case CMD_FEED:
+        return STAT_FEED;
+    case CMD_MUTUAL:
+        return STAT_MUTUAL;
+    case CMD_SUGGEST:
+        return STAT_SUGGEST;
+    case CMD_DISTANCE:
+    case CMD_PATH:
+        return STAT_DISTANCE;
+    case CMD_SEARCH:
+        return STAT_SEARCH;
+    case CMD_PING:
+        return STAT_PING;
+    case CMD_MEMORY:
+    case CMD_CACHE:
+    case CMD_SNAPSHOT:
+    case CMD_STATS:
+        return STAT_ADMIN;
+    default:
+        return STAT_INVALID;
+    }
+}
+
+
+/*
+ * count one command of the given kind that took the given time
+ */
+void stats_record(StatCommand command, uint64_t nanoseconds) {
+    ThreadStats *stats = get_local_stats();
+    bump(&stats->latency[command][bucket_index(nanoseconds)], 1);
+    if (nanoseconds > stats->max_latency[command]) {
+        __atomic_store_n(&stats->max_latency[command], nanoseconds, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * add to one of the plain counters
+ */
+void stats_add(StatCounter counter, uint64_t amount) {
+    bump(&get_local_stats()->counters[counter], amount);
+}
+
+
+/*
+ * return a monotonic time in nanoseconds, for timing commands
+ */
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// the value at the given quantile (0..1) of a histogram with total values
+static uint64_t quantile(const uint64_t *buckets, uint64_t total, uint64_t max, double q) {
+    uint64_t rank = ceil(q * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            // the middle of the bucket, but never past the largest value seen
+            uint64_t mid = (bucket_value(i) + bucket_value(i + 1)) / 2;
+            return mid < max ? mid : max;
+        }
+    }
+    return max;
+}
+
+
+/*
+ * return a report of every counter, the store sizes, and the count and
+ * latency percentiles (in microseconds) of every kind of command, summed
+ * over all threads
+ */
+char *stats_report(void) {
+    uint64_t (*latency)[STAT_BUCKETS] = calloc(NUM_STAT_COMMANDS, sizeof(*latency));
+    if (latency == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    uint64_t max_latency[NUM_STAT_COMMANDS] = {0};
+    uint64_t counters[NUM_STAT_COUNTERS] = {0};
+    for (ThreadStats *stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); stats != NULL; stats = stats->next) {
+        for (int cmd = 0; cmd < NUM_STAT_COMMANDS; cmd++) {
+            for (int i = 0; i < STAT_BUCKETS; i++) {
+                latency[cmd][i] += __atomic_load_n(&stats->latency[cmd][i], __ATOMIC_RELAXED);
+            }
+            uint64_t max = __atomic_load_n(&stats->max_latency[cmd], __ATOMIC_RELAXED);
+            if (max > max_latency[cmd]) {
+                max_latency[cmd] = max;
+            }
+        }
+        for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+            counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    unsigned long users, friendships, posts;
+    store_counts(&users, &friendships, &posts);
+    uint64_t started = __atomic_load_n(&start_time, __ATOMIC_RELAXED);
+
+    StrBuf report;
+    sb_init(&report, REPORT_SIZE);
+    char line[256];
+    snprintf(line, sizeof(line), "Stats\n\tuptime: %.1f s\n\tconnections: %lu active\n",
+             started == 0 ? 0 : (stats_now() - started) / 1e9,
+             (unsigned long)(counters[STAT_ACCEPTED] - counters[STAT_CLOSED]));
+    sb_puts(&report, line);
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        snprintf(line, sizeof(line), "\t%s: %lu\n", counter_names[i], (unsigned long)counters[i]);
+        sb_puts(&report, line);
+    }
+    snprintf(line, sizeof(line), "\tstore: %lu users, %lu friendships, %lu posts\n", users, friendships, posts);
+    sb_puts(&report, line);
+    unsigned long terms, postings, index_bytes;
+    search_counts(&terms, &postings, &index_bytes);
+    snprintf(line, sizeof(line), "\tsearch index: %lu terms, %lu postings, %lu bytes\n",
+             terms, postings, index_bytes);
+    sb_puts(&report, line);
+    for (int cmd = 0; cmd < NUM_STAT_COMMANDS; cmd++) {
+        uint64_t count = 0;
+        for (int i = 0; i < STAT_BUCKETS; i++) {
+            count += latency[cmd][i];
+        }
+        snprintf(line, sizeof(line),
+                 "\t%s: %lu, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+                 command_names[cmd], (unsigned long)count,
+                 quantile(latency[cmd], count, max_latency[cmd], 0.5) / 1e3,
+                 quantile(latency[cmd], count, max_latency[cmd], 0.99) / 1e3,
+                 quantile(latency[cmd], count, max_latency[cmd], 0.999) / 1e3,
+                 max_latency[cmd] / 1e3);
+        sb_puts(&report, line);
+    }
+    free(latency);
+    return sb_finish(&report);
+}
+
+
+/*
+ * write stats_report to path, through a temporary file renamed over it so
+ * readers never see a half written report
+ *
+ * return:
+ *   - 0 on success.
+ *   - 1 if the file couldn't be written.
+ */
+int stats_dump(const char *path) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return 1;
+    }
+    char *report = stats_report();
+    int err = fputs(report, out) == EOF;
+    free(report);
+    if (fclose(out) != 0 || err || rename(tmp_path, path) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
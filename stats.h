@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include "command.h"
+
+// the commands timed separately, see stats_command_kind
+typedef enum stat_command {
+    STAT_LOGIN,
+    STAT_LIST_USERS,
+    STAT_MAKE_FRIENDS,
+    STAT_POST,
+    STAT_PROFILE,
+    STAT_POSTS,
+    STAT_FEED,
+    STAT_MUTUAL,
+    STAT_SUGGEST,
+    STAT_DISTANCE, // distance and path
+    STAT_SEARCH,
+    STAT_PING,
+    STAT_ADMIN, // memory, cache, snapshot, stats
+    STAT_INVALID,
+    NUM_STAT_COMMANDS
+} StatCommand;
+
+// the plain counters
+typedef enum stat_counter {
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_ACCEPTED,
+    STAT_CLOSED,
+    STAT_WAKEUPS,
+    STAT_SYSCALLS, // made by the event loops to wait, accept, read, write and close
+    NUM_STAT_COUNTERS
+} StatCounter;
+
+// 16 linear sub-buckets per power of two (in nanoseconds), so a latency is
+// known to within about 6%
+#define STAT_BUCKETS 1024
+
+StatCommand stats_command_kind(CommandId id);
+
+void stats_record(StatCommand command, uint64_t nanoseconds);
+
+void stats_add(StatCounter counter, uint64_t amount);
+
+uint64_t stats_now(void);
+
+char *stats_report(void);
+
+int stats_dump(const char *path);
@@ -0,0 +1,73 @@
+#include "strbuf.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/*
+ * set up an empty buffer with room for cap characters
+ */
+void sb_init(StrBuf *sb, size_t cap) {
+    sb->cap = cap < 16 ? 16 : cap;
+    sb->data = malloc(sb->cap + 1);
+    if (sb->data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sb->len = 0;
+    sb->data[0] = '\0';
+}
+
+
+/*
+ * make room for len more bytes, doubling the buffer when it runs out of
+ * room, and return where they go. they count as appended, so the caller
+ * must fill them in
+ */
+char *sb_extend(StrBuf *sb, size_t len) {
+    if (sb->len + len > sb->cap) {
+        size_t cap = sb->cap * 2;
+        while (cap < sb->len + len) {
+            cap *= 2;
+        }
+        char *data = realloc(sb->data, cap + 1);
+        if (data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        sb->data = data;
+        sb->cap = cap;
+    }
+    char *dest = sb->data + sb->len;
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return dest;
+}
+
+
+/*
+ * append len bytes of str
+ */
+void sb_append(StrBuf *sb, const char *str, size_t len) {
+    memcpy(sb_extend(sb, len), str, len);
+}
+
+
+/*
+ * append a null terminated string
+ */
+void sb_puts(StrBuf *sb, const char *str) {
+    sb_append(sb, str, strlen(str));
+}
+
+
+/*
+ * return the built string (the caller frees it), leaving sb empty
+ */
+char *sb_finish(StrBuf *sb) {
+    char *data = sb->data;
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    return data;
+}
@@ -0,0 +1,19 @@
+#include <stddef.h>
+
+// growable, always null terminated output buffer, for building responses
+// in one pass without sizing them first
+typedef struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+void sb_init(StrBuf *sb, size_t cap);
+
+char *sb_extend(StrBuf *sb, size_t len);
+
+void sb_append(StrBuf *sb, const char *str, size_t len);
+
+void sb_puts(StrBuf *sb, const char *str);
+
+char *sb_finish(StrBuf *sb);
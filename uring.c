@@ -0,0 +1,404 @@
+#include "uring.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/*
+ * io_uring without liburing: the rings are mmap'd from the fd that
+ * io_uring_setup returns, sqes are filled in at the submission tail and
+ * handed to the kernel in one io_uring_enter per loop turn, and
+ * completions are read off the completion head. only one thread ever uses
+ * a ring, so the kernel is told so (SINGLE_ISSUER), and completion work is
+ * left until the thread asks for completions (DEFER_TASKRUN) rather than
+ * interrupting it, where the kernel supports that.
+ */
+#define URING_CQ_FACTOR 4 // completions per sqe: multishot ops post many
+
+
+static int sys_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                     void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+
+static int sys_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+ * set up a ring of entries sqes, and register buf_count (a power of two)
+ * provided buffers of buf_size bytes for multishot receives
+ *
+ * return:
+ *   - 0 on success.
+ *   - -1 (with errno set) if the kernel can't give us such a ring.
+ */
+int uring_init(Uring *ring, unsigned int entries, unsigned int buf_count, unsigned int buf_size) {
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER
+                   | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * URING_CQ_FACTOR;
+    int fd = sys_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        // older kernels: without the single issuer optimizations
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * URING_CQ_FACTOR;
+        fd = sys_setup(entries, &params);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    ring->fd = fd;
+    // waiting with a timeout needs EXT_ARG, and dropped completions would
+    // lose multishot results
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        uring_free(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_free(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    // sqes are always used in order, so the index array is set up once
+    unsigned int *array = (unsigned int *)(sq + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // the provided buffer ring, and the buffers right behind it
+    size_t ring_bytes = (sizeof(struct io_uring_buf) * buf_count + 4095) & ~(size_t)4095;
+    ring->bufs_size = ring_bytes + (size_t)buf_count * buf_size;
+    void *mem = mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        uring_free(ring);
+        return -1;
+    }
+    ring->buf_ring = mem;
+    ring->bufs = (char *)mem + ring_bytes;
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_free(ring);
+        return -1;
+    }
+    for (unsigned int bid = 0; bid < buf_count; bid++) {
+        uring_recycle(ring, bid);
+    }
+    return 0;
+}
+
+
+/*
+ * tear a ring down, unmapping whatever uring_init got to
+ */
+void uring_free(Uring *ring) {
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->bufs_size);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->backlog);
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+
+/*
+ * check that the kernel does everything the server's io_uring loop needs,
+ * multishot receives into provided buffers being the newest of it: set up
+ * a ring, and receive one byte through a socket pair with it
+ *
+ * return 1 if it does, 0 if the server should stay with epoll
+ */
+int uring_supported(void) {
+    Uring ring;
+    if (uring_init(&ring, 8, 8, 64) != 0) {
+        return 0;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        uring_free(&ring);
+        return 0;
+    }
+
+    int supported = 0;
+    uring_prep_recv(uring_sqe(&ring), pair[0], 1);
+    if (write(pair[1], "x", 1) == 1 && uring_enter(&ring, 1, 1000) == 0) {
+        struct io_uring_cqe *cqe = uring_next_cqe(&ring);
+        supported = cqe != NULL && cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER)
+                    && (cqe->flags & IORING_CQE_F_MORE);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    uring_free(&ring);
+    return supported;
+}
+
+
+// whether the submission queue has room for one more sqe
+static int sq_has_room(Uring *ring) {
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+    return tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) <= ring->sq_mask;
+}
+
+
+// move as much of the backlog into the submission queue as fits
+static void backlog_flush(Uring *ring) {
+    unsigned int moved = 0;
+    while (moved < ring->backlog_count && sq_has_room(ring)) {
+        unsigned int tail = *ring->sq_tail + ring->sq_pending;
+        ring->sqes[tail & ring->sq_mask] = ring->backlog[moved++];
+        ring->sq_pending++;
+    }
+    memmove(ring->backlog, ring->backlog + moved,
+            sizeof(struct io_uring_sqe) * (ring->backlog_count - moved));
+    ring->backlog_count -= moved;
+}
+
+
+/*
+ * return a zeroed sqe at the submission tail, submitting what is pending
+ * first if the queue is full. if the kernel doesn't take any of it (until
+ * completions are reaped), the sqe is kept in the backlog instead, behind
+ * any already there. it goes to the kernel with the next uring_enter
+ */
+struct io_uring_sqe *uring_sqe(Uring *ring) {
+    if (ring->backlog_count == 0 && !sq_has_room(ring)) {
+        uring_enter(ring, 0, 0);
+    }
+    struct io_uring_sqe *sqe;
+    if (ring->backlog_count == 0 && sq_has_room(ring)) {
+        sqe = &ring->sqes[(*ring->sq_tail + ring->sq_pending) & ring->sq_mask];
+        ring->sq_pending++;
+    } else {
+        if (ring->backlog_count == ring->backlog_cap) {
+            unsigned int cap = ring->backlog_cap == 0 ? ring->sq_mask + 1 : ring->backlog_cap * 2;
+            struct io_uring_sqe *backlog = realloc(ring->backlog, sizeof(struct io_uring_sqe) * cap);
+            if (backlog == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            ring->backlog = backlog;
+            ring->backlog_cap = cap;
+        }
+        sqe = &ring->backlog[ring->backlog_count++];
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+/*
+ * submit every pending sqe and, if wait is set, wait until there is at
+ * least one completion or timeout_ms have passed (-1 to wait for good),
+ * all in one syscall
+ *
+ * return:
+ *   - 0 on success (including a timeout or a signal while waiting).
+ *   - -1 (with errno set) if the ring is broken.
+ */
+int uring_enter(Uring *ring, int wait, int timeout_ms) {
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    while (1) {
+        backlog_flush(ring);
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+        // everything the kernel hasn't taken, including what an earlier
+        // call left behind
+        unsigned int to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int submitted = sys_enter(ring->fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+        ring->syscalls++;
+        if (submitted < 0) {
+            if (errno == ETIME || errno == EINTR) {
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EBUSY) {
+                // no room for more in flight right now: the rest go in
+                // once the caller has reaped completions
+                return 0;
+            }
+            return -1;
+        }
+        // with room made, submit the backlog too, without waiting again
+        if (ring->backlog_count == 0 || submitted == 0) {
+            return 0;
+        }
+        wait = 0;
+        flags &= ~IORING_ENTER_GETEVENTS;
+    }
+}
+
+
+/*
+ * return the oldest completion not seen yet, or NULL if there is none
+ * (call uring_cqe_seen once done with it)
+ */
+struct io_uring_cqe *uring_next_cqe(Uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+
+/*
+ * hand the completion uring_next_cqe returned back to the kernel
+ */
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * return the provided buffer with this id (a completion's
+ * flags >> IORING_CQE_BUFFER_SHIFT)
+ */
+char *uring_buf(Uring *ring, unsigned int bid) {
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+
+/*
+ * give a provided buffer back to the kernel once its data has been used
+ */
+void uring_recycle(Uring *ring, unsigned int bid) {
+    struct io_uring_buf_ring *br = ring->buf_ring;
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+
+/*
+ * accept connections on the listening socket fd until cancelled, one
+ * completion (with the new fd as its result) per connection
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+
+/*
+ * receive from fd until cancelled, each completion carrying one provided
+ * buffer of data (0 bytes at the end of the stream)
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = user_data;
+}
+
+
+/*
+ * send what msg gathers to fd (which must stay untouched until it
+ * completes), without a SIGPIPE if the peer is gone
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+
+/*
+ * cancel the operation submitted with user_data target
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,73 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// a minimal io_uring for one thread, set up and driven with the raw
+// syscalls: a submission and a completion queue, plus one ring of provided
+// buffers that multishot receives pick their buffers from
+typedef struct uring {
+    int fd;
+    // submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending; // sqes filled in but not submitted yet
+    // sqes that didn't fit in the submission queue, in order; uring_enter
+    // moves them in as the kernel makes room
+    struct io_uring_sqe *backlog;
+    unsigned int backlog_count;
+    unsigned int backlog_cap;
+    // completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    // provided buffers, buf_count of buf_size bytes, in group URING_BUF_GROUP
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned int buf_count;
+    unsigned int buf_size;
+    // mappings, for uring_free
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    size_t bufs_size;
+    unsigned long syscalls; // io_uring_enter calls made, for the caller to reset
+} Uring;
+
+#define URING_BUF_GROUP 0
+
+int uring_init(Uring *ring, unsigned int entries, unsigned int buf_count, unsigned int buf_size);
+
+void uring_free(Uring *ring);
+
+int uring_supported(void);
+
+struct io_uring_sqe *uring_sqe(Uring *ring);
+
+int uring_enter(Uring *ring, int wait, int timeout_ms);
+
+struct io_uring_cqe *uring_next_cqe(Uring *ring);
+
+void uring_cqe_seen(Uring *ring);
+
+char *uring_buf(Uring *ring, unsigned int bid);
+
+void uring_recycle(Uring *ring, unsigned int bid);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data);
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data);
+
+#endif